@@ -0,0 +1,919 @@
+/* Native versions of the hot loops of dxr.lines
+
+Turning a file's refs and regions into balanced, per-line tags is the
+busiest loop of indexing, and it runs for every line of every file.
+Turning them back into HTML is most of the CPU time of serving a big file.
+These are drop-in replacements for the pure-Python implementations in
+dxr/lines.py, which remain the reference: for the same input, these must
+give the same output, down to the order of dict insertions, so what we send
+to elasticsearch is byte-for-byte the same. dxr.lines falls back to the
+Python if this module isn't built.
+
+Within this file, as in dxr/lines.py, "tag" means a tuple of (file-wide
+offset, is_start, payload).
+
+*/
+#include <Python.h>
+
+static PyObject *sort_order_str, *es_str, *payload_str, *start_str, *end_str;
+static PyObject *opener_str, *closer_str;
+static PyObject *zero, *minus_one;
+static PyObject *nesting_order_func;  /* our own nesting_order(), as a key */
+
+/* Return a new (point, is_start, payload) tuple. */
+static PyObject *
+make_tag(PyObject *point, int is_start, PyObject *payload)
+{
+    return PyTuple_Pack(3, point, is_start ? Py_True : Py_False, payload);
+}
+
+/* Pull apart a tag into borrowed references. Return 0 and set an exception
+   if it isn't one. */
+static int
+unpack_tag(PyObject *tag, PyObject **point, int *is_start, PyObject **payload)
+{
+    int truth;
+    if (!PyTuple_Check(tag) || PyTuple_GET_SIZE(tag) != 3) {
+        PyErr_SetString(PyExc_TypeError,
+                        "tags must be (point, is_start, payload) tuples");
+        return 0;
+    }
+    truth = PyObject_IsTrue(PyTuple_GET_ITEM(tag, 1));
+    if (truth < 0)
+        return 0;
+    *point = PyTuple_GET_ITEM(tag, 0);
+    *is_start = truth;
+    *payload = PyTuple_GET_ITEM(tag, 2);
+    return 1;
+}
+
+/* Append a new reference to a list, consuming it. */
+static int
+append_new(PyObject *list, PyObject *item)
+{
+    int ret;
+    if (!item)
+        return -1;
+    ret = PyList_Append(list, item);
+    Py_DECREF(item);
+    return ret;
+}
+
+/* Pop the last item of a list, returning a new reference. */
+static PyObject *
+list_pop(PyObject *list)
+{
+    Py_ssize_t n = PyList_GET_SIZE(list);
+    PyObject *item;
+    if (!n) {
+        PyErr_SetString(PyExc_IndexError, "pop from empty list");
+        return NULL;
+    }
+    item = PyList_GET_ITEM(list, n - 1);
+    Py_INCREF(item);
+    if (PyList_SetSlice(list, n - 1, n, NULL) < 0) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+
+/* nesting_order */
+
+static PyObject *
+nesting_order(PyObject *self, PyObject *tag)
+{
+    PyObject *point, *payload, *order, *key, *ret;
+    int is_start;
+    if (!unpack_tag(tag, &point, &is_start, &payload))
+        return NULL;
+    order = PyObject_GetAttr(payload, sort_order_str);
+    if (!order)
+        return NULL;
+    if (is_start) {
+        key = order;
+    } else {
+        key = PyNumber_Negative(order);
+        Py_DECREF(order);
+        if (!key)
+            return NULL;
+    }
+    ret = PyTuple_Pack(3, point, PyTuple_GET_ITEM(tag, 1), key);
+    Py_DECREF(key);
+    return ret;
+}
+
+
+/* Tag and line boundaries */
+
+/* Like tag_boundaries(), appending to a list. */
+static int
+tag_boundaries(PyObject *spans, PyObject *out)
+{
+    PyObject *iter, *span;
+    iter = PyObject_GetIter(spans);
+    if (!iter)
+        return -1;
+    while ((span = PyIter_Next(iter))) {
+        PyObject *start, *end, *data;
+        int keep;
+        if (!PyArg_ParseTuple(span, "OOO;spans must be (start, end, data)",
+                              &start, &end, &data))
+            goto fail;
+        keep = start != Py_None && end != Py_None;
+        if (keep) {
+            int cmp = PyObject_RichCompareBool(start, minus_one, Py_NE);
+            if (cmp < 0)
+                goto fail;
+            keep = cmp;
+        }
+        if (keep) {
+            int cmp = PyObject_RichCompareBool(end, minus_one, Py_NE);
+            if (cmp < 0)
+                goto fail;
+            keep = cmp;
+        }
+        if (keep) {
+            int cmp = PyObject_RichCompareBool(start, end, Py_LT);
+            if (cmp < 0)
+                goto fail;
+            keep = cmp;
+        }
+        if (keep && (append_new(out, make_tag(start, 1, data)) < 0 ||
+                     append_new(out, make_tag(end, 0, data)) < 0))
+            goto fail;
+        Py_DECREF(span);
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+fail:
+    Py_DECREF(span);
+    Py_DECREF(iter);
+    return -1;
+}
+
+/* Like line_boundaries(), appending to a list. */
+static int
+line_boundaries(PyObject *lines, PyObject *line_payload, PyObject *out)
+{
+    PyObject *iter, *line;
+    Py_ssize_t up_to = 0;
+    iter = PyObject_GetIter(lines);
+    if (!iter)
+        return -1;
+    while ((line = PyIter_Next(iter))) {
+        Py_ssize_t length = PyObject_Length(line);
+        PyObject *point;
+        Py_DECREF(line);
+        if (length < 0)
+            goto fail;
+        up_to += length;
+        point = PyInt_FromSsize_t(up_to);
+        if (!point)
+            goto fail;
+        if (append_new(out, make_tag(point, 0, line_payload)) < 0) {
+            Py_DECREF(point);
+            goto fail;
+        }
+        Py_DECREF(point);
+    }
+    Py_DECREF(iter);
+    return PyErr_Occurred() ? -1 : 0;
+fail:
+    Py_DECREF(iter);
+    return -1;
+}
+
+
+/* remove_overlapping_refs */
+
+static int
+remove_overlapping_refs_impl(PyObject *tags, PyObject *ref_class)
+{
+    PyObject *blacklist, *open_ref = NULL;
+    Py_ssize_t i, j = 0, n = PyList_GET_SIZE(tags);
+
+    blacklist = PySet_New(NULL);
+    if (!blacklist)
+        return -1;
+    for (i = 0; i < n; ++i) {
+        PyObject *tag = PyList_GET_ITEM(tags, i), *point, *payload;
+        int is_start, keep = 1, is_ref;
+        if (!unpack_tag(tag, &point, &is_start, &payload))
+            goto fail;
+        is_ref = PyObject_IsInstance(payload, ref_class);
+        if (is_ref < 0)
+            goto fail;
+        if (is_ref) {
+            int blacklisted = PySet_Contains(blacklist, payload);
+            if (blacklisted < 0)
+                goto fail;
+            if (blacklisted) {
+                /* It's the evil close tag of a misnested tag. */
+                if (PySet_Discard(blacklist, payload) < 0)
+                    goto fail;
+                keep = 0;
+            } else if (!open_ref) {
+                if (!is_start) {
+                    PyErr_SetNone(PyExc_AssertionError);
+                    goto fail;
+                }
+                open_ref = payload;
+            } else if (open_ref == payload) {  /* it's the closer */
+                open_ref = NULL;
+            } else {  /* It's an evil open tag of a misnested tag. */
+                if (PyErr_WarnEx(PyExc_UserWarning,
+                                 "htmlifier plugins requested overlapping "
+                                 "<a> tags. Fix the plugins.", 1) < 0 ||
+                        PySet_Add(blacklist, payload) < 0)
+                    goto fail;
+                keep = 0;
+            }
+        }
+        if (keep) {
+            if (j != i) {
+                Py_INCREF(tag);
+                PyList_SetItem(tags, j, tag);
+            }
+            ++j;
+        }
+    }
+    Py_DECREF(blacklist);
+    return PyList_SetSlice(tags, j, n, NULL);
+fail:
+    Py_DECREF(blacklist);
+    return -1;
+}
+
+static PyObject *
+remove_overlapping_refs(PyObject *self, PyObject *args)
+{
+    PyObject *tags, *ref_class;
+    if (!PyArg_ParseTuple(args, "O!O:remove_overlapping_refs",
+                          &PyList_Type, &tags, &ref_class))
+        return NULL;
+    if (remove_overlapping_refs_impl(tags, ref_class) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+/* balanced_tags */
+
+/* The state of without_empty_tags(), fed one tag at a time */
+typedef struct {
+    PyObject *out;
+    PyObject *buffer;
+    Py_ssize_t depth;
+} EmptyFilter;
+
+static int
+filter_push(EmptyFilter *f, PyObject *point, int is_start, PyObject *payload)
+{
+    if (is_start) {
+        if (append_new(f->buffer, make_tag(point, 1, payload)) < 0)
+            return -1;
+        ++f->depth;
+    } else {
+        Py_ssize_t n = PyList_GET_SIZE(f->buffer);
+        PyObject *top;
+        int cancels = 0;
+        if (!n) {
+            PyErr_SetString(PyExc_IndexError, "list index out of range");
+            return -1;
+        }
+        top = PyList_GET_ITEM(f->buffer, n - 1);
+        if (PyTuple_GET_ITEM(top, 2) == payload) {
+            cancels = PyObject_RichCompareBool(PyTuple_GET_ITEM(top, 0),
+                                               point, Py_EQ);
+            if (cancels < 0)
+                return -1;
+        }
+        if (cancels) {
+            /* It's a closer which, with the last thing in buffer, forms a
+               zero-width span. Cancel them both. */
+            if (PyList_SetSlice(f->buffer, n - 1, n, NULL) < 0)
+                return -1;
+        } else if (append_new(f->buffer, make_tag(point, 0, payload)) < 0) {
+            return -1;
+        }
+        --f->depth;
+
+        /* If we have a balanced set of non-zero-width tags, emit them: */
+        if (!f->depth) {
+            n = PyList_GET_SIZE(f->out);
+            if (PyList_SetSlice(f->out, n, n, f->buffer) < 0 ||
+                    PyList_SetSlice(f->buffer, 0,
+                                    PyList_GET_SIZE(f->buffer), NULL) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Close open tags down to (but not including) the one with the payload
+   ``to``, or all of them if ``to`` is NULL. */
+static int
+close_to(EmptyFilter *f, PyObject *opens, PyObject *closes, PyObject *point,
+         PyObject *to)
+{
+    for (;;) {
+        Py_ssize_t n = PyList_GET_SIZE(opens);
+        PyObject *intermediate;
+        if (to) {
+            if (!n) {
+                PyErr_SetString(PyExc_IndexError, "list index out of range");
+                return -1;
+            }
+            if (PyList_GET_ITEM(opens, n - 1) == to)
+                return 0;
+        } else if (!n) {
+            return 0;
+        }
+        intermediate = list_pop(opens);
+        if (!intermediate)
+            return -1;
+        if (filter_push(f, point, 0, intermediate) < 0 ||
+                PyList_Append(closes, intermediate) < 0) {
+            Py_DECREF(intermediate);
+            return -1;
+        }
+        Py_DECREF(intermediate);
+    }
+}
+
+/* Reopen all temporarily closed tags. */
+static int
+reopen(EmptyFilter *f, PyObject *opens, PyObject *closes, PyObject *point)
+{
+    while (PyList_GET_SIZE(closes)) {
+        PyObject *intermediate = list_pop(closes);
+        if (!intermediate)
+            return -1;
+        if (filter_push(f, point, 1, intermediate) < 0 ||
+                PyList_Append(opens, intermediate) < 0) {
+            Py_DECREF(intermediate);
+            return -1;
+        }
+        Py_DECREF(intermediate);
+    }
+    return 0;
+}
+
+/* balanced_tags(), given a list of sorted tags. Return a new list. */
+static PyObject *
+balanced_tags_impl(PyObject *tags, PyObject *line_payload)
+{
+    EmptyFilter f;
+    PyObject *opens, *closes, *point = zero;
+    Py_ssize_t i, n = PyList_GET_SIZE(tags);
+
+    f.out = PyList_New(0);
+    f.buffer = PyList_New(0);
+    f.depth = 0;
+    opens = PyList_New(0);
+    closes = PyList_New(0);
+    if (!f.out || !f.buffer || !opens || !closes)
+        goto fail;
+
+    if (filter_push(&f, zero, 1, line_payload) < 0)
+        goto fail;
+    for (i = 0; i < n; ++i) {
+        PyObject *payload;
+        int is_start;
+        if (!unpack_tag(PyList_GET_ITEM(tags, i), &point, &is_start, &payload))
+            goto fail;
+        if (is_start) {
+            if (filter_push(&f, point, 1, payload) < 0 ||
+                    PyList_Append(opens, payload) < 0)
+                goto fail;
+        } else if (payload == line_payload) {
+            /* Close all open tags before a line break, and reopen them
+               afterward. */
+            if (close_to(&f, opens, closes, point, NULL) < 0 ||
+                    filter_push(&f, point, 0, line_payload) < 0 ||
+                    filter_push(&f, point, 1, line_payload) < 0 ||
+                    reopen(&f, opens, closes, point) < 0)
+                goto fail;
+        } else {
+            PyObject *popped;
+            if (close_to(&f, opens, closes, point, payload) < 0 ||
+                    filter_push(&f, point, 0, payload) < 0)
+                goto fail;
+            popped = list_pop(opens);
+            if (!popped)
+                goto fail;
+            Py_DECREF(popped);
+            if (reopen(&f, opens, closes, point) < 0)
+                goto fail;
+        }
+    }
+    if (filter_push(&f, point, 0, line_payload) < 0)
+        goto fail;
+
+    Py_DECREF(f.buffer);
+    Py_DECREF(opens);
+    Py_DECREF(closes);
+    return f.out;
+fail:
+    Py_XDECREF(f.out);
+    Py_XDECREF(f.buffer);
+    Py_XDECREF(opens);
+    Py_XDECREF(closes);
+    return NULL;
+}
+
+
+/* finished_tags */
+
+static PyObject *
+finished_tags(PyObject *self, PyObject *args)
+{
+    PyObject *lines, *spans, *line_payload, *ref_class;
+    PyObject *tags, *sort, *sort_args = NULL, *sort_kwargs = NULL, *sorted;
+    PyObject *ret;
+
+    if (!PyArg_ParseTuple(args, "OOOO:finished_tags",
+                          &lines, &spans, &line_payload, &ref_class))
+        return NULL;
+    tags = PyList_New(0);
+    if (!tags)
+        return NULL;
+    if (tag_boundaries(spans, tags) < 0 ||
+            line_boundaries(lines, line_payload, tags) < 0)
+        goto fail;
+
+    /* tags.sort(key=nesting_order). It's stable, like sorted(). */
+    sort = PyObject_GetAttrString(tags, "sort");
+    sort_args = PyTuple_New(0);
+    sort_kwargs = Py_BuildValue("{s:O}", "key", nesting_order_func);
+    if (!sort || !sort_args || !sort_kwargs) {
+        Py_XDECREF(sort);
+        goto fail;
+    }
+    sorted = PyObject_Call(sort, sort_args, sort_kwargs);
+    Py_DECREF(sort);
+    if (!sorted)
+        goto fail;
+    Py_DECREF(sorted);
+
+    if (remove_overlapping_refs_impl(tags, ref_class) < 0)
+        goto fail;
+    ret = balanced_tags_impl(tags, line_payload);
+    Py_DECREF(tags);
+    Py_DECREF(sort_args);
+    Py_DECREF(sort_kwargs);
+    return ret;
+fail:
+    Py_DECREF(tags);
+    Py_XDECREF(sort_args);
+    Py_XDECREF(sort_kwargs);
+    return NULL;
+}
+
+
+/* es_lines */
+
+/* Turn one line's {payload: {'start': x, 'end': y}} into a list of ES index
+   objects, in the dict's own order. */
+static PyObject *
+es_line(PyObject *payloads)
+{
+    PyObject *ret, *payload, *pos;
+    Py_ssize_t i = 0;
+
+    ret = PyList_New(0);
+    if (!ret)
+        return NULL;
+    while (PyDict_Next(payloads, &i, &payload, &pos)) {
+        PyObject *obj, *es, *start, *end;
+        es = PyObject_CallMethodObjArgs(payload, es_str, NULL);
+        if (!es)
+            goto fail;
+        start = PyObject_GetItem(pos, start_str);
+        end = start ? PyObject_GetItem(pos, end_str) : NULL;
+        obj = end ? PyDict_New() : NULL;
+        if (!obj ||
+                PyDict_SetItem(obj, payload_str, es) < 0 ||
+                PyDict_SetItem(obj, start_str, start) < 0 ||
+                PyDict_SetItem(obj, end_str, end) < 0) {
+            Py_DECREF(es);
+            Py_XDECREF(start);
+            Py_XDECREF(end);
+            Py_XDECREF(obj);
+            goto fail;
+        }
+        Py_DECREF(es);
+        Py_DECREF(start);
+        Py_DECREF(end);
+        if (append_new(ret, obj) < 0)
+            goto fail;
+    }
+    return ret;
+fail:
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/* Call per_line(list of index objects) for each line of balanced tags, and
+   append what it returns to a new list. */
+static PyObject *
+map_es_lines(PyObject *tags, PyObject *line_payload,
+             PyObject *(*per_line)(PyObject *))
+{
+    PyObject *ret, *iter, *tag, *payloads;
+
+    ret = PyList_New(0);
+    payloads = PyDict_New();
+    iter = PyObject_GetIter(tags);
+    if (!ret || !payloads || !iter)
+        goto fail;
+    while ((tag = PyIter_Next(iter))) {
+        PyObject *point, *payload;
+        int is_start, ok = 0;
+        if (!unpack_tag(tag, &point, &is_start, &payload)) {
+            Py_DECREF(tag);
+            goto fail;
+        }
+        if (payload == line_payload) {
+            if (is_start) {
+                ok = 1;
+            } else {
+                PyObject *line = es_line(payloads);
+                if (line) {
+                    ok = append_new(ret, per_line(line)) == 0;
+                    Py_DECREF(line);
+                }
+                Py_DECREF(payloads);
+                payloads = PyDict_New();
+                ok = ok && payloads;
+            }
+        } else if (is_start) {
+            PyObject *pos = PyDict_New();
+            ok = pos &&
+                 PyDict_SetItem(pos, start_str, point) == 0 &&
+                 PyDict_SetItem(payloads, payload, pos) == 0;
+            Py_XDECREF(pos);
+        } else {
+            PyObject *pos = PyObject_GetItem(payloads, payload);
+            ok = pos && PyObject_SetItem(pos, end_str, point) == 0;
+            Py_XDECREF(pos);
+        }
+        Py_DECREF(tag);
+        if (!ok)
+            goto fail;
+    }
+    if (PyErr_Occurred())
+        goto fail;
+    Py_DECREF(iter);
+    Py_DECREF(payloads);
+    return ret;
+fail:
+    Py_XDECREF(ret);
+    Py_XDECREF(payloads);
+    Py_XDECREF(iter);
+    return NULL;
+}
+
+static PyObject *
+identity(PyObject *line)
+{
+    Py_INCREF(line);
+    return line;
+}
+
+/* Split a line's index objects into a (refs, regions) pair of lists. */
+static PyObject *
+bucket_line(PyObject *line)
+{
+    PyObject *refs, *regions, *ret;
+    Py_ssize_t i, n = PyList_GET_SIZE(line);
+    refs = PyList_New(0);
+    regions = PyList_New(0);
+    if (!refs || !regions)
+        goto fail;
+    for (i = 0; i < n; ++i) {
+        PyObject *obj = PyList_GET_ITEM(line, i);
+        int is_region = PyObject_IsInstance(
+            PyDict_GetItem(obj, payload_str),
+            (PyObject *)&PyBaseString_Type);
+        if (is_region < 0 ||
+                PyList_Append(is_region ? regions : refs, obj) < 0)
+            goto fail;
+    }
+    ret = PyTuple_Pack(2, refs, regions);
+    Py_DECREF(refs);
+    Py_DECREF(regions);
+    return ret;
+fail:
+    Py_XDECREF(refs);
+    Py_XDECREF(regions);
+    return NULL;
+}
+
+static PyObject *
+es_lines(PyObject *self, PyObject *args)
+{
+    PyObject *tags, *line_payload;
+    if (!PyArg_ParseTuple(args, "OO:es_lines", &tags, &line_payload))
+        return NULL;
+    return map_es_lines(tags, line_payload, identity);
+}
+
+static PyObject *
+es_line_buckets(PyObject *self, PyObject *args)
+{
+    PyObject *tags, *line_payload;
+    if (!PyArg_ParseTuple(args, "OO:es_line_buckets", &tags, &line_payload))
+        return NULL;
+    return map_es_lines(tags, line_payload, bucket_line);
+}
+
+/* html_line */
+
+/* A growable unicode buffer */
+typedef struct {
+    Py_UNICODE *chars;
+    Py_ssize_t len, capacity;
+} Buffer;
+
+static int
+buffer_reserve(Buffer *b, Py_ssize_t more)
+{
+    Py_ssize_t capacity = b->capacity ? b->capacity : 256;
+    Py_UNICODE *chars;
+    if (b->len + more <= b->capacity)
+        return 0;
+    while (capacity < b->len + more)
+        capacity *= 2;
+    chars = PyMem_Realloc(b->chars, capacity * sizeof(Py_UNICODE));
+    if (!chars) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    b->chars = chars;
+    b->capacity = capacity;
+    return 0;
+}
+
+static int
+buffer_append(Buffer *b, PyObject *unicode)
+{
+    Py_ssize_t n = PyUnicode_GET_SIZE(unicode);
+    if (buffer_reserve(b, n) < 0)
+        return -1;
+    Py_UNICODE_COPY(b->chars + b->len, PyUnicode_AS_UNICODE(unicode), n);
+    b->len += n;
+    return 0;
+}
+
+/* Append text[start:end], escaped like cgi.escape(). The slice bounds follow
+   Python's rules, negatives and all. */
+static int
+buffer_append_escaped(Buffer *b, PyObject *text, Py_ssize_t start,
+                      Py_ssize_t end)
+{
+    Py_ssize_t len = PyUnicode_GET_SIZE(text), i;
+    const Py_UNICODE *chars = PyUnicode_AS_UNICODE(text);
+    if (start < 0 && (start += len) < 0)
+        start = 0;
+    if (end < 0 && (end += len) < 0)
+        end = 0;
+    if (start > len)
+        start = len;
+    if (end > len)
+        end = len;
+    /* Most text needs no escaping, and "&amp;" is the longest escape. */
+    if (end > start && buffer_reserve(b, end - start) < 0)
+        return -1;
+    for (i = start; i < end; ++i) {
+        const char *escape;
+        switch (chars[i]) {
+            case '&': escape = "&amp;"; break;
+            case '<': escape = "&lt;"; break;
+            case '>': escape = "&gt;"; break;
+            default:
+                if (buffer_reserve(b, 1) < 0)
+                    return -1;
+                b->chars[b->len++] = chars[i];
+                continue;
+        }
+        if (buffer_reserve(b, 5) < 0)
+            return -1;
+        while (*escape)
+            b->chars[b->len++] = *escape++;
+    }
+    return 0;
+}
+
+/* Return payload.opener() or payload.closer() as unicode, remembering it in
+   the cache dict. A ref's opener JSON-encodes its whole menu, and refs split
+   across lines or around other tags open many times. */
+static PyObject *
+cached_markup(PyObject *cache, PyObject *payload, PyObject *method)
+{
+    PyObject *markup = PyDict_GetItem(cache, payload), *ret;
+    if (markup) {
+        Py_INCREF(markup);
+        return markup;
+    }
+    markup = PyObject_CallMethodObjArgs(payload, method, NULL);
+    if (!markup)
+        return NULL;
+    /* u''.join() would decode a str as ASCII, and so do we. */
+    ret = PyUnicode_FromObject(markup);
+    Py_DECREF(markup);
+    if (ret && PyDict_SetItem(cache, payload, ret) < 0) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/* Render one line of text and its tags into a new unicode object, using
+   (and filling) the opener and closer caches. */
+static PyObject *
+render_line(PyObject *text, PyObject *tags, Py_ssize_t bof_offset,
+            PyObject *openers, PyObject *closers)
+{
+    Buffer b = {NULL, 0, 0};
+    PyObject *unicode, *iter, *tag, *ret = NULL;
+    Py_ssize_t up_to = 0;
+
+    unicode = PyUnicode_FromObject(text);
+    iter = unicode ? PyObject_GetIter(tags) : NULL;
+    if (!iter)
+        goto done;
+    while ((tag = PyIter_Next(iter))) {
+        PyObject *point, *payload, *markup;
+        Py_ssize_t pos;
+        int is_start, ok;
+        if (!unpack_tag(tag, &point, &is_start, &payload)) {
+            Py_DECREF(tag);
+            goto done;
+        }
+        pos = PyNumber_AsSsize_t(point, PyExc_OverflowError);
+        if (pos == -1 && PyErr_Occurred()) {
+            Py_DECREF(tag);
+            goto done;
+        }
+        pos -= bof_offset;
+        markup = NULL;
+        ok = buffer_append_escaped(&b, unicode, up_to, pos) == 0 &&
+             (markup = is_start ? cached_markup(openers, payload, opener_str)
+                                : cached_markup(closers, payload, closer_str)) &&
+             buffer_append(&b, markup) == 0;
+        up_to = pos;
+        Py_XDECREF(markup);
+        Py_DECREF(tag);
+        if (!ok)
+            goto done;
+    }
+    if (PyErr_Occurred() ||
+            buffer_append_escaped(&b, unicode, up_to,
+                                  PyUnicode_GET_SIZE(unicode)) < 0)
+        goto done;
+    ret = PyUnicode_FromUnicode(b.chars, b.len);
+done:
+    PyMem_Free(b.chars);
+    Py_XDECREF(unicode);
+    Py_XDECREF(iter);
+    return ret;
+}
+
+static PyObject *
+html_line(PyObject *self, PyObject *args)
+{
+    PyObject *text, *tags, *openers, *closers, *ret = NULL;
+    Py_ssize_t bof_offset;
+    if (!PyArg_ParseTuple(args, "OOn:html_line", &text, &tags, &bof_offset))
+        return NULL;
+    openers = PyDict_New();
+    closers = PyDict_New();
+    if (openers && closers)
+        ret = render_line(text, tags, bof_offset, openers, closers);
+    Py_XDECREF(openers);
+    Py_XDECREF(closers);
+    return ret;
+}
+
+/* Render a whole file's lines at once, splitting the flat tags on LINE ones
+   like tags_per_line(). Stop at the end of whichever of the texts, offsets,
+   or lines of tags runs out first, like izip(). */
+static PyObject *
+html_lines(PyObject *self, PyObject *args)
+{
+    PyObject *texts, *tags, *offsets, *line_payload;
+    PyObject *ret, *openers, *closers, *line, *text_iter, *offset_iter, *iter;
+    PyObject *tag;
+
+    if (!PyArg_ParseTuple(args, "OOOO:html_lines",
+                          &texts, &tags, &offsets, &line_payload))
+        return NULL;
+    ret = PyList_New(0);
+    openers = PyDict_New();
+    closers = PyDict_New();
+    line = PyList_New(0);
+    text_iter = PyObject_GetIter(texts);
+    offset_iter = text_iter ? PyObject_GetIter(offsets) : NULL;
+    iter = offset_iter ? PyObject_GetIter(tags) : NULL;
+    if (!ret || !openers || !closers || !line || !iter)
+        goto fail;
+    while ((tag = PyIter_Next(iter))) {
+        PyObject *point, *payload, *text, *offset;
+        Py_ssize_t bof_offset;
+        int is_start, ok;
+        if (!unpack_tag(tag, &point, &is_start, &payload)) {
+            Py_DECREF(tag);
+            goto fail;
+        }
+        if (payload != line_payload) {
+            ok = PyList_Append(line, tag) == 0;
+            Py_DECREF(tag);
+            if (!ok)
+                goto fail;
+            continue;
+        }
+        Py_DECREF(tag);
+        if (is_start)
+            continue;
+        text = PyIter_Next(text_iter);
+        offset = text ? PyIter_Next(offset_iter) : NULL;
+        if (!offset) {
+            Py_XDECREF(text);
+            break;
+        }
+        bof_offset = PyNumber_AsSsize_t(offset, PyExc_OverflowError);
+        ok = !(bof_offset == -1 && PyErr_Occurred()) &&
+             append_new(ret, render_line(text, line, bof_offset,
+                                         openers, closers)) == 0;
+        Py_DECREF(text);
+        Py_DECREF(offset);
+        if (!ok)
+            goto fail;
+        Py_DECREF(line);
+        if (!(line = PyList_New(0)))
+            goto fail;
+    }
+    if (PyErr_Occurred())
+        goto fail;
+    Py_DECREF(openers);
+    Py_DECREF(closers);
+    Py_DECREF(line);
+    Py_DECREF(text_iter);
+    Py_DECREF(offset_iter);
+    Py_DECREF(iter);
+    return ret;
+fail:
+    Py_XDECREF(ret);
+    Py_XDECREF(openers);
+    Py_XDECREF(closers);
+    Py_XDECREF(line);
+    Py_XDECREF(text_iter);
+    Py_XDECREF(offset_iter);
+    Py_XDECREF(iter);
+    return NULL;
+}
+
+static PyMethodDef methods[] = {
+    {"nesting_order", nesting_order, METH_O,
+     "nesting_order(tag) -> sort key, like dxr.lines.nesting_order()"},
+    {"remove_overlapping_refs", remove_overlapping_refs, METH_VARARGS,
+     "remove_overlapping_refs(tags, Ref), like "
+     "dxr.lines.remove_overlapping_refs()"},
+    {"finished_tags", finished_tags, METH_VARARGS,
+     "finished_tags(lines, refs_and_regions, LINE, Ref) -> list, like "
+     "dxr.lines.finished_tags()"},
+    {"es_lines", es_lines, METH_VARARGS,
+     "es_lines(tags, LINE) -> list, like dxr.lines.es_lines()"},
+    {"es_line_buckets", es_line_buckets, METH_VARARGS,
+     "es_line_buckets(tags, LINE) -> list, like dxr.lines.es_line_buckets()"},
+    {"html_line", html_line, METH_VARARGS,
+     "html_line(text, tags, bof_offset) -> unicode, like "
+     "dxr.lines.html_line() but without the Markup"},
+    {"html_lines", html_lines, METH_VARARGS,
+     "html_lines(texts, tags, offsets, LINE) -> list of unicode, like "
+     "dxr.lines.html_lines() but without the Markup"},
+    {NULL, NULL, 0, NULL}
+};
+
+PyMODINIT_FUNC
+init_lines(void)
+{
+    PyObject *module = Py_InitModule3("_lines", methods,
+                                      "Native versions of the hot loops of "
+                                      "dxr.lines");
+    if (!module)
+        return;
+    sort_order_str = PyString_InternFromString("sort_order");
+    es_str = PyString_InternFromString("es");
+    payload_str = PyString_InternFromString("payload");
+    start_str = PyString_InternFromString("start");
+    end_str = PyString_InternFromString("end");
+    opener_str = PyString_InternFromString("opener");
+    closer_str = PyString_InternFromString("closer");
+    zero = PyInt_FromLong(0);
+    minus_one = PyInt_FromLong(-1);
+    nesting_order_func = PyObject_GetAttrString(module, "nesting_order");
+}
@@ -1,7 +1,7 @@
 from cStringIO import StringIO
 from datetime import datetime
 from functools import partial
-from itertools import chain, izip
+from itertools import chain, ifilter, izip
 from logging import StreamHandler
 import os
 from os.path import join, basename, split, dirname
@@ -14,14 +14,20 @@ from funcy import merge
 from pyelasticsearch import ElasticSearch
 from werkzeug.exceptions import NotFound
 
+from dxr.content_store import stored_file
 from dxr.es import (filtered_query, frozen_config, frozen_configs,
                     es_alias_or_not_found)
 from dxr.exceptions import BadTerm
 from dxr.filters import FILE, LINE
-from dxr.lines import html_line, tags_per_line, finished_tags, Ref, Region
+from dxr.include_graph import include_graph_tables, reachable
+from dxr.lines import html_lines, finished_tags, Ref, Region
+from dxr.menu_table import menu_table
+from dxr.metrics import (Metrics, finish_timing, log_query, phase, query_type,
+                         set_kind, start_timing)
 from dxr.mime import icon, is_binary_image, is_textual_image, decode_data
 from dxr.plugins import plugins_named
 from dxr.query import Query, filter_menu_items
+from dxr.query_cache import ResultCache
 from dxr.utils import (non_negative_int, decode_es_datetime, DXR_BLUEPRINT,
                        format_number, append_by_line, build_offset_map,
                        split_content_lines)
@@ -109,6 +115,16 @@ def make_app(config):
     # Make an ES connection pool shared among all threads:
     app.es = ElasticSearch(config.es_hosts)
 
+    # Remember the results of popular searches:
+    app.result_cache = (ResultCache(config.result_cache_size,
+                                    config.result_cache_seconds)
+                        if config.result_cache_size else None)
+
+    # Time requests, phase by phase:
+    app.metrics = Metrics()
+    app.before_request(start_timing)
+    app.after_request(finish_timing)
+
     return app
 
 
@@ -118,6 +134,13 @@ def index():
                             tree=current_app.dxr_config.default_tree))
 
 
+@dxr_blueprint.route('/metrics')
+def metrics():
+    """Return this process's recent request latencies, by kind of request
+    and by phase."""
+    return jsonify(current_app.metrics.summary())
+
+
 @dxr_blueprint.route('/<tree>/search')
 def search(tree):
     """Normalize params, and dispatch between JSON- and HTML-returning
@@ -132,14 +155,33 @@ def search(tree):
     offset = non_negative_int(req.get('offset'), 0)
     limit = min(non_negative_int(req.get('limit'), 100), 1000)
 
+    # Catalog records from before the catalog noted the index lack es_index.
+    caching = current_app.result_cache is not None and frozen.get('es_index')
+    # When caching, search the very index results are cached under, not the
+    # alias, which a deploy swaps only after updating the catalog.
+    index = frozen['es_index'] if caching else frozen['es_alias']
+
     # Make a Query:
-    query = Query(partial(current_app.es.search,
-                          index=frozen['es_alias']),
-                  query_text,
-                  plugins_named(frozen['enabled_plugins']))
+    with phase('parse'):
+        query = Query(partial(current_app.es.search, index=index),
+                      query_text,
+                      plugins_named(frozen['enabled_plugins']),
+                      frozen.get('artifact_folder'))
+    set_kind('search:' + query_type(query.terms))
+    if caching:
+        query = current_app.result_cache.wrap(query, tree, index)
 
     # Fire off one of the two search routines:
-    searcher = _search_json if _request_wants_json() else _search_html
+    if _request_wants_json():
+        # The HTML page is just a shell, so it's the JSON ones worth replaying.
+        log_query({'tree': tree,
+                   'q': query_text,
+                   'offset': offset,
+                   'limit': limit,
+                   'redirect': req.get('redirect', 'false')})
+        searcher = _search_json
+    else:
+        searcher = _search_html
     return searcher(query, tree, query_text, offset, limit, config)
 
 
@@ -186,21 +228,24 @@ def _search_json(query, tree, query_text, offset, limit, config):
                 'redirect_type': 'single'
             }
             return jsonify({'redirect': url_for('.browse', _anchor=line, **params)})
-        # Convert to dicts for ease of manipulation in JS:
-        results = [{'icon': icon,
-                    'path': file_path,
-                    'lines': [{'line_number': nb, 'line': l} for nb, l in lines]}
-                   for icon, file_path, lines in count_and_results['results']]
+        # Convert to dicts for ease of manipulation in JS. Results are
+        # highlighted lazily, so this is where that happens:
+        with phase('highlight'):
+            results = [{'icon': icon,
+                        'path': file_path,
+                        'lines': [{'line_number': nb, 'line': l} for nb, l in lines]}
+                       for icon, file_path, lines in count_and_results['results']]
     except BadTerm as exc:
         return jsonify({'error_html': exc.reason, 'error_level': 'warning'}), 400
 
-    return jsonify({
-        'www_root': config.www_root,
-        'tree': tree,
-        'results': results,
-        'result_count': count_and_results['result_count'],
-        'result_count_formatted': format_number(count_and_results['result_count']),
-        'tree_tuples': _tree_tuples('.search', q=query_text)})
+    with phase('render'):
+        return jsonify({
+            'www_root': config.www_root,
+            'tree': tree,
+            'results': results,
+            'result_count': count_and_results['result_count'],
+            'result_count_formatted': format_number(count_and_results['result_count']),
+            'tree_tuples': _tree_tuples('.search', q=query_text)})
 
 
 def _search_html(query, tree, query_text, offset, limit, config):
@@ -251,7 +296,8 @@ def raw(tree, path):
             'term': {
                 'path': path
             }
-        }
+        },
+        '_source': {'include': ['content_stored']}
     }
     results = current_app.es.search(
             query,
@@ -260,13 +306,44 @@ def raw(tree, path):
             size=1)
     try:
         # we explicitly get index 0 because there should be exactly 1 result
-        data = results['hits']['hits'][0]['_source']['raw_data'][0]
+        file_doc = results['hits']['hits'][0]['_source']
     except IndexError: # couldn't find the image
         raise NotFound
-    data_file = StringIO(data.decode('base64'))
+    stored = _stored_file(tree, path, file_doc)
+    if stored:
+        data = stored.data()
+    else:
+        results = current_app.es.search(
+                dict(query, _source={'include': ['raw_data']}),
+                index=es_alias_or_not_found(tree),
+                doc_type=FILE,
+                size=1)
+        try:
+            data = (results['hits']['hits'][0]['_source']['raw_data'][0]
+                    .decode('base64'))
+        except (IndexError, KeyError):
+            raise NotFound
+    data_file = StringIO(data)
     return send_file(data_file, mimetype=guess_type(path)[0])
 
 
+def _stored_file(tree, path, file_doc):
+    """Return the :class:`~dxr.content_store.StoredFile` of a path, or None
+    if the content store doesn't have it or has an outdated copy.
+
+    :arg file_doc: The path's FILE doc, or at least its ``content_stored``
+        field. A file reindexed on its own since the build isn't marked as
+        stored, so its contents come from ES instead.
+
+    """
+    stored = file_doc.get('content_stored', False)
+    if isinstance(stored, list):
+        stored = stored[0]
+    if stored:
+        artifact_folder = frozen_config(tree).get('artifact_folder')
+        return artifact_folder and stored_file(artifact_folder, path)
+
+
 @dxr_blueprint.route('/<tree>/raw-rev/<revision>/<path:path>')
 def raw_rev(tree, revision, path):
     """Send raw data at path from tree at the given revision, for binary things
@@ -291,6 +368,23 @@ def lines(tree):
     path = req.get('path', '')
     from_line = max(0, int(req.get('start', '')))
     to_line = int(req.get('end', ''))
+    # Without artifacts, there's no store to find the lines in, so don't
+    # spend a round trip asking whether they're stored.
+    stored = None
+    if frozen_config(tree).get('artifact_folder'):
+        files = filtered_query(es_alias_or_not_found(tree),
+                               FILE,
+                               filter={'path': path},
+                               size=1,
+                               include=['content_stored'])
+        stored = files and _stored_file(tree, path, files[0])
+    if stored:
+        start = max(from_line, 1)
+        return jsonify({'lines': [{'line_number': number, 'line': line}
+                                  for number, line in enumerate(
+                                      stored.lines(start, to_line), start)],
+                        'path': path})
+
     ctx_found = []
     possible_hits = current_app.es.search(
             {
@@ -314,6 +408,27 @@ def lines(tree):
     return jsonify({'lines': ctx_found, 'path': path})
 
 
+@dxr_blueprint.route('/<tree>/includes/')
+def includes(tree):
+    """Return the files that the file at the ``path`` URL param transitively
+    includes and those that transitively include it.
+
+    404 if the tree's build left no include graph.
+
+    """
+    path = request.values.get('path', '')
+    artifact_folder = frozen_config(tree).get('artifact_folder')
+    tables = artifact_folder and include_graph_tables(artifact_folder)
+    if not tables:
+        raise NotFound('No include graph for %s' % tree)
+    ret = {'path': path}
+    for key, table in zip(['includes', 'includers'], tables):
+        paths, truncated = reachable(table, path.encode('utf-8'))
+        ret[key] = sorted(p.decode('utf-8') for p in paths)
+        ret[key + '_truncated'] = truncated
+    return jsonify(ret)
+
+
 @dxr_blueprint.route('/<tree>/source/')
 @dxr_blueprint.route('/<tree>/source/<path:path>')
 def browse(tree, path=''):
@@ -327,14 +442,16 @@ def browse(tree, path=''):
         # Strip any trailing slash because we do not store it in ES.
         return _browse_folder(tree, path.rstrip('/'), config)
     except NotFound:
+        set_kind('browse:file')
         frozen = frozen_config(tree)
         # Grab the FILE doc, just for the sidebar nav links and the symlink target:
-        files = filtered_query(
-            frozen['es_alias'],
-            FILE,
-            filter={'path': path},
-            size=1,
-            include=['link', 'links', 'is_binary'])
+        with phase('es'):
+            files = filtered_query(
+                frozen['es_alias'],
+                FILE,
+                filter={'path': path},
+                size=1,
+                include=['link', 'links', 'is_binary', 'content_stored'])
         if not files:
             raise NotFound
         file_doc = files[0]
@@ -342,17 +459,37 @@ def browse(tree, path=''):
             # Then this path is a symlink, so redirect to the real thing.
             return redirect(url_for('.browse', tree=tree, path=file_doc['link'][0]))
 
-        lines = filtered_query(
-            frozen['es_alias'],
-            LINE,
-            filter={'path': path},
-            sort=['number'],
-            size=1000000,
-            include=['content', 'refs', 'regions', 'annotations'])
-        # Deref the content field in each document. We can do this because we
-        # do not store empty lines in ES.
-        for doc in lines:
-            doc['content'] = doc['content'][0]
+        stored = _stored_file(tree, path, file_doc)
+        if stored and stored.is_text:
+            # Rebuild the LINE docs from the content store rather than
+            # pulling them all out of ES.
+            with phase('content'):
+                render = stored.render()
+                lines = []
+                for number, content in enumerate(stored.lines(), 1):
+                    doc = {'content': content}
+                    refs, regions, annotations = render.get(number,
+                                                            ([], [], []))
+                    if refs:
+                        doc['refs'] = refs
+                    if regions:
+                        doc['regions'] = regions
+                    if annotations:
+                        doc['annotations'] = annotations
+                    lines.append(doc)
+        else:
+            with phase('es'):
+                lines = filtered_query(
+                    frozen['es_alias'],
+                    LINE,
+                    filter={'path': path},
+                    sort=['number'],
+                    size=1000000,
+                    include=['content', 'refs', 'regions', 'annotations'])
+            # Deref the content field in each document. We can do this
+            # because we do not store empty lines in ES.
+            for doc in lines:
+                doc['content'] = doc['content'][0]
 
         return _browse_file(tree, path, lines, file_doc, config,
                             file_doc.get('is_binary', [False])[0],
@@ -556,29 +693,39 @@ def _browse_file(tree, path, line_docs, file_doc, config, is_binary,
                                         line_docs)
                     for plugin in tree_config.enabled_plugins
                     if plugin.file_to_skim]
-        skim_links, refses, regionses, annotationses = skim_file(skimmers, len(line_docs))
-        index_refs = (Ref.es_to_triple(ref, tree_config) for ref in
-                      chain.from_iterable(doc.get('refs', [])
-                                          for doc in line_docs))
+        with phase('skim'):
+            skim_links, refses, regionses, annotationses = skim_file(skimmers, len(line_docs))
+        artifact_folder = frozen_config(tree).get('artifact_folder')
+        menus = artifact_folder and menu_table(artifact_folder)
+        index_refs = ifilter(None,
+                             (Ref.es_to_triple(ref, tree_config, menus)
+                              for ref in chain.from_iterable(
+                                  doc.get('refs', []) for doc in line_docs)))
         index_regions = (Region.es_to_triple(region) for region in
                          chain.from_iterable(doc.get('regions', [])
                                              for doc in line_docs))
-        tags = finished_tags(lines,
-                             chain(chain.from_iterable(refses), index_refs),
-                             chain(chain.from_iterable(regionses), index_regions))
-        return render_template(
-            'text_file.html',
-            **merge(common, {
-                # Someday, it would be great to stream this and not concretize
-                # the whole thing in RAM. The template will have to quit
-                # looping through the whole thing 3 times.
-                'lines': [(html_line(doc['content'], tags_in_line, offset),
-                           doc.get('annotations', []) + skim_annotations)
-                          for doc, tags_in_line, offset, skim_annotations
-                              in izip(line_docs, tags_per_line(tags), offsets, annotationses)],
-                'sections': sidebar_links(links + skim_links),
-                'query': request.args.get('q', ''),
-                'bubble': request.args.get('redirect_type')}))
+        with phase('tags'):
+            tags = finished_tags(
+                lines,
+                chain(chain.from_iterable(refses), index_refs),
+                chain(chain.from_iterable(regionses), index_regions))
+        with phase('render'):
+            return render_template(
+                'text_file.html',
+                **merge(common, {
+                    # Someday, it would be great to stream this and not concretize
+                    # the whole thing in RAM. The template will have to quit
+                    # looping through the whole thing 3 times.
+                    'lines': [(html, doc.get('annotations', []) + skim_annotations)
+                              for html, doc, skim_annotations
+                                  in izip(html_lines((doc['content'] for doc in line_docs),
+                                                     tags,
+                                                     offsets),
+                                          line_docs,
+                                          annotationses)],
+                    'sections': sidebar_links(links + skim_links),
+                    'query': request.args.get('q', ''),
+                    'bubble': request.args.get('redirect_type')}))
 
 
 @dxr_blueprint.route('/<tree>/rev/<revision>/<path:path>')
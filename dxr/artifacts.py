@@ -0,0 +1,185 @@
+"""Files a build leaves beside its ES index, for the web app to read
+
+Some lookups are simple enough that an ES round trip costs far more than the
+lookup itself. For those, plugins can write artifacts: plain files, like
+sorted tables which the app memory-maps and binary-searches.
+
+Plugins write artifacts into a staging folder within the tree's temp folder.
+Once indexing succeeds, the staging folder is moved to a folder named after
+the new ES index within ``artifact_folder``, and the catalog records where it
+is. Since it's named after the index, a rebuild never disturbs the artifacts
+a running app is reading, and they're deleted along with their index.
+
+"""
+from errno import ENOENT
+from heapq import merge
+from mmap import mmap, ACCESS_READ
+import os
+from os.path import isdir, join
+from shutil import move, rmtree
+from tempfile import mkstemp
+
+
+def staging_folder(tree):
+    """Return the folder plugins should write a tree's artifacts into during
+    a build, or None if artifacts are turned off."""
+    if tree.config.artifact_folder:
+        return join(tree.temp_folder, 'artifacts')
+
+
+def staging_path(tree, name):
+    """Return the path plugins should write the artifact called ``name`` to,
+    or None if artifacts are turned off."""
+    folder = staging_folder(tree)
+    if folder:
+        return join(folder, name)
+
+
+def published_folder(config, index):
+    """Return the folder holding the artifacts of an ES index, or None if it
+    has none."""
+    if config.artifact_folder:
+        folder = join(config.artifact_folder, index)
+        if isdir(folder):
+            return folder
+
+
+def publish(tree, index):
+    """Move a tree's staged artifacts to their home beside ``index``."""
+    staging = staging_folder(tree)
+    if staging and isdir(staging):
+        if not isdir(tree.config.artifact_folder):
+            os.makedirs(tree.config.artifact_folder)
+        move(staging, join(tree.config.artifact_folder, index))
+
+
+def remove(config, index):
+    """Delete the artifacts of an ES index, if there are any."""
+    folder = published_folder(config, index)
+    if folder:
+        rmtree(folder, ignore_errors=True)
+
+
+def write_sorted_table(path, rows):
+    """Write a table that :class:`SortedTable` can search.
+
+    :arg rows: An iterable of (key, value) pairs of bytestrings. Keys can't
+        contain tabs or newlines, nor can values contain newlines. Duplicate
+        rows are written only once.
+
+    """
+    lines = sorted(set('%s\t%s\n' % row for row in rows))
+    with open(path, 'wb') as file:
+        file.writelines(lines)
+
+
+def write_table_piece(pieces, rows):
+    """Write some rows as one sorted piece of a table, in the folder
+    ``pieces``, for :func:`merge_table_pieces()` to put together later.
+
+    Workers indexing in parallel each write their own pieces this way.
+
+    """
+    try:
+        os.makedirs(pieces)
+    except OSError:
+        if not isdir(pieces):
+            raise
+    fd, path = mkstemp(dir=pieces)
+    os.close(fd)
+    write_sorted_table(path, rows)
+
+
+def merge_table_pieces(pieces, path):
+    """Merge the pieces in the folder ``pieces`` into one table at ``path``,
+    and delete them.
+
+    Where pieces have rows with the same key, only the first is kept.
+
+    """
+    if not isdir(pieces):
+        return
+    files = [open(join(pieces, name), 'rb') for name in os.listdir(pieces)]
+    try:
+        with open(path, 'wb') as table:
+            last_key = None
+            for line in merge(*files):
+                key = line[:line.index('\t')]
+                if key != last_key:
+                    table.write(line)
+                    last_key = key
+    finally:
+        for file in files:
+            file.close()
+    rmtree(pieces)
+
+
+class SortedTable(object):
+    """A memory-mapped file of sorted ``key<tab>value`` lines, which can be
+    binary-searched for the values of a key without reading it all in"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as file:
+            if os.fstat(file.fileno()).st_size:
+                self._map = mmap(file.fileno(), 0, access=ACCESS_READ)
+            else:
+                self._map = ''  # mmap won't map empty files.
+
+    def values(self, key, limit=None):
+        """Return a list of the values of ``key``, in sorted order.
+
+        :arg limit: The most values to return, if not all of them
+
+        """
+        data = self._map
+        prefix = key + '\t'
+
+        # Find the first line not less than the prefix. lo and hi are always
+        # the starts of lines.
+        lo, hi = 0, len(data)
+        while lo < hi:
+            mid = (lo + hi) // 2
+            start = data.rfind('\n', 0, mid) + 1
+            end = data.find('\n', start)
+            if data[start:end] < prefix:
+                lo = end + 1
+            else:
+                hi = start
+
+        ret = []
+        while lo < len(data) and (limit is None or len(ret) < limit):
+            end = data.find('\n', lo)
+            line = data[lo:end]
+            if not line.startswith(prefix):
+                break
+            ret.append(line[len(prefix):])
+            lo = end + 1
+        return ret
+
+
+_tables = {}
+
+
+def sorted_table(folder, name):
+    """Return a :class:`SortedTable` of the artifact called ``name`` in
+    ``folder``, or None if there isn't one.
+
+    Tables are opened once per process and kept open. Artifacts never change
+    once published, and a mapping stays good even after its file is deleted.
+
+    """
+    path = join(folder, name)
+    try:
+        return _tables[path]
+    except KeyError:
+        pass
+    if len(_tables) > 100:  # Don't hoard the tables of long-gone builds.
+        _tables.clear()
+    try:
+        table = SortedTable(path)
+    except IOError as exc:
+        if exc.errno != ENOENT:
+            raise
+        table = None
+    _tables[path] = table
+    return table
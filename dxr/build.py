@@ -1,7 +1,9 @@
 from datetime import datetime
 from errno import ENOENT
 from fnmatch import fnmatchcase
-from itertools import chain, izip, repeat
+from hashlib import sha1
+from itertools import chain, count, izip, repeat
+from operator import itemgetter
 import os
 from os import stat, makedirs
 from os.path import islink, relpath, join, split
@@ -16,19 +18,25 @@ from binaryornot.helpers import is_binary_string
 from concurrent.futures import as_completed, ProcessPoolExecutor
 from click import progressbar
 from flask import current_app
-from funcy import ichunks, first
+from funcy import first
 from pyelasticsearch import (ElasticSearch, IndexAlreadyExistsError,
                              bulk_chunks, Timeout, ConnectionError)
 
+from dxr import artifacts, compile_db
+from dxr.bulk import BulkSender
 from dxr.app import make_app, dictify_links
 from dxr.config import FORMAT
+from dxr.content_store import ContentWriter, merge_content_pieces
 from dxr.es import UNINDEXED_STRING, UNANALYZED_STRING, TREE, create_index_and_wait
 from dxr.exceptions import BuildError
 from dxr.filters import LINE, FILE
-from dxr.lines import es_lines, finished_tags
-from dxr.mime import decode_data
-from dxr.utils import (open_log, deep_update, append_update,
-                       append_update_by_line, append_by_line, bucket,
+from dxr.lines import es_line_buckets, finished_tags
+from dxr.menu_table import (PIECE_SIZE, intern_menus, merge_menu_pieces,
+                            write_menu_piece)
+from dxr.mime import decode_data, is_binary_image
+from dxr.trigram_index import TrigramWriter, merge_shards
+from dxr.utils import (maybe, open_log, deep_update, append_update,
+                       append_update_by_line, append_by_line,
                        split_content_lines, unicode_for_display)
 from dxr.vcs import VcsCache
 
@@ -72,7 +80,9 @@ def deploy_tree(tree, es, index_name):
 
     # Make new index live:
     alias = config.es_alias.format(format=FORMAT, tree=tree.name)
-    swap_alias(alias, index_name, es)
+    old_index = swap_alias(alias, index_name, es)
+    if old_index:
+        artifacts.remove(config, old_index)
 
     # Create catalog index if it doesn't exist.
     try:
@@ -104,7 +114,12 @@ def deploy_tree(tree, es, index_name):
                             'description': UNINDEXED_STRING,
                             # ["clang", "pygmentize"]:
                             'enabled_plugins': UNINDEXED_STRING,
-                            'generated_date': UNINDEXED_STRING
+                            'generated_date': UNINDEXED_STRING,
+                            # Where the web app finds the index's artifacts:
+                            'artifact_folder': UNINDEXED_STRING,
+                            # The index behind es_alias, so the web app knows
+                            # when cached results are from an old one:
+                            'es_index': UNINDEXED_STRING
                             # We may someday also need to serialize some plugin
                             # configuration here.
                         }
@@ -121,15 +136,20 @@ def deploy_tree(tree, es, index_name):
              doc=dict(name=tree.name,
                       format=FORMAT,
                       es_alias=alias,
+                      es_index=index_name,
                       description=tree.description,
                       enabled_plugins=[p.name for p in tree.enabled_plugins],
-                      generated_date=config.generated_date),
+                      generated_date=config.generated_date,
+                      artifact_folder=artifacts.published_folder(config,
+                                                                 index_name)),
              id='%s/%s' % (FORMAT, tree.name))
 
 
 def swap_alias(alias, index, es):
     """Point an ES alias to a new index, and delete the old index.
 
+    Return the name of the old index, if there was one.
+
     :arg index: The new index name
 
     """
@@ -144,6 +164,7 @@ def swap_alias(alias, index, es):
     # Delete the old index.
     if old_index:
         es.delete_index(old_index)
+    return old_index
 
 
 def index_tree(tree, es, verbose=False):
@@ -203,6 +224,8 @@ def index_tree(tree, es, verbose=False):
     for plugin in tree.enabled_plugins:
         ensure_folder(join(tree.temp_folder, 'plugins', plugin.name),
                       not skip_cleanup)
+    if artifacts.staging_folder(tree):
+        ensure_folder(artifacts.staging_folder(tree), True)
 
     vcs_cache = VcsCache(tree)
     tree_indexers = [p.tree_to_index(p.name, tree, vcs_cache) for p in
@@ -263,6 +286,11 @@ def index_tree(tree, es, verbose=False):
             with new_pool() as pool:
                 tree_indexers = farm_out('post_build')
                 index_files(tree, tree_indexers, index, pool, es)
+            if artifacts.staging_folder(tree):
+                merge_menu_pieces(artifacts.staging_folder(tree))
+                merge_content_pieces(artifacts.staging_folder(tree))
+                if tree.trigram_index:
+                    merge_shards(artifacts.staging_folder(tree))
 
             # refresh() times out in prod. Wait until it doesn't. That
             # probably means things are ready to rock again.
@@ -284,6 +312,7 @@ def index_tree(tree, es, verbose=False):
                         }
                     }
                 })
+            artifacts.publish(tree, index)
     except Exception as exc:
         # If anything went wrong, delete the index, because we're not
         # going to have a way of returning its name if we raise an
@@ -306,14 +335,27 @@ def aligned_progressbar(*args, **kwargs):
         *args, bar_template='%(label)-18s [%(bar)s] %(info)s', **kwargs)
 
 
-def show_progress(futures, message):
-    """Show progress and yield results as futures complete."""
-    with aligned_progressbar(as_completed(futures),
-                             length=len(futures),
-                             show_eta=False,  # never even close
-                             label=message) as bar:
-        for future in bar:
-            yield future
+def show_progress(futures, message, sizes=None):
+    """Show progress and yield results as futures complete.
+
+    :arg sizes: A map of futures to how much work each represents, if not
+        all the same
+
+    """
+    if sizes is None:
+        with aligned_progressbar(as_completed(futures),
+                                 length=len(futures),
+                                 show_eta=False,  # never even close
+                                 label=message) as bar:
+            for future in bar:
+                yield future
+    else:
+        with aligned_progressbar(length=sum(sizes.itervalues()),
+                                 show_eta=False,
+                                 label=message) as bar:
+            for future in as_completed(futures):
+                bar.update(sizes[future])
+                yield future
 
 
 def save_scribbles(obj, method):
@@ -355,6 +397,25 @@ def _unignored_folders(folders, source_path, ignore_filenames, ignore_paths):
                 yield folder
 
 
+def is_ignored(rel_path, ignore_paths, ignore_filenames):
+    """Return whether :func:`unignored()` would skip a file.
+
+    :arg rel_path: The bytestring path of the file, relative to the source
+        folder
+
+    """
+    parts = rel_path.split('/')
+    for i, name in enumerate(parts):
+        if any(fnmatchcase(name, e) for e in ignore_filenames):
+            return True
+        # Folders' paths get a trailing slash, as in _unignored_folders().
+        path = '/' + '/'.join(parts[:i + 1]) + ('/' if i < len(parts) - 1
+                                                else '')
+        if any(fnmatchcase(path, e) for e in ignore_paths):
+            return True
+    return False
+
+
 def unicode_contents(path, encoding_guess):  # TODO: Make accessible to TreeToIndex.post_build.
     """Return the unicode contents of a file if we can figure out a decoding,
     or else None.
@@ -425,7 +486,8 @@ def unignored(folder, ignore_paths, ignore_filenames, want_folders=False):
             for f in folders:
                 yield join(root, f)
 
-def index_file(tree, tree_indexers, path, es, index):
+def index_file(tree, tree_indexers, path, es, index, sender=None,
+               menus=None, content_writer=None, trigram_writer=None):
     """Index a single file into ES, and build a static HTML representation of it.
 
     For the moment, we execute plugins in series, figuring that we have plenty
@@ -436,6 +498,16 @@ def index_file(tree, tree_indexers, path, es, index):
 
     :arg path: Bytestring absolute path to the file to index
     :arg index: The ES index name
+    :arg sender: A :class:`~dxr.bulk.BulkSender` to hand the docs off to. If
+        None, send them synchronously.
+    :arg menus: A dict to intern the refs' menu data into, as
+        :func:`~dxr.menu_table.intern_menus()` does, or None to store it on
+        each ref
+    :arg content_writer: A :class:`~dxr.content_store.ContentWriter` to store
+        the file's text (or, for an image, bytes) and the rendering info of
+        its lines in, or None not to
+    :arg trigram_writer: A :class:`~dxr.trigram_index.TrigramWriter` to index
+        the file's text with, or None not to
 
     """
     try:
@@ -455,31 +527,39 @@ def index_file(tree, tree_indexers, path, es, index):
     is_link = islink(path)
     # Index by line if the contents are text and the path is not a symlink.
     index_by_line = is_text and not is_link
+    store_data = (content_writer is not None and not is_text and
+                  not is_link and is_binary_image(rel_path))
     if index_by_line:
         lines = split_content_lines(contents)
         num_lines = len(lines)
         needles_by_line = [{} for _ in xrange(num_lines)]
         annotations_by_line = [[] for _ in xrange(num_lines)]
         refses, regionses = [], []
+        if trigram_writer is not None:
+            trigram_writer.add(rel_path, lines)
     needles = {}
     linkses = []
 
-    for tree_indexer in tree_indexers:
-        file_to_index = tree_indexer.file_to_index(rel_path, contents)
-        if file_to_index.is_interesting():
-            # Per-file stuff:
-            append_update(needles, file_to_index.needles())
-            if not is_link:
-                linkses.append(file_to_index.links())
-
-            # Per-line stuff:
-            if index_by_line:
-                refses.append(file_to_index.refs())
+    files_to_index = [tree_indexer.file_to_index(rel_path, contents)
+                      for tree_indexer in tree_indexers]
+    files_to_index = [f for f in files_to_index if f.is_interesting()]
+    syntax_covered = index_by_line and any(f.covers_syntax()
+                                           for f in files_to_index)
+    for file_to_index in files_to_index:
+        # Per-file stuff:
+        append_update(needles, file_to_index.needles())
+        if not is_link:
+            linkses.append(file_to_index.links())
+
+        # Per-line stuff:
+        if index_by_line:
+            refses.append(file_to_index.refs())
+            if not (syntax_covered and file_to_index.syntax_fallback):
                 regionses.append(file_to_index.regions())
-                append_update_by_line(needles_by_line,
-                                      file_to_index.needles_by_line())
-                append_by_line(annotations_by_line,
-                               file_to_index.annotations_by_line())
+            append_update_by_line(needles_by_line,
+                                  file_to_index.needles_by_line())
+            append_by_line(annotations_by_line,
+                           file_to_index.annotations_by_line())
 
     def docs():
         """Yield documents for bulk indexing.
@@ -488,10 +568,6 @@ def index_file(tree, tree_indexers, path, es, index):
         needles_by_line because they will no longer be used.
         """
         # Index a doc of type 'file' so we can build folder listings.
-        # At the moment, we send to ES in the same worker that does the
-        # indexing. We could interpose an external queueing system, but I'm
-        # willing to potentially sacrifice a little speed here for the easy
-        # management of self-throttling.
         file_info = stat(path)
         folder_name, file_name = split(rel_path)
         # Hard-code the keys that are hard-coded in the browse()
@@ -507,45 +583,79 @@ def index_file(tree, tree_indexers, path, es, index):
         links = dictify_links(chain.from_iterable(linkses))
         if links:
             doc['links'] = links
-        yield es.index_op(doc, doc_type=FILE)
+        if store_data:
+            with open(path, 'rb') as image_file:
+                content_writer.add_data(rel_path, image_file.read())
+        if store_data or (index_by_line and content_writer is not None):
+            doc['content_stored'] = True
+        # Paths can be longer than ES allows IDs to be.
+        file_id = sha1(rel_path).hexdigest()
+        yield es.index_op(doc, doc_type=FILE, id=file_id)
 
         # Index all the lines.
         if index_by_line:
-            for total, annotations_for_this_line, tags in izip(
+            render = []
+            for number, total, annotations_for_this_line, (refs, regions) in izip(
+                    count(1),
                     needles_by_line,
                     annotations_by_line,
-                    es_lines(finished_tags(lines,
-                                           chain.from_iterable(refses),
-                                           chain.from_iterable(regionses)))):
-                # Duplicate the file-wide needles into this line:
-                total.update(needles)
-
-                # We bucket tags into refs and regions for ES because later at
-                # request time we want to be able to merge them individually
-                # with those from skimmers.
-                refs_and_regions = bucket(tags, lambda index_obj: "regions" if
-                                          isinstance(index_obj['payload'], basestring) else
-                                          "refs")
-                if 'refs' in refs_and_regions:
-                    total['refs'] = refs_and_regions['refs']
-                if 'regions' in refs_and_regions:
-                    total['regions'] = refs_and_regions['regions']
+                    es_line_buckets(finished_tags(
+                        lines,
+                        chain.from_iterable(refses),
+                        chain.from_iterable(regionses)))):
+                # The rest of the file-wide needles are reached through the
+                # parent FILE doc.
+                if 'path' in needles:
+                    total['path'] = needles['path']
+
+                if refs:
+                    if menus is not None:
+                        intern_menus(refs, menus)
+                    total['refs'] = refs
+                if regions:
+                    total['regions'] = regions
                 if annotations_for_this_line:
                     total['annotations'] = annotations_for_this_line
-                yield es.index_op(total)
+                if content_writer is not None and (
+                        refs or regions or annotations_for_this_line):
+                    render.append([number,
+                                   refs,
+                                   regions,
+                                   annotations_for_this_line])
+                yield es.index_op(total, parent=file_id)
 
                 # Because needles_by_line holds a reference, total is not
                 # garbage collected. Since we won't use it again, we can clear
                 # the contents, saving substantial memory on long files.
                 total.clear()
+            if content_writer is not None:
+                content_writer.add_text(rel_path, lines, render)
 
-    # Indexing a 277K-line file all in one request makes ES time out (>60s),
-    # so we chunk it up. 300 docs is optimal according to the benchmarks in
-    # https://bugzilla.mozilla.org/show_bug.cgi?id=1122685. So large docs like
-    # images don't make our chunk sizes ridiculous, there's a size ceiling as
-    # well: 10000 is based on the 300 and an average of 31 chars per line.
-    for chunk in bulk_chunks(docs(), docs_per_chunk=300, bytes_per_chunk=10000):
-        es.bulk(chunk, index=index, doc_type=LINE)
+    if sender:
+        for doc in docs():
+            sender.add(doc)
+    else:
+        # Indexing a 277K-line file all in one request makes ES time out
+        # (>60s), so we chunk it up. 300 docs is optimal according to the
+        # benchmarks in https://bugzilla.mozilla.org/show_bug.cgi?id=1122685.
+        # So large docs like images don't make our chunk sizes ridiculous,
+        # there's a size ceiling as well: 10000 is based on the 300 and an
+        # average of 31 chars per line.
+        for chunk in bulk_chunks(docs(), docs_per_chunk=300,
+                                 bytes_per_chunk=10000):
+            es.bulk(chunk, index=index, doc_type=LINE)
+
+
+def _bulk_sender(es, index, config):
+    """Return a :class:`~dxr.bulk.BulkSender` for LINE docs, or None if the
+    config says to send them inline."""
+    if config.es_bulk_senders:
+        return BulkSender(es,
+                          index,
+                          LINE,
+                          senders=config.es_bulk_senders,
+                          queue_size=config.es_bulk_queue_size,
+                          target_latency=config.es_bulk_target_ms / 1000.0)
 
 
 def index_chunk(tree,
@@ -563,6 +673,7 @@ def index_chunk(tree,
 
     """
     path = '(no file yet)'
+    sender = None
     try:
         # So we can use Flask's url_from():
         with make_app(tree.config).test_request_context():
@@ -572,15 +683,39 @@ def index_chunk(tree,
                 log = (worker_number and
                        open_log(tree.log_folder,
                                 'index-chunk-%s.log' % worker_number))
-                for path in paths:
-                    log and log.write('Starting %s.\n' % path)
-                    index_file(tree, tree_indexers, path, es, index)
+                # With artifacts on, menu data go in a table beside the
+                # index, and file contents in a content store.
+                staging = artifacts.staging_folder(tree)
+                menus = {} if staging else None
+                # Each is made only once the one before is entered, so a
+                # failure partway cleans up after those already going.
+                with maybe(_bulk_sender(es, index, tree.config)) as sender, \
+                     maybe(ContentWriter(staging)
+                           if staging else None) as content_writer, \
+                     maybe(TrigramWriter(staging)
+                           if staging and tree.trigram_index
+                           else None) as trigram_writer:
+                    for path in paths:
+                        log and log.write('Starting %s.\n' % path)
+                        index_file(tree, tree_indexers, path, es, index,
+                                   sender, menus, content_writer,
+                                   trigram_writer)
+                        if menus and len(menus) >= PIECE_SIZE:
+                            write_menu_piece(staging, menus)
+                    if menus:
+                        write_menu_piece(staging, menus)
+                if sender:
+                    log and log.write('Ended with %s docs per bulk request.\n'
+                                      % sender.docs_per_chunk)
                 log and log.write('Finished chunk.\n')
             finally:
                 log and log.close()
     except Exception as exc:
         if swallow_exc:
             type, value, traceback = exc_info()
+            if sender and value is sender.failure:
+                # It was for some earlier doc, not necessarily this file's.
+                path = '(a bulk request to ES)'
             return format_exc(), type, value, path
         else:
             raise
@@ -603,34 +738,82 @@ def index_folders(tree, index, es):
             es.index(index, FILE, needles)
 
 
+def file_size(path):
+    """Return the size of a file, or 0 if it's a bad symlink or otherwise
+    unstat-able."""
+    try:
+        return stat(path).st_size
+    except OSError:
+        return 0
+
+
+def size_ordered_chunks(sizes,
+                        workers,
+                        max_paths=500,
+                        min_bytes=256 * 1024,
+                        chunks_per_worker=16):
+    """Divide paths into chunks of about the same number of bytes, biggest
+    files first, and return a list of (paths, bytes) pairs.
+
+    The pool hands out chunks in order as workers come free, so starting with
+    the biggest files and ending with lots of small chunks keeps one worker
+    from being stuck on a few huge generated files after the rest are done.
+
+    :arg sizes: An iterable of (path, size in bytes) pairs
+    :arg min_bytes: The size below which not to bother splitting chunks
+        further, since each costs a little to set up
+
+    """
+    sizes = sorted(sizes, key=itemgetter(1), reverse=True)
+    target = max(sum(size for _, size in sizes) //
+                     (workers * chunks_per_worker),
+                 min_bytes)
+    chunks = []
+    paths, total = [], 0
+    for path, size in sizes:
+        paths.append(path)
+        total += size
+        if total >= target or len(paths) >= max_paths:
+            chunks.append((paths, total))
+            paths, total = [], 0
+    if paths:
+        chunks.append((paths, total))
+    return chunks
+
+
 def index_files(tree, tree_indexers, index, pool, es):
     """Divide source files into groups, and send them out to be indexed."""
 
     def path_chunks(tree):
-        """Return an iterable of worker-sized iterables of paths."""
-        return ichunks(500, unignored(tree.source_folder,
-                                      tree.ignore_paths,
-                                      tree.ignore_filenames))
+        """Return a list of worker-sized (paths, bytes) pairs."""
+        return size_ordered_chunks(
+            ((path, file_size(path)) for path in
+                unignored(tree.source_folder,
+                          tree.ignore_paths,
+                          tree.ignore_filenames)),
+            max(tree.workers, 1))
 
     index_folders(tree, index, es)
 
     if not tree.workers:
-        for paths in path_chunks(tree):
+        for paths, _ in path_chunks(tree):
             index_chunk(tree,
                         tree_indexers,
                         paths,
                         index,
                         swallow_exc=False)
     else:
-        futures = [pool.submit(index_chunk,
-                               tree,
-                               tree_indexers,
-                               paths,
-                               index,
-                               worker_number=worker_number,
-                               swallow_exc=True)
-                   for worker_number, paths in enumerate(path_chunks(tree), 1)]
-        for future in show_progress(futures, 'Indexing files'):
+        sizes = {}
+        for worker_number, (paths, size) in enumerate(path_chunks(tree), 1):
+            future = pool.submit(index_chunk,
+                                 tree,
+                                 tree_indexers,
+                                 paths,
+                                 index,
+                                 worker_number=worker_number,
+                                 swallow_exc=True)
+            sizes[future] = size
+        for future in show_progress(sizes.keys(), 'Indexing files', sizes):
             result = future.result()
             if result:
                 formatted_tb, type, value, path = result
@@ -650,7 +833,7 @@ def _fill_and_write_template(jinja_env, template_name, out_path, vars):
 def build_tree(tree, tree_indexers, verbose):
     """Set up env vars, and run the build command."""
 
-    if not tree.build_command:
+    if not tree.build_command and not tree.compile_commands:
         return
 
     # Set up build environment variables:
@@ -662,15 +845,25 @@ def build_tree(tree, tree_indexers, verbose):
     with open_log(tree.log_folder, 'build.log', verbose) as log:
         print 'Building tree'
         workers = max(tree.workers, 1)
-        r = subprocess.call(
-            tree.build_command.replace('$jobs', str(workers))
-                              .format(workers=workers),
-            shell   = True,
-            stdout  = log,
-            stderr  = log,
-            env     = environ,
-            cwd     = tree.object_folder
-        )
+        if tree.compile_commands:
+            failures = compile_db.build(tree.compile_commands,
+                                        tree.object_folder,
+                                        workers,
+                                        environ,
+                                        log)
+            for path in failures:
+                log.write('Failed to compile %s\n' % path)
+            r = 1 if failures else 0
+        else:
+            r = subprocess.call(
+                tree.build_command.replace('$jobs', str(workers))
+                                  .format(workers=workers),
+                shell   = True,
+                stdout  = log,
+                stderr  = log,
+                env     = environ,
+                cwd     = tree.object_folder
+            )
 
     # Abort if build failed:
     if r != 0:
@@ -0,0 +1,153 @@
+"""Pipelined bulk indexing into elasticsearch
+
+Indexing workers are CPU-bound, and waiting on an ES round trip after every
+few hundred docs leaves them idle for much of the time. A
+:class:`BulkSender` lets a worker hand off docs and get on with the next
+file, while a few threads keep bulk requests in flight. The queue between
+them is bounded, so a slow cluster pushes back on the workers rather than
+letting docs pile up in RAM.
+
+Chunk sizes adapt to how long ES takes to respond: they grow while requests
+come back quicker than the target latency and halve when one doesn't, like
+TCP's congestion window.
+
+"""
+from Queue import Queue
+from sys import exc_info
+from threading import Lock, Thread
+from time import time
+
+
+# Sentinel which tells a sender thread to quit
+_DONE = object()
+
+
+class BulkSender(object):
+    """A pipeline of bulk requests to one ES index and doc type"""
+
+    def __init__(self,
+                 es,
+                 index,
+                 doc_type,
+                 senders=2,
+                 queue_size=8,
+                 target_latency=1.0,
+                 docs_per_chunk=300,
+                 min_docs_per_chunk=50,
+                 max_docs_per_chunk=5000,
+                 bytes_per_doc=33):
+        """
+        :arg es: The ElasticSearch connection to send with
+        :arg senders: How many bulk requests to keep in flight
+        :arg queue_size: How many chunks to let wait for a sender before
+            :meth:`add()` blocks
+        :arg target_latency: The number of seconds a bulk request should
+            take. Chunks grow while requests take less and shrink when
+            they take more.
+        :arg docs_per_chunk: The number of docs to start out sending at once
+        :arg bytes_per_doc: The average doc size, for working out the byte
+            ceiling of a chunk, which keeps big docs like images from making
+            for huge requests
+
+        """
+        self.es = es
+        self.index = index
+        self.doc_type = doc_type
+        self.target_latency = target_latency
+        self.docs_per_chunk = docs_per_chunk
+        self.min_docs_per_chunk = min_docs_per_chunk
+        self.max_docs_per_chunk = max_docs_per_chunk
+        self.bytes_per_doc = bytes_per_doc
+        self.chunks_sent = 0
+
+        self._chunk = []
+        self._chunk_bytes = 0
+        self._error = None
+        self._aborted = False
+        self._lock = Lock()
+        self._queue = Queue(maxsize=queue_size)
+        self._threads = [Thread(target=self._send_forever)
+                         for _ in xrange(max(senders, 1))]
+        for thread in self._threads:
+            thread.daemon = True
+            thread.start()
+
+    def add(self, op):
+        """Queue up an op from ``es.index_op()`` for sending.
+
+        Block if the senders are behind. Raise any error a sender has hit.
+
+        """
+        self._raise_error()
+        self._chunk.append(op)
+        self._chunk_bytes += len(op)
+        if (len(self._chunk) >= self.docs_per_chunk or
+                self._chunk_bytes >= self.docs_per_chunk * self.bytes_per_doc):
+            self._flush()
+
+    def close(self):
+        """Send whatever's left, wait for all requests to finish, and raise
+        any error a sender hit."""
+        self._flush()
+        for _ in self._threads:
+            self._queue.put(_DONE)
+        for thread in self._threads:
+            thread.join()
+        self._raise_error()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        if type is None:
+            self.close()
+        else:
+            # Don't mask the original exception, but don't leave threads
+            # behind in a worker that may be reused, either. Drop what's
+            # queued, and wait out only the requests already in flight.
+            self._aborted = True
+            for _ in self._threads:
+                self._queue.put(_DONE)
+            for thread in self._threads:
+                thread.join()
+
+    @property
+    def failure(self):
+        """The exception a sender hit, or None"""
+        return self._error and self._error[1]
+
+    def _flush(self):
+        if self._chunk:
+            self._queue.put(self._chunk)
+            self._chunk = []
+            self._chunk_bytes = 0
+
+    def _raise_error(self):
+        if self._error:
+            raise self._error[0], self._error[1], self._error[2]
+
+    def _send_forever(self):
+        while True:
+            chunk = self._queue.get()
+            if chunk is _DONE:
+                return
+            if self._error or self._aborted:
+                continue  # Drain the queue so add() doesn't block forever.
+            start = time()
+            try:
+                self.es.bulk(chunk, index=self.index, doc_type=self.doc_type)
+            except Exception:
+                self._error = exc_info()
+            else:
+                self._adapt(time() - start)
+
+    def _adapt(self, latency):
+        """Grow chunks a little if ES is keeping up, and halve them if not."""
+        with self._lock:
+            self.chunks_sent += 1
+            if latency < self.target_latency:
+                self.docs_per_chunk = min(self.docs_per_chunk + 50,
+                                          self.max_docs_per_chunk)
+            else:
+                self.docs_per_chunk = max(self.docs_per_chunk // 2,
+                                          self.min_docs_per_chunk)
@@ -10,6 +10,8 @@ from dxr.cli.delete import delete
 from dxr.cli.deploy import deploy
 from dxr.cli.index import index
 from dxr.cli.list import list
+from dxr.cli.refresh import refresh
+from dxr.cli.replay import replay
 from dxr.cli.serve import serve
 from dxr.cli.shell import shell
 
@@ -42,5 +44,7 @@ dxr.add_command(delete)
 dxr.add_command(deploy)
 dxr.add_command(index)
 dxr.add_command(list)
+dxr.add_command(refresh)
+dxr.add_command(replay)
 dxr.add_command(serve)
 dxr.add_command(shell)
@@ -0,0 +1,36 @@
+from click import ClickException, argument, command, option
+
+from dxr.cli.utils import config_option, tree_objects
+from dxr.exceptions import BuildError
+from dxr.refresh import Refresher, make_service
+
+
+@command()
+@config_option
+@option('--host', '-h',
+        default='localhost',
+        show_default=True,
+        help='The host address to serve on')
+@option('--port', '-p',
+        default=8001,
+        show_default=True,
+        help='The port to serve on')
+@argument('tree_name', metavar='TREE')
+def refresh(config, host, port, tree_name):
+    """Run a service which reindexes a tree's files as they change.
+
+    POST one or more "path" params, relative to the source folder, to
+    /refresh. The TUs which are or include those files are rebuilt, and the
+    files' docs in the live index are replaced.
+
+    The tree must have compile_commands set and must have last been indexed
+    with "clean" in skip_stages, so the build's temp files are still around,
+    and with artifact_folder set, so there's an include graph.
+
+    """
+    tree, = tree_objects([tree_name], config)
+    try:
+        refresher = Refresher(tree)
+    except BuildError as exc:
+        raise ClickException(str(exc))
+    make_service(refresher).run(host=host, port=port, threaded=True)
@@ -0,0 +1,79 @@
+from json import loads
+
+from click import ClickException, File, argument, command, echo, option
+from tabulate import tabulate
+
+from dxr.app import make_app
+from dxr.cli.utils import config_option
+from dxr.metrics import TOTAL
+
+
+@command()
+@config_option
+@option('--tree', '-t',
+        help='Run every query against this tree rather than the one it was '
+             'logged against, like a test tree indexed from a snapshot')
+@option('--repeat', '-r',
+        default=1,
+        show_default=True,
+        help='How many times to run through the log')
+@option('--cached',
+        is_flag=True,
+        default=False,
+        help="Leave the result cache on. Otherwise, every search goes to "
+             "elasticsearch.")
+@argument('log', type=File('r'))
+def replay(config, tree, repeat, cached, log):
+    """Run the searches in a query log, and report latencies by query type.
+
+    LOG is a file written by the web app with query_log set. Searches run
+    through the web app in-process, against the elasticsearch the config
+    file names, so point it at a local test instance.
+
+    """
+    entries = [loads(line) for line in log if line.strip()]
+    if not entries:
+        raise ClickException('%s has no searches in it.' % log.name)
+    app = make_app(config)
+    if not cached:
+        app.result_cache = None
+    client = app.test_client()
+    failures = 0
+    for _ in xrange(repeat):
+        for entry in entries:
+            response = client.get(
+                '%s/%s/search' % (config.www_root, tree or entry['tree']),
+                query_string={'q': entry['q'],
+                              'offset': entry.get('offset', 0),
+                              'limit': entry.get('limit', 100),
+                              'redirect': entry.get('redirect', 'false')},
+                headers={'Accept': 'application/json'})
+            # 400s are for bad terms, which are as valid a result as any.
+            if response.status_code not in (200, 400):
+                failures += 1
+    echo(report(app.metrics.summary()))
+    if failures:
+        raise ClickException('%s searches failed.' % failures)
+
+
+def report(summary):
+    """Return a table of the search latencies from
+    :meth:`~dxr.metrics.Metrics.summary()`, the whole requests first for each
+    query type and then their phases."""
+    rows = []
+    for kind in sorted(k for k in summary if k.startswith('search:')):
+        phases = summary[kind]
+        for phase in sorted(phases, key=lambda p: (p != TOTAL, p)):
+            stats = phases[phase]
+            rows.append([kind[len('search:'):] if phase == TOTAL else '',
+                         phase,
+                         stats['count'],
+                         stats['p50_ms'],
+                         stats['p90_ms'],
+                         stats['p99_ms'],
+                         stats['max_ms']])
+    return tabulate(rows,
+                    headers=['Query type', 'Phase', 'Count', 'p50 ms',
+                             'p90 ms', 'p99 ms', 'Max ms'],
+                    floatfmt='.1f',
+                    tablefmt='simple')
@@ -0,0 +1,130 @@
+"""Building a tree from a compilation database, most expensive TUs first
+
+When a tree has ``compile_commands`` set, we run its compile commands
+ourselves rather than its ``build_command``. That lets us use what each TU
+cost last time to start the slowest ones first, which keeps a giant
+generated TU from running alone at the end while every other worker
+idles. It's longest-processing-time-first list scheduling: each worker takes
+the most expensive TU left as soon as it's free.
+
+"""
+from json import load, dump
+from os.path import basename, join, splitext
+from shlex import split
+import subprocess
+from time import time
+
+from concurrent.futures import ThreadPoolExecutor, as_completed
+
+
+# Where, within the object folder, to keep the costs from the last build
+COSTS_FILE = '.dxr-tu-costs.json'
+
+# Extensions which, regardless of the compiler named, mean C rather than C++
+C_EXTENSIONS = frozenset(['.c', '.m'])
+
+
+def compile_commands(path):
+    """Return a list of (directory, file, argv) tuples from a
+    ``compile_commands.json`` file.
+
+    Files are made absolute, relative to their directories.
+
+    """
+    with open(path) as file:
+        entries = load(file)
+    return [(entry['directory'],
+             join(entry['directory'], entry['file']),
+             entry['arguments'] if 'arguments' in entry
+                                else split(entry['command'].encode('utf-8')))
+            for entry in entries]
+
+
+def with_compiler(argv, path, environ):
+    """Return ``argv`` with its compiler swapped for ``$CC`` or ``$CXX`` from
+    ``environ``, so indexing plugins get to see the compilation.
+
+    If the one we'd want isn't set, leave the compiler alone.
+
+    """
+    cxx = ('++' in basename(argv[0]) or
+           splitext(path)[1].lower() not in C_EXTENSIONS)
+    compiler = environ.get('CXX' if cxx else 'CC')
+    return (split(compiler) if compiler else argv[:1]) + list(argv[1:])
+
+
+def load_costs(folder):
+    """Return {path: seconds} recorded by the last build in ``folder``, or
+    {} if there wasn't one."""
+    try:
+        with open(join(folder, COSTS_FILE)) as file:
+            return load(file)
+    except (IOError, ValueError):
+        return {}
+
+
+def save_costs(folder, costs):
+    with open(join(folder, COSTS_FILE), 'w') as file:
+        dump(costs, file)
+
+
+def by_cost(commands, costs):
+    """Sort ``commands`` from :func:`compile_commands` most expensive first.
+
+    TUs we have no history for go first of all, since for all we know they're
+    the big ones.
+
+    """
+    return sorted(commands,
+                  key=lambda (directory, path, argv): -costs.get(path,
+                                                                 float('inf')))
+
+
+def _run(directory, path, argv, environ, log):
+    """Run one compile command, and return (path, seconds, return code)."""
+    start = time()
+    code = subprocess.call(argv,
+                           stdout=log,
+                           stderr=log,
+                           env=environ,
+                           cwd=directory)
+    return path, time() - start, code
+
+
+def run(commands, workers, environ, log):
+    """Run commands from :func:`compile_commands`, starting them in the order
+    given, and yield (path, seconds, return code) for each as it finishes."""
+    with ThreadPoolExecutor(max_workers=workers) as pool:
+        futures = [pool.submit(_run,
+                               directory,
+                               path,
+                               with_compiler(argv, path, environ),
+                               environ,
+                               log)
+                   for directory, path, argv in commands]
+        for future in as_completed(futures):
+            yield future.result()
+
+
+def build(database, object_folder, workers, environ, log):
+    """Run all the commands in a compilation database, most expensive first,
+    and record what each cost for next time.
+
+    The cost of a TU is the wall time of its compiler process, which
+    includes the time any compiler plugins spend indexing it.
+
+    Return the paths of any TUs that failed to compile.
+
+    """
+    commands = compile_commands(database)
+    costs = load_costs(object_folder)
+    failures = []
+    for path, seconds, code in run(by_cost(commands, costs),
+                                   workers,
+                                   environ,
+                                   log):
+        costs[path] = seconds
+        if code:
+            failures.append(path)
+    save_costs(object_folder, costs)
+    return failures
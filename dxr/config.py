@@ -97,6 +97,12 @@ class Config(DotSection):
             'DXR': {
                 Optional('temp_folder', default=abspath('dxr-temp-{tree}')):
                     AbsPath,
+                Optional('artifact_folder', default=None): AbsPath,
+                Optional('cache_folder', default=None): AbsPath,
+                Optional('cache_size', default=10000):
+                    And(Use(int),
+                        lambda v: v >= 0,
+                        error='"cache_size" must be a non-negative integer.'),
                 Optional('default_tree', default=None): basestring,
                 Optional('disabled_plugins', default=plugin_list('')): Plugins,
                 Optional('enabled_plugins', default=plugin_list('*')): Plugins,
@@ -140,7 +146,38 @@ class Config(DotSection):
                         error='"es_indexing_retries" must be a non-negative '
                               'integer.'),
                 Optional('es_refresh_interval', default=60):
-                    Use(int, error='"es_refresh_interval" must be an integer.')
+                    Use(int, error='"es_refresh_interval" must be an integer.'),
+                Optional('es_bulk_senders', default=2):
+                    And(Use(int),
+                        lambda v: v >= 0,
+                        error='"es_bulk_senders" must be a non-negative '
+                              'integer.'),
+                Optional('es_bulk_queue_size', default=8):
+                    And(Use(int),
+                        lambda v: v > 0,
+                        error='"es_bulk_queue_size" must be a positive '
+                              'integer.'),
+                Optional('es_bulk_target_ms', default=1000):
+                    And(Use(int),
+                        lambda v: v > 0,
+                        error='"es_bulk_target_ms" must be a positive '
+                              'integer.'),
+                Optional('result_cache_size', default=1000):
+                    And(Use(int),
+                        lambda v: v >= 0,
+                        error='"result_cache_size" must be a non-negative '
+                              'integer.'),
+                Optional('result_cache_seconds', default=300):
+                    And(Use(int),
+                        lambda v: v > 0,
+                        error='"result_cache_seconds" must be a positive '
+                              'integer.'),
+                Optional('slow_request_ms', default=2000):
+                    And(Use(int),
+                        lambda v: v >= 0,
+                        error='"slow_request_ms" must be a non-negative '
+                              'integer.'),
+                Optional('query_log', default=None): AbsPath
             },
             basestring: dict
         })
@@ -208,6 +245,7 @@ class TreeConfig(DotSectionWrapper):
         schema = Schema({
             Optional('build_command', default='make -j {workers}'): basestring,
             Optional('clean_command', default='make clean'): basestring,
+            Optional('compile_commands', default=None): AbsPath,
             Optional('description', default=''): basestring,
             Optional('disabled_plugins', default=plugin_list('')): Plugins,
             Optional('enabled_plugins', default=plugin_list('*')): Plugins,
@@ -222,6 +260,7 @@ class TreeConfig(DotSectionWrapper):
             'source_folder': AbsPath,
             Optional('source_encoding', default='utf-8'): basestring,
             Optional('temp_folder', default=None): AbsPath,
+            Optional('trigram_index', default=False): Bool,
             Optional('p4web_url', default='http://p4web/'): basestring,
             Optional('workers', default=None): WORKERS_VALIDATOR,
             Optional(basestring): dict})
@@ -331,6 +370,19 @@ WhitespaceList = And(basestring,
                      error='This should be a whitespace-separated list.')
 
 
+def _parse_bool(value):
+    """Turn a config value like "true" or "off" into a bool."""
+    lowered = value.strip().lower()
+    if lowered in ('true', 'yes', 'on', '1'):
+        return True
+    if lowered in ('false', 'no', 'off', '0'):
+        return False
+    raise ValueError(value)
+Bool = And(basestring,
+           Use(_parse_bool),
+           error='This should be "true" or "false".')
+
+
 # Turn a filesystem path into an absolute one so changing the working
 # directory doesn't keep us from finding them.
 AbsPath = And(basestring, Use(abspath), error='This should be a path.')
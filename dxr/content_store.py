@@ -0,0 +1,227 @@
+"""A compressed store of file contents, kept beside the ES index
+
+Showing a file used to mean pulling every one of its LINE docs out of ES,
+tens of thousands for a big file, just to get back text we had on disk all
+along. When a build leaves artifacts, it also writes each file's text, the
+refs, regions, and annotations of its lines, and the bytes of each image
+into packs of zlib-compressed blocks. The app memory-maps the packs and
+decompresses only the blocks it needs, which leaves ES to do the searching.
+
+Each indexing worker appends to a pack of its own and writes a piece of a
+:class:`~dxr.artifacts.SortedTable` saying where in the packs each path's
+data is. :func:`merge_content_pieces()` puts the pieces together at the end.
+
+"""
+from array import array
+from errno import ENOENT
+from json import dumps, loads
+from mmap import mmap, ACCESS_READ
+import os
+from os.path import basename, join
+from tempfile import mkstemp
+from zlib import compress, decompress
+
+from dxr.artifacts import merge_table_pieces, sorted_table, write_table_piece
+
+
+# The name of the table of paths, and of the folder its pieces go in while
+# indexing:
+CONTENT_TABLE = 'content'
+PIECES = 'content.pieces'
+
+# What packs are named, after this prefix and a unique suffix
+PACK_PREFIX = 'content.pack.'
+
+# How many bytes of a file to compress together. Reading a few lines means
+# decompressing the block or two they're in.
+BLOCK_SIZE = 64 * 1024
+
+
+class ContentWriter(object):
+    """An appender to a new pack of file contents in an artifact folder"""
+
+    def __init__(self, folder):
+        self._folder = folder
+        fd, path = mkstemp(dir=folder, prefix=PACK_PREFIX)
+        os.chmod(path, 0644)  # mkstemp's 0600 would lock out the web app.
+        self._pack = os.fdopen(fd, 'wb')
+        self._name = basename(path)
+        self._rows = []
+
+    def add_text(self, path, lines, render=None):
+        """Store the text of a file.
+
+        :arg path: The bytestring path of the file, relative to the source
+            folder
+        :arg lines: The unicode lines of the file, line endings and all
+        :arg render: A list of JSON-serializable [line number, refs, regions,
+            annotations] for each line that has any of those
+
+        """
+        encoded = [line.encode('utf-8') for line in lines]
+        offsets = array('I')
+        offset = 0
+        for line in encoded:
+            offsets.append(offset)
+            offset += len(line)
+        self._add(path, 't', ''.join(encoded), offsets.tostring(),
+                  dumps(render or [], separators=(',', ':')))
+
+    def add_data(self, path, data):
+        """Store the bytes of a binary file, like an image."""
+        self._add(path, 'b', data, '', '[]')
+
+    def _add(self, path, kind, data, offsets, render):
+        if '\t' in path or '\n' in path:
+            return  # Not keyable. The app falls back to ES.
+        start = self._pack.tell()
+        offsets = compress(offsets)
+        render = compress(render)
+        self._pack.write(offsets)
+        self._pack.write(render)
+        block_lengths = []
+        for i in xrange(0, len(data), BLOCK_SIZE):
+            block = compress(data[i:i + BLOCK_SIZE])
+            self._pack.write(block)
+            block_lengths.append(str(len(block)))
+        self._rows.append((path, ' '.join([self._name,
+                                           kind,
+                                           str(start),
+                                           str(len(data)),
+                                           str(len(offsets)),
+                                           str(len(render)),
+                                           ','.join(block_lengths)])))
+
+    def close(self):
+        """Finish the pack, and write the piece of the table locating what's
+        in it."""
+        self._pack.close()
+        write_table_piece(join(self._folder, PIECES), self._rows)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        if type is None:
+            self.close()
+        else:
+            self._pack.close()  # The build is failing. Don't list the pack.
+
+
+def merge_content_pieces(folder):
+    """Merge the pieces written by :class:`ContentWriter`\ s into one table,
+    and delete them."""
+    merge_table_pieces(join(folder, PIECES), join(folder, CONTENT_TABLE))
+
+
+class StoredFile(object):
+    """The stored contents of one file"""
+
+    def __init__(self, pack, value):
+        (_, self.kind, start, size, offsets_length, render_length,
+         block_lengths) = value.split(' ')
+        self._pack = pack
+        self.size = int(size)
+        start = int(start)
+        self._offsets_at = start, start + int(offsets_length)
+        self._render_at = self._offsets_at[1], (self._offsets_at[1] +
+                                                int(render_length))
+        self._blocks = []
+        block_start = self._render_at[1]
+        for length in block_lengths.split(',') if block_lengths else []:
+            self._blocks.append((block_start, block_start + int(length)))
+            block_start += int(length)
+
+    @property
+    def is_text(self):
+        return self.kind == 't'
+
+    def _decompress(self, (start, end)):
+        return decompress(self._pack[start:end])
+
+    def _bytes(self, start, end):
+        """Return bytes start:end of the file, decompressing only the blocks
+        they're in."""
+        if start >= end:
+            return ''
+        first, last = start // BLOCK_SIZE, (end - 1) // BLOCK_SIZE
+        data = ''.join(self._decompress(self._blocks[i])
+                       for i in xrange(first, last + 1))
+        base = first * BLOCK_SIZE
+        return data[start - base:end - base]
+
+    def data(self):
+        """Return all the bytes of the file. Text comes back UTF-8-encoded."""
+        return self._bytes(0, self.size)
+
+    def num_lines(self):
+        return len(self._line_offsets())
+
+    def _line_offsets(self):
+        offsets = array('I')
+        offsets.fromstring(self._decompress(self._offsets_at))
+        return offsets
+
+    def lines(self, start=1, end=None):
+        """Return the unicode lines from 1-based line ``start`` through line
+        ``end``, inclusive, or through the end of the file if ``end`` is
+        None."""
+        offsets = self._line_offsets()
+        start = max(start, 1)
+        end = len(offsets) if end is None else min(end, len(offsets))
+        if start > end:
+            return []
+        bounds = list(offsets[start - 1:end])
+        bounds.append(offsets[end] if end < len(offsets) else self.size)
+        data = self._bytes(bounds[0], bounds[-1])
+        base = bounds[0]
+        return [data[b - base:e - base].decode('utf-8')
+                for b, e in zip(bounds, bounds[1:])]
+
+    def render(self):
+        """Return {line number: (refs, regions, annotations)} for the lines
+        that have any, in the form they take in LINE docs."""
+        return dict((number, (refs, regions, annotations)) for
+                    number, refs, regions, annotations in
+                    loads(self._decompress(self._render_at)))
+
+
+_packs = {}
+
+
+def _pack(folder, name):
+    """Return a memory map of a pack, opening it only once per process."""
+    path = join(folder, name)
+    try:
+        return _packs[path]
+    except KeyError:
+        pass
+    if len(_packs) > 1000:  # Don't hoard the packs of long-gone builds.
+        _packs.clear()
+    with open(path, 'rb') as file:
+        if os.fstat(file.fileno()).st_size:
+            pack = mmap(file.fileno(), 0, access=ACCESS_READ)
+        else:
+            pack = ''  # mmap won't map empty files.
+    _packs[path] = pack
+    return pack
+
+
+def stored_file(artifact_folder, path):
+    """Return the :class:`StoredFile` of a path from an artifact folder, or
+    None if the folder has no contents for it.
+
+    :arg path: A unicode path relative to the source folder
+
+    """
+    table = sorted_table(artifact_folder, CONTENT_TABLE)
+    if table:
+        values = table.values(path.encode('utf-8'), limit=1)
+        if values:
+            try:
+                pack = _pack(artifact_folder, values[0].split(' ', 1)[0])
+            except IOError as exc:
+                if exc.errno != ENOENT:
+                    raise
+                return None
+            return StoredFile(pack, values[0])
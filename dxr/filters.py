@@ -48,6 +48,13 @@ class Filter(object):
         filter
     :ivar is_identifier: Whether to include this filter in the "id:" aggregate
         filter
+    :ivar on_lines: For FILE-domain filters, whether the fields queried are on
+        LINE docs as well, as ``path`` is. Otherwise, filtering lines by them
+        takes a trip through the lines' parent FILE docs. Default: False.
+    :ivar artifact_folder: The folder of artifacts from the build of the index
+        being searched, if any, set by the :class:`~dxr.query.Query` before
+        :meth:`filter()` is called. Filters may narrow their searches with
+        them.
 
     """
     domain = LINE
@@ -55,6 +62,8 @@ class Filter(object):
     is_reference = False
     is_identifier = False
     union_only = False
+    on_lines = False
+    artifact_folder = None
 
     def __init__(self, term, enabled_plugins):
         """This is a good place to parse the term's arg (if it requires further
@@ -116,6 +125,20 @@ class Filter(object):
     # on that to make identifiers easy to pick out visually.
 
 
+def line_filter(filter):
+    """Return the ES filter clause of a :class:`Filter` for applying to LINE
+    docs, or None if it doesn't filter anything.
+
+    File-wide needles live only on FILE docs, which are the parents of their
+    lines, so most FILE-domain filters have to reach them by way of those.
+
+    """
+    clause = filter.filter()
+    if clause and filter.domain == FILE and not filter.on_lines:
+        return {'has_parent': {'parent_type': FILE, 'filter': clause}}
+    return clause
+
+
 def negatable(filter_method):
     """Decorator to wrap an ES "not" around a ``Filter.filter()`` method iff
     the term is negated.
@@ -0,0 +1,136 @@
+"""The graph of which files include which, as build artifacts
+
+Plugins which know about includes hand :func:`write_include_graph()` the
+edges. It stores them both ways round, as :class:`~dxr.artifacts.SortedTable`
+artifacts, so the app can walk the graph in either direction a lookup at a
+time: "what does X pull in" and "who pulls in X". It also writes a report of
+the headers which cost the most to include, to help decide which to split.
+
+"""
+from collections import defaultdict
+from os.path import getsize, join
+
+from dxr.artifacts import sorted_table, write_sorted_table
+
+
+# The names of the artifacts:
+INCLUDES = 'includes'  # path -> paths it includes
+INCLUDERS = 'includers'  # path -> paths which include it
+
+
+def write_include_graph(folder, edges):
+    """Write the include graph into an artifact folder.
+
+    :arg edges: An iterable of (including path, included path) pairs, as
+        bytestrings relative to the source folder
+
+    """
+    edges = [edge for edge in edges if not any('\t' in path or '\n' in path
+                                              for path in edge)]
+    write_sorted_table(join(folder, INCLUDES), edges)
+    write_sorted_table(join(folder, INCLUDERS),
+                       ((target, source) for source, target in edges))
+
+
+def reachable(table, path, limit=10000):
+    """Return the set of paths reachable from ``path`` by following a table
+    from :func:`write_include_graph()`, not counting ``path`` itself unless
+    there's a cycle through it, and whether we gave up early.
+
+    :arg limit: The most paths to return. Past this, the answer is "lots".
+
+    """
+    seen = set()
+    todo = [path]
+    while todo:
+        for next in table.values(todo.pop()):
+            if next not in seen:
+                if len(seen) >= limit:
+                    return seen, True
+                seen.add(next)
+                todo.append(next)
+    return seen, False
+
+
+def include_graph_tables(artifact_folder):
+    """Return the (includes, includers) tables from an artifact folder, or
+    None if there aren't any."""
+    includes = sorted_table(artifact_folder, INCLUDES)
+    includers = sorted_table(artifact_folder, INCLUDERS)
+    if includes and includers:
+        return includes, includers
+
+
+def fan_out(edges, tus, source_folder):
+    """Return a list of stats about every included file, most costly first.
+
+    Each is a dict of...
+
+    path
+        The path of the included file
+    direct_includers
+        How many files include it directly
+    tus
+        How many TUs pull it in, directly or otherwise
+    bytes
+        How many bytes of it those TUs parse all told: its size times ``tus``
+    ms
+        The total time spent indexing those TUs
+
+    :arg edges: An iterable of (including path, included path) pairs
+    :arg tus: A dict of {TU path: milliseconds it took to index}
+    :arg source_folder: The folder the paths are relative to, for measuring
+        file sizes
+
+    """
+    includes = defaultdict(set)
+    direct_includers = defaultdict(int)
+    for source, target in edges:
+        if target not in includes[source]:
+            includes[source].add(target)
+            direct_includers[target] += 1
+
+    # Walk what each TU pulls in, as the compiler did. That's as much work as
+    # the number of headers parsed, where walking up from each header could
+    # be the square of the number of files.
+    tu_counts = defaultdict(int)
+    ms = defaultdict(int)
+    for tu, tu_ms in tus.iteritems():
+        seen = set()
+        todo = [tu]
+        while todo:
+            for target in includes.get(todo.pop(), ()):
+                if target not in seen:
+                    seen.add(target)
+                    todo.append(target)
+        for target in seen:
+            tu_counts[target] += 1
+            ms[target] += tu_ms
+
+    def size(path):
+        try:
+            return getsize(join(source_folder, path))
+        except OSError:
+            return 0
+
+    stats = [{'path': path,
+              'direct_includers': direct_includers[path],
+              'tus': tu_counts[path],
+              'bytes': tu_counts[path] * size(path),
+              'ms': ms[path]}
+             for path in direct_includers]
+    stats.sort(key=lambda s: (-s['bytes'], -s['tus'], s['path']))
+    return stats
+
+
+def write_fan_out_report(stats, log, top=100):
+    """Write the first ``top`` items of :func:`fan_out()`'s output to a file
+    as a table."""
+    log.write('Included files costing the most to include, of %s:\n' %
+              len(stats))
+    log.write('%14s %8s %8s %12s  %s\n' %
+              ('bytes parsed', 'TUs', 'includers', 'TU ms', 'path'))
+    for s in stats[:top]:
+        log.write('%14d %8d %8d %12d  %s\n' % (s['bytes'], s['tus'],
+                                               s['direct_includers'], s['ms'],
+                                               s['path']))
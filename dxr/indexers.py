@@ -137,6 +137,42 @@ class TreeToIndex(PluginConfig):
 
         """
 
+    def load_build(self):
+        """Hook called by ``dxr refresh`` as it starts, instead of
+        :meth:`post_build()`
+
+        Load whatever whole-program analysis the last full build left
+        behind. A full build of the same tree may be running at the same
+        time, so don't write anything it writes, like logs or artifacts.
+        By default, this just calls :meth:`post_build()`.
+
+        """
+        self.post_build()
+
+    def pre_refresh(self, paths):
+        """Hook called by ``dxr refresh`` before it rebuilds the TUs affected
+        by changes to some files
+
+        This is a good place to throw out analysis data about those files, so
+        stale data doesn't outlive the rebuild.
+
+        :arg paths: The changed files' paths, relative to the source folder
+
+        The refresh service calls :meth:`pre_build()` and
+        :meth:`load_build()` once, as it starts, and then, for each batch of
+        changes, this, :meth:`environment()`, and :meth:`post_refresh()`.
+
+        """
+
+    def post_refresh(self, paths):
+        """Hook called by ``dxr refresh`` after it rebuilds the TUs affected
+        by changes to some files, before it reindexes them
+
+        Whole-program analysis from :meth:`post_build()` is generally left as
+        it is, since redoing it would take as long as a full build.
+
+        """
+
     def file_to_index(self, path, contents):
         """Return an object that provides data about a given file.
 
@@ -183,6 +219,10 @@ class FileToSkim(PluginConfig):
     shared cache among my methods.
 
     """
+    # Whether my regions() are only wanted for files no other plugin
+    # covers_syntax() of
+    syntax_fallback = False
+
     def __init__(self, path, contents, plugin_name, tree, file_properties=None,
                  line_properties=None):
         """
@@ -276,6 +316,16 @@ class FileToSkim(PluginConfig):
         """
         return []
 
+    def covers_syntax(self):
+        """Return whether :meth:`~dxr.indexers.FileToSkim.regions()` does the
+        whole job of syntax-coloring this file.
+
+        If any plugin says so at indexing time, the regions of those whose
+        ``syntax_fallback`` attribute is true are left out.
+
+        """
+        return False
+
     def annotations_by_line(self):
         """Yield extra user-readable information about each line, hidden by
         default: compiler warnings that occurred there, for example.
@@ -399,6 +449,10 @@ class FileToIndex(FileToSkim):
         from the same plugin or different ones), all unique values will be
         retained using an elasticsearch array.
 
+        The needles go on the file's FILE doc only. Filters of domain FILE
+        get at them in line queries through the FILE docs, which are the
+        LINE docs' parents. See :func:`~dxr.filters.line_filter()`.
+
         """
         # We go with pairs rather than a map so we can just chain all these
         # together and pass them to a dict constructor: fewer temp vars.
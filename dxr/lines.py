@@ -1,16 +1,15 @@
 """Machinery for interspersing lines of text with linked and colored regions
 
-The typical entrypoints are es_lines() and html_line().
+The typical entrypoints are es_lines() and html_lines().
 
 Within this file, "tag" means a tuple of (file-wide offset, is_start, payload).
 
 """
 import cgi
-from itertools import chain
+from itertools import chain, izip
 try:
     from itertools import compress
 except ImportError:
-    from itertools import izip
     def compress(data, selectors):
         return (d for d, s in izip(data, selectors) if s)
 import json
@@ -21,6 +20,13 @@ from jinja2 import Markup
 from dxr.plugins import all_plugins
 from dxr.utils import without_ending
 
+try:
+    # Native versions of finished_tags() and friends. The Python ones below
+    # are the reference, and the native ones must give the same output.
+    from dxr import _lines as _native
+except ImportError:
+    _native = None
+
 
 class Line(object):
     """Representation of a line's beginning and ending as the contents of a tag
@@ -96,18 +102,24 @@ class Ref(object):
         return ret
 
     @staticmethod
-    def es_to_triple(es_data, tree):
+    def es_to_triple(es_data, tree, menus=None):
         """Convert ES-dwelling ref representation to a (start, end,
         :class:`~dxr.lines.Ref` subclass) triple.
 
         Return a subclass of Ref, chosen according to the ES data. Into its
         attributes "menu_data", "hover" and "qualname_hash", copy the ES
-        properties of the same names, JSON-decoding "menu_data" first.
+        properties of the same names, JSON-decoding "menu_data" first. If
+        there's a "menu_id" instead of "menu_data", look the data up in
+        ``menus``.
+
+        Return None if the Ref subclass or menu data can't be found.
 
         :arg es_data: An item from the array under the 'refs' key of an ES LINE
             document
         :arg tree: The :class:`~dxr.config.TreeConfig` representing the tree
             from which the ``es_data`` was pulled
+        :arg menus: The :func:`~dxr.menu_table.menu_table()` of the build
+            the ``es_data`` came from, if it has one
 
         """
         def ref_class(plugin, id):
@@ -123,12 +135,22 @@ class Ref(object):
 
         payload = es_data['payload']
         cls = ref_class(payload['plugin'], payload['id'])
-        return (es_data['start'],
-                es_data['end'],
-                cls(tree,
-                    json.loads(payload['menu_data']),
-                    hover=payload.get('hover'),
-                    qualname_hash=payload.get('qualname_hash')))
+        if 'menu_id' in payload:
+            menu_data = menus and menus.values(payload['menu_id'], limit=1)
+            if not menu_data:
+                warn('Menu %s was referenced in the index but not found in '
+                     'the menu table. Ignored.' % payload['menu_id'])
+                return None
+            menu_data = menu_data[0]
+        else:
+            menu_data = payload['menu_data']
+        if cls:
+            return (es_data['start'],
+                    es_data['end'],
+                    cls(tree,
+                        json.loads(menu_data),
+                        hover=payload.get('hover'),
+                        qualname_hash=payload.get('qualname_hash')))
 
     def menu_items(self):
         """Return an iterable of menu items to be attached to a ref.
@@ -464,6 +486,9 @@ def finished_tags(lines, refs, regions):
     """
     # Plugins return unicode offsets, not byte ones.
 
+    if _native:
+        return _native.finished_tags(lines, chain(refs, regions), LINE, Ref)
+
     # balanced_tags undoes the sorting, but we tolerate that in html_lines().
     # Remark: this sort is the memory peak, but it is not a significant use of
     # time in an indexing run.
@@ -504,6 +529,12 @@ def es_lines(tags):
         end of each line.
 
     """
+    if _native:
+        return _native.es_lines(tags, LINE)
+    return _es_lines(tags)
+
+
+def _es_lines(tags):
     for line in tags_per_line(tags):
         payloads = {}
         for pos, is_start, payload in line:
@@ -521,6 +552,30 @@ def es_lines(tags):
     # yield here to catch remnants.
 
 
+def es_line_buckets(tags):
+    """Yield a (refs, regions) pair for each line, splitting the output of
+    :func:`es_lines()` by payload type.
+
+    We bucket tags into refs and regions for ES because later at request
+    time we want to be able to merge them individually with those from
+    skimmers.
+
+    """
+    if _native:
+        return _native.es_line_buckets(tags, LINE)
+    return _es_line_buckets(tags)
+
+
+def _es_line_buckets(tags):
+    for line in _es_lines(tags):
+        refs, regions = [], []
+        for index_obj in line:
+            # Regions' payloads are just strings; refs' are objects.
+            (regions if isinstance(index_obj['payload'], basestring)
+                     else refs).append(index_obj)
+        yield refs, regions
+
+
 def html_line(text, tags, bof_offset):
     """Return a line of Markup, interleaved with the refs and regions that
     decorate it.
@@ -532,7 +587,22 @@ def html_line(text, tags, bof_offset):
         beginning of the file.
 
     """
-    def segments(text, tags, bof_offset):
+    if _native:
+        return Markup(_native.html_line(text, tags, bof_offset))
+    return Markup(_render_line(text, tags, bof_offset, {}, {}))
+
+
+def _render_line(text, tags, bof_offset, openers, closers):
+    """Return the unicode HTML of a line, looking up (and filling) the opener
+    and closer caches, dicts of markup by payload."""
+    def cached(cache, payload, method):
+        try:
+            return cache[payload]
+        except KeyError:
+            markup = cache[payload] = method()
+            return markup
+
+    def segments():
         up_to = 0
         for pos, is_start, payload in tags:
             # Convert from file-based position to line-based position.
@@ -540,9 +610,31 @@ def html_line(text, tags, bof_offset):
             yield cgi.escape(text[up_to:pos])
             up_to = pos
             if not is_start:  # It's a closer. Most common.
-                yield payload.closer()
+                yield cached(closers, payload, payload.closer)
             else:
-                yield payload.opener()
+                yield cached(openers, payload, payload.opener)
         yield cgi.escape(text[up_to:])
 
-    return Markup(u''.join(segments(text, tags, bof_offset)))
+    return u''.join(segments())
+
+
+def html_lines(texts, tags, offsets):
+    """Return a list of lines of Markup, like :func:`html_line()` for each
+    line of a file.
+
+    :arg texts: An iterable of the unicode text of each line
+    :arg tags: The output of :func:`finished_tags()` for the whole file
+    :arg offsets: An iterable of the offset of each line from the beginning
+        of the file
+
+    Refs and regions spanning several lines are rendered only once, which
+    saves lots of JSON-encoding of menus on big files.
+
+    """
+    if _native:
+        return [Markup(line) for line in
+                _native.html_lines(texts, tags, offsets, LINE)]
+    openers, closers = {}, {}
+    return [Markup(_render_line(text, tags_in_line, offset, openers, closers))
+            for text, tags_in_line, offset
+            in izip(texts, tags_per_line(tags), offsets)]
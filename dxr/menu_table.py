@@ -0,0 +1,57 @@
+"""Context menu data, stored once per distinct menu rather than once per ref
+
+A popular symbol can have tens of thousands of refs, each of which would
+otherwise carry the same JSON-encoded menu data in its LINE doc. When a build
+leaves artifacts, refs store just a short ``menu_id``, a hash of the data, and
+the data go once into a :class:`~dxr.artifacts.SortedTable` which the app
+looks IDs up in.
+
+Indexing workers each write sorted pieces of the table as they go, and
+:func:`merge_menu_pieces()` puts them together at the end.
+
+"""
+from hashlib import sha1
+from os.path import join
+
+from dxr.artifacts import merge_table_pieces, sorted_table, write_table_piece
+
+
+# The name of the artifact, and of the folder its pieces go in while indexing:
+MENU_TABLE = 'menus'
+PIECES = 'menus.pieces'
+
+# How many menus a worker holds onto before writing a piece
+PIECE_SIZE = 100000
+
+
+def intern_menus(refs, menus):
+    """Replace the ``menu_data`` of some refs' ES payloads with
+    ``menu_id``\ s, adding the data to the dict ``menus`` by ID."""
+    for ref in refs:
+        payload = ref['payload']
+        data = payload.pop('menu_data', None)
+        if data is not None:
+            menu_id = sha1(data).hexdigest()[:16]
+            menus[menu_id] = data
+            payload['menu_id'] = menu_id
+
+
+def write_menu_piece(folder, menus):
+    """Write the menus from :func:`intern_menus()` as a piece of the table in
+    the artifact folder ``folder``, and clear them out of the dict."""
+    if menus:
+        write_table_piece(join(folder, PIECES), menus.iteritems())
+        menus.clear()
+
+
+def merge_menu_pieces(folder):
+    """Merge the pieces written by :func:`write_menu_piece()` into one table,
+    and delete them."""
+    # Equal IDs mean equal data, so it doesn't matter which row is kept.
+    merge_table_pieces(join(folder, PIECES), join(folder, MENU_TABLE))
+
+
+def menu_table(artifact_folder):
+    """Return the menu table from an artifact folder, or None if it has
+    none."""
+    return sorted_table(artifact_folder, MENU_TABLE)
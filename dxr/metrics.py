@@ -0,0 +1,153 @@
+"""Latency instrumentation for the web app
+
+Each request is timed as a whole and by phase: parsing the query, waiting
+on ES, highlighting, rendering, and so on. Views mark out phases with
+:func:`phase()`, and they name the kind of request they're serving, so a
+search for ``regexp:`` terms is told apart from one for ``function:``
+terms. Each process keeps the most recent timings of each kind and phase
+in a :class:`Metrics`, which the ``/metrics`` endpoint reports as
+percentiles.
+
+Requests slower than ``slow_request_ms`` are logged with their breakdowns.
+With ``query_log`` set, searches are also appended to a log, which
+``dxr replay`` can run again later to benchmark a change.
+
+"""
+from collections import deque
+from contextlib import contextmanager
+from json import dumps
+from threading import Lock
+from time import time
+
+from flask import current_app, g, has_request_context, request
+
+
+# How many of the latest timings of each kind and phase to keep
+RESERVOIR_SIZE = 1000
+
+# The phase under which a request's whole time is recorded
+TOTAL = 'total'
+
+
+def percentile(sorted_values, fraction):
+    """Return the nearest-rank percentile of a sorted, non-empty list."""
+    index = int(round(fraction * (len(sorted_values) - 1)))
+    return sorted_values[index]
+
+
+class Metrics(object):
+    """Recent timings of the kinds of requests a process has served, by
+    phase"""
+
+    def __init__(self, reservoir_size=RESERVOIR_SIZE):
+        self._reservoir_size = reservoir_size
+        self._samples = {}
+        self._counts = {}
+        self._lock = Lock()
+
+    def record(self, kind, phase, seconds):
+        key = kind, phase
+        with self._lock:
+            samples = self._samples.get(key)
+            if samples is None:
+                samples = self._samples[key] = deque(
+                    maxlen=self._reservoir_size)
+            samples.append(seconds)
+            self._counts[key] = self._counts.get(key, 0) + 1
+
+    def summary(self):
+        """Return {kind: {phase: stats}}, where stats are the number of times
+        the phase has happened and percentiles, in milliseconds, of its
+        latest timings."""
+        with self._lock:
+            samples = dict((key, sorted(values)) for key, values in
+                           self._samples.iteritems())
+            counts = dict(self._counts)
+        ret = {}
+        for (kind, phase), values in samples.iteritems():
+            ret.setdefault(kind, {})[phase] = {
+                'count': counts[kind, phase],
+                'mean_ms': sum(values) / len(values) * 1000,
+                'p50_ms': percentile(values, 0.5) * 1000,
+                'p90_ms': percentile(values, 0.9) * 1000,
+                'p99_ms': percentile(values, 0.99) * 1000,
+                'max_ms': values[-1] * 1000}
+        return ret
+
+
+def query_type(terms):
+    """Return a name for the kind of search some query terms make up, like
+    "path+regexp"."""
+    return '+'.join(sorted(set(term['name'] for term in terms))) or 'empty'
+
+
+@contextmanager
+def phase(name):
+    """Time a phase of serving the current request, adding it to any earlier
+    time spent in a phase of the same name.
+
+    Outside a request, do nothing.
+
+    """
+    phases = getattr(g, 'dxr_phases', None) if has_request_context() else None
+    if phases is None:
+        yield
+        return
+    start = time()
+    try:
+        yield
+    finally:
+        phases[name] = phases.get(name, 0) + time() - start
+
+
+def set_kind(kind):
+    """Name the kind of the current request, for grouping its timings."""
+    g.dxr_kind = kind
+
+
+def log_query(entry):
+    """Note a search to go in the query log when the request finishes.
+
+    :arg entry: A JSON-serializable dict of what it takes to replay the
+        search
+
+    """
+    g.dxr_query = entry
+
+
+def start_timing():
+    """Start timing a request. A Flask ``before_request`` handler."""
+    g.dxr_start = time()
+    g.dxr_phases = {}
+
+
+_log_lock = Lock()
+
+
+def finish_timing(response):
+    """Record, and maybe log, the timings of a request. A Flask
+    ``after_request`` handler."""
+    start = getattr(g, 'dxr_start', None)
+    if start is None:
+        return response
+    elapsed = time() - start
+    kind = getattr(g, 'dxr_kind', None) or request.endpoint or 'unknown'
+    metrics = current_app.metrics
+    metrics.record(kind, TOTAL, elapsed)
+    for name, seconds in g.dxr_phases.iteritems():
+        metrics.record(kind, name, seconds)
+
+    config = current_app.dxr_config
+    ms = int(elapsed * 1000)
+    if config.slow_request_ms and ms >= config.slow_request_ms:
+        current_app.logger.warning(
+            'Slow request (%s ms) for %s: %s', ms, request.full_path,
+            ', '.join('%s %d ms' % (name, seconds * 1000) for name, seconds
+                      in sorted(g.dxr_phases.iteritems())))
+    query = getattr(g, 'dxr_query', None)
+    if query is not None and config.query_log:
+        line = dumps(dict(query, kind=kind, ms=ms)) + '\n'
+        with _log_lock:
+            with open(config.query_log, 'a') as log:
+                log.write(line)
+    return response
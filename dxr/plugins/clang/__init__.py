@@ -6,9 +6,12 @@ structural data to CSV files during compilation. This is then pulled into
 elasticsearch as a post-processing phase.
 
 """
+from schema import And, Optional, Use
+
+from dxr.config import Bool
 from dxr.plugins import Plugin, filters_from_namespace, refs_from_namespace
 from dxr.plugins.clang import direct, filters, menus
-from dxr.plugins.clang.indexers import TreeToIndex, mappings
+from dxr.plugins.clang.indexers import BUDGETS, TreeToIndex, mappings
 
 
 plugin = Plugin(filters=filters_from_namespace(filters.__dict__),
@@ -16,4 +19,12 @@ plugin = Plugin(filters=filters_from_namespace(filters.__dict__),
                 mappings=mappings,
                 badge_colors={'c': '#F4FAAA'},
                 direct_searchers=direct.searchers,
-                refs=refs_from_namespace(menus.__dict__))
+                refs=refs_from_namespace(menus.__dict__),
+                config_schema=dict(
+                    [(Optional('collector', default=False), Bool),
+                     (Optional('syntax_regions', default=False), Bool)] +
+                    [(Optional(name, default=default),
+                      And(Use(int),
+                          lambda v: v >= 0,
+                          error='"%s" must be a non-negative integer.' % name))
+                     for name, default in BUDGETS]))
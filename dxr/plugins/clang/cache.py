@@ -0,0 +1,203 @@
+"""A cache of the compiler plugin's CSVs, shared across trees and builds
+
+The CSVs are already content-addressed: each is named for the hashes of its
+source file's path and of its own contents. So a cache of them is just a
+folder of them, one per version of the plugin, since a new plugin may write
+different records for the same source. Instead of writing a CSV into its
+tree's temp folder, whoever has it (the plugin or the collector) makes sure
+it's in the cache and hard-links it from there. Many branches of the same
+codebase then share one copy of each header's records on disk.
+
+Entries are published by writing them under a temp name and renaming them
+into place, so concurrent builds never see half an entry. Linking an entry
+bumps its inode's ctime, which is what :func:`evict` goes by to throw out
+the least recently used ones.
+
+The per-file results of condensing the CSVs are cached alongside, keyed by
+the names of the CSVs they came from and a digest of the whole-program
+graphs they depend on.
+
+"""
+from cPickle import dump, load, HIGHEST_PROTOCOL, UnpicklingError
+from errno import EEXIST, ENOENT
+from fcntl import flock, LOCK_EX, LOCK_UN
+from hashlib import sha1
+import os
+from os.path import join, split
+from tempfile import mkstemp
+
+
+def plugin_version(plugin_path):
+    """Return a short identifier for the build of the compiler plugin at
+    ``plugin_path``."""
+    with open(plugin_path, 'rb') as file:
+        return sha1(file.read()).hexdigest()[:12]
+
+
+def _ensure_folder(folder):
+    try:
+        os.makedirs(folder)
+    except OSError as exc:
+        if exc.errno != EEXIST:
+            raise
+    return folder
+
+
+def version_folder(cache_folder, version):
+    """Return (and make, if need be) the folder for the CSVs written by a
+    version of the plugin."""
+    return _ensure_folder(join(cache_folder, 'clang', version))
+
+
+def link_or_write(folder, name, body, dest):
+    """Put ``body`` at ``dest`` by linking it from the cache ``folder`` under
+    ``name``, first publishing it there if it isn't already.
+
+    If linking or publishing doesn't work out (for instance, if the cache is
+    on another filesystem), just write ``dest``.
+
+    """
+    cached = join(folder, name)
+    for _ in xrange(2):
+        try:
+            os.link(cached, dest)
+            return
+        except OSError as exc:
+            if exc.errno == EEXIST:
+                return
+            if exc.errno != ENOENT:
+                break
+        try:
+            fd, temp = mkstemp(dir=folder, prefix='.' + name)
+        except OSError:
+            break
+        try:
+            with os.fdopen(fd, 'wb') as file:
+                file.write(body)
+            os.chmod(temp, 0644)
+            os.rename(temp, cached)
+        except (IOError, OSError):
+            # Say, an eviction took the temp file out from under us
+            try:
+                os.remove(temp)
+            except OSError:
+                pass
+            break
+    with open(dest, 'wb') as file:
+        file.write(body)
+
+
+def evict(cache_folder, max_bytes):
+    """Delete the least recently used CSVs of every plugin version until
+    those that are left take up at most ``max_bytes``.
+
+    Concurrent evictions are serialized with a lock on the folder. Builds
+    linking from entries while they're deleted just write their own copies.
+
+    Return the number of entries deleted.
+
+    """
+    root = join(cache_folder, 'clang')
+    if not os.path.isdir(root):
+        return 0
+    with open(join(cache_folder, '.lock'), 'w') as lock:
+        flock(lock, LOCK_EX)
+        try:
+            entries = []
+            total = 0
+            for dirpath, _, filenames in os.walk(root):
+                for filename in filenames:
+                    if filename.startswith('.'):
+                        continue  # Some build's entry, still being written
+                    path = join(dirpath, filename)
+                    try:
+                        stat = os.stat(path)
+                    except OSError:
+                        continue
+                    entries.append((stat.st_ctime, stat.st_size, path))
+                    total += stat.st_size
+            deleted = 0
+            entries.sort()
+            for _, size, path in entries:
+                if total <= max_bytes:
+                    break
+                try:
+                    os.remove(path)
+                except OSError as exc:
+                    if exc.errno != ENOENT:
+                        raise
+                total -= size
+                deleted += 1
+            return deleted
+        finally:
+            flock(lock, LOCK_UN)
+
+
+def graph_digest(graphs, roots):
+    """Return a hash of the parts of the whole-program graphs from
+    :func:`~dxr.plugins.clang.condense.condense_global` reachable from some
+    symbols, for telling whether results which depend on them are still
+    good.
+
+    A file's condensed data and needles look only at its own symbols' entries
+    and at what those lead to, so hashing just those keeps a new override
+    somewhere else in the tree from invalidating every file's results.
+
+    :arg graphs: An iterable of graphs, each {symbol: [(dest symbol, ...)]}
+    :arg roots: The symbols whose entries to start from
+
+    """
+    digest = sha1()
+    for graph in graphs:
+        reached = set()
+        stack = list(roots)
+        while stack:
+            key = stack.pop()
+            if key not in reached:
+                reached.add(key)
+                stack.extend(dest[0] for dest in graph.get(key, ()))
+        for key in sorted(reached):
+            if key in graph:
+                digest.update(repr((key, sorted(graph[key]))))
+        digest.update('\0')
+    return digest.hexdigest()
+
+
+def condensed_folder(cache_folder):
+    """Return (and make, if need be) the folder for condensed results."""
+    return _ensure_folder(join(cache_folder, 'clang', 'condensed'))
+
+
+def condensed_path(folder, key_parts):
+    """Return the path within ``folder`` at which to cache something
+    computed from ``key_parts``, an iterable of strings."""
+    digest = sha1()
+    for part in key_parts:
+        digest.update(part)
+        digest.update('\0')
+    return join(folder, digest.hexdigest() + '.pickle')
+
+
+def load_pickle(path):
+    """Return the object pickled at ``path``, or None if there isn't one.
+
+    Bump the entry's ctime, so :func:`evict` knows it's still in use.
+
+    """
+    try:
+        with open(path, 'rb') as file:
+            ret = load(file)
+        os.utime(path, None)
+        return ret
+    except (IOError, OSError, EOFError, UnpicklingError):
+        return None
+
+
+def save_pickle(path, obj):
+    """Atomically pickle ``obj`` to ``path``."""
+    folder, name = split(path)
+    fd, temp = mkstemp(dir=folder, prefix='.' + name)
+    with os.fdopen(fd, 'wb') as file:
+        dump(obj, file, HIGHEST_PROTOCOL)
+    os.chmod(temp, 0644)
+    os.rename(temp, path)
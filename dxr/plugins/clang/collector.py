@@ -0,0 +1,266 @@
+"""A local daemon which takes the compiler plugin's output over a Unix socket
+
+With a ``-j64`` build, every compiler process hashing its own CSVs and racing
+the others to create them with ``O_EXCL`` puts a lot of small-file IO on the
+critical path. When ``[[clang]] collector`` is on, the plugin instead streams
+each file's records here. We work out the CSV names, drop the blobs we've
+already got (headers come up in TU after TU), and leave the writing to a
+single thread, so the compilers can get on with compiling.
+
+Run as ``python -m dxr.plugins.clang.collector <socket path> <output folder>
+[<cache folder>]``. With a cache folder, CSVs are linked from the
+:mod:`~dxr.plugins.clang.cache` rather than written afresh.
+
+The plugin sends a series of frames, each of which is a kind byte, two
+network-order 32-bit lengths, and then that many bytes of name and of body:
+
+``c``
+    The records for one source file. The name is the file's path.
+``s``
+    A per-TU stats file. The name is the file name to write it under.
+``q``
+    A request for the counters, which are sent back as JSON, length-prefixed.
+``x``
+    A request to finish writing and quit. The final counters are sent back.
+
+If the collector can't be reached, the plugin writes its files itself, so
+the results are the same either way.
+
+"""
+from errno import ENOENT
+from hashlib import sha1
+from json import dumps, loads
+import os
+from os.path import exists, join
+from Queue import Queue
+from SocketServer import StreamRequestHandler, ThreadingUnixStreamServer
+import socket
+from struct import Struct
+from subprocess import Popen
+import sys
+from threading import Condition, Lock, Thread
+from time import sleep
+
+from dxr.plugins.clang.cache import link_or_write
+
+
+HEADER = Struct('!cII')
+LENGTH = Struct('!I')
+
+# How many blobs to take off the queue before syncing the write counters:
+BATCH_SIZE = 256
+
+
+class Collector(ThreadingUnixStreamServer):
+    """A server which dedups and writes out the plugin's CSVs"""
+
+    daemon_threads = True
+
+    def __init__(self, socket_path, folder, cache_folder=None):
+        self.folder = folder
+        self.cache_folder = cache_folder
+        # Names we've written or queued. Start with what's already there, in
+        # case a previous build of this tree left some behind:
+        self.seen = set(name for name in os.listdir(folder)
+                        if name.endswith('.csv'))
+        self.counters = dict(blobs=0, duplicates=0, bytes_written=0,
+                             files_written=0, connections=0, write_errors=0,
+                             first_write_error=None)
+        self._lock = Lock()
+        self._idle = Condition(self._lock)
+        self._active = 0
+        self._queue = Queue()
+        ThreadingUnixStreamServer.__init__(self, socket_path, _Handler)
+        writer = Thread(target=self._write_forever)
+        writer.daemon = True
+        writer.start()
+
+    def receive(self, kind, name, body):
+        """Dedup and queue up a blob for writing."""
+        if kind == 'c':
+            name = '%s.%s.csv' % (sha1(name).hexdigest(),
+                                  sha1(body).hexdigest())
+        with self._lock:
+            self.counters['blobs'] += 1
+            if name in self.seen:
+                self.counters['duplicates'] += 1
+                return
+            if kind == 'c':
+                self.seen.add(name)
+        self._queue.put((name, body))
+
+    def _write_forever(self):
+        """Write out queued blobs, in batches so the counters stay cheap.
+
+        A blob that can't be written, say because the disk is full, is
+        counted in ``write_errors`` rather than killing this, the only
+        writer, which would leave :meth:`flush()` waiting forever.
+
+        """
+        while True:
+            written = size = errors = 0
+            first_error = None
+            name, body = self._queue.get()
+            while True:
+                try:
+                    self._write(name, body)
+                except Exception as exc:
+                    errors += 1
+                    if first_error is None:
+                        first_error = 'Writing %s: %s' % (name, exc)
+                else:
+                    written += 1
+                    size += len(body)
+                finally:
+                    self._queue.task_done()
+                if written + errors >= BATCH_SIZE or self._queue.empty():
+                    break
+                name, body = self._queue.get()
+            with self._lock:
+                self.counters['files_written'] += written
+                self.counters['bytes_written'] += size
+                self.counters['write_errors'] += errors
+                if self.counters['first_write_error'] is None:
+                    self.counters['first_write_error'] = first_error
+
+    def _write(self, name, body):
+        path = join(self.folder, name)
+        if self.cache_folder and name.endswith('.csv'):
+            link_or_write(self.cache_folder, name, body, path)
+        else:
+            with open(path, 'wb') as file:
+                file.write(body)
+
+    def process_request(self, request, client_address):
+        # Count the connection here, in accept order, rather than in its
+        # thread, so flush() can't miss one that's been accepted but not yet
+        # started.
+        with self._lock:
+            self._active += 1
+            self.counters['connections'] += 1
+        ThreadingUnixStreamServer.process_request(self, request,
+                                                  client_address)
+
+    def disconnect(self):
+        with self._lock:
+            self._active -= 1
+            self._idle.notify_all()
+
+    def snapshot(self):
+        """Return a copy of the counters."""
+        with self._lock:
+            return dict(self.counters)
+
+    def flush(self):
+        """Wait for all other connections to finish and everything they sent
+        to hit the disk, and return the final counters."""
+        with self._lock:
+            while self._active > 1:  # not counting the one asking
+                self._idle.wait()
+        self._queue.join()
+        return self.snapshot()
+
+
+class _Handler(StreamRequestHandler):
+    def handle(self):
+        server = self.server
+        try:
+            while True:
+                header = self.rfile.read(HEADER.size)
+                if len(header) < HEADER.size:
+                    return
+                kind, name_length, body_length = HEADER.unpack(header)
+                name = self.rfile.read(name_length)
+                body = self.rfile.read(body_length)
+                if len(name) < name_length or len(body) < body_length:
+                    return  # The compiler died mid-frame. Drop it.
+                if kind in 'cs':
+                    server.receive(kind, name, body)
+                elif kind == 'q':
+                    self._reply(server.snapshot())
+                elif kind == 'x':
+                    self._reply(server.flush())
+                    # shutdown() waits on serve_forever(), which runs in
+                    # another thread than us.
+                    server.shutdown()
+                    return
+        finally:
+            server.disconnect()
+
+    def _reply(self, counters):
+        json = dumps(counters)
+        self.wfile.write(LENGTH.pack(len(json)) + json)
+        self.wfile.flush()
+
+
+def _die_with_parent(server, parent):
+    """Shut down if the process that started us goes away, as after a failed
+    build."""
+    while os.getppid() == parent:
+        sleep(1)
+    server.shutdown()
+
+
+def serve(socket_path, folder, cache_folder=None):
+    """Collect plugin output on ``socket_path`` until told to stop."""
+    server = Collector(socket_path, folder, cache_folder)
+    watchdog = Thread(target=_die_with_parent,
+                      args=(server, os.getppid()))
+    watchdog.daemon = True
+    watchdog.start()
+    try:
+        server.serve_forever()
+    finally:
+        server.server_close()
+        try:
+            os.remove(socket_path)
+        except OSError as exc:
+            if exc.errno != ENOENT:
+                raise
+
+
+def start(socket_path, folder, cache_folder=None, timeout=10):
+    """Start a collector in a new process, and return once it's listening.
+
+    Return the process.
+
+    """
+    process = Popen([sys.executable, '-m', __name__, socket_path, folder] +
+                    ([cache_folder] if cache_folder else []))
+    for _ in xrange(timeout * 20):
+        if exists(socket_path):
+            return process
+        if process.poll() is not None:
+            break
+        sleep(0.05)
+    raise RuntimeError("The clang plugin's output collector didn't start "
+                       "listening on %s." % socket_path)
+
+
+def _request(socket_path, kind):
+    """Send a request with no name or body, and return the JSON reply."""
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        sock.connect(socket_path)
+        sock.sendall(HEADER.pack(kind, 0, 0))
+        file = sock.makefile('rb')
+        length, = LENGTH.unpack(file.read(LENGTH.size))
+        return loads(file.read(length))
+    finally:
+        sock.close()
+
+
+def counters(socket_path):
+    """Return the live counters of the collector listening on
+    ``socket_path``."""
+    return _request(socket_path, 'q')
+
+
+def stop(socket_path):
+    """Have the collector on ``socket_path`` finish writing and quit, and
+    return its final counters."""
+    return _request(socket_path, 'x')
+
+
+if __name__ == '__main__':
+    serve(*sys.argv[1:4])
@@ -13,6 +13,7 @@ from os.path import join
 from funcy import decorator, identity, select_keys, imap, ifilter, remove
 
 from dxr.indexers import FuncSig, Position, Extent
+from dxr.plugins.clang.symbols import add_definition
 from dxr.utils import frozendict
 
 
@@ -22,7 +23,10 @@ class UselessLine(Exception):
 
 POSSIBLE_KINDS = set(['call', 'macro', 'function', 'func_override', 'variable',
                       'ref', 'type', 'impl', 'decldef', 'typedef', 'warning',
-                      'namespace', 'namespace_alias', 'include'])
+                      'namespace', 'namespace_alias', 'include', 'syntax'])
+
+# Fields holding the compiler's 64-bit symbol IDs, as hex:
+SYMBOL_FIELDS = ['sym', 'basesym', 'overriddensym']
 
 
 def c_type_sig(inputs, output, method=None):
@@ -56,19 +60,41 @@ def process_function(props):
     return props
 
 
+def symbol_key(props, prefix=''):
+    """Return the key under which the whole-program graphs store the symbol
+    described by some props.
+
+    That's the compiler's integer symbol ID, which is cheaper to hash, compare,
+    and keep around than the qualname. We fall back to the qualname for CSVs
+    that lack one.
+
+    :arg prefix: The prefix of the fields to look at: "base" for the
+        "basesym" and "basequalname" of an impl line, for instance
+
+    """
+    return props.get(prefix + 'sym', props.get(prefix + 'qualname'))
+
+
+def _process_sym(hex_id):
+    """Turn a 16-hex-digit symbol ID into a signed int, which fits in an ES
+    long."""
+    ret = int(hex_id, 16)
+    return ret - (1 << 64) if ret >= (1 << 63) else ret
+
+
 def process_maybe_override(overrides, overriddens, props):
     """Add 'has_overriddens', 'has_overrides' properties to props if the
-    qualname of this function appears in overrides, respectively
+    symbol of this function appears in overrides, respectively
     overriddens.
 
     """
-    qualname = props.get('qualname')
-    if qualname in overrides:
+    key = symbol_key(props)
+    if key in overrides:
         # Keys of overrides are functions that override something, so this
         # function has overriddens in the sense of the "Find overriddens" menu
         # option.
         props['has_overriddens'] = True
-    if qualname in overriddens:
+    if key in overriddens:
         props['has_overrides'] = True
 
     return props
@@ -99,15 +125,15 @@ def process_override(overrides, overriddens, props):
     """Note overrides of methods, and organize them so we can emit
     "overridden" and "overrides" needles later.
 
-    Specifically, extract the qualname of the overridden method and the
-    qualname and name of the overriding method, and squirrel it away in
-    ``overriddens``, keyed by base qualname::
+    Specifically, extract the symbol of the overridden method and the
+    symbol, qualname, and name of the overriding method, and squirrel it away
+    in ``overriddens``, keyed by base symbol (see :func:`symbol_key`)::
 
-        {'Base::foo()': set([('Derived::foo()', 'foo')])}
+        {<Base::foo() sym>: set([(<Derived::foo() sym>, 'Derived::foo()', 'foo')])}
 
     Also store the reverse mapping (override to overridden), in ``overrides``::
 
-        {'Derived::foo()': set([('Base::foo()', 'foo')])}
+        {<Derived::foo() sym>: set([(<Base::foo() sym>, 'Base::foo()', 'foo')])}
 
     This lets return indirect overrides (not just direct ones) in "overrides"
     queries.
@@ -116,14 +142,16 @@ def process_override(overrides, overriddens, props):
     # It may not be necessary to have a list here. In multiple inheritance,
     # does clang ever consider a method to override multiple other methods, or
     # is it at most one each?  Answer: clang recognizes multiple overriddens.
-    overrides.setdefault(props['qualname'], set()).add(
-            (props['overriddenqualname'], props['overriddenname']))
+    key, overridden_key = symbol_key(props), symbol_key(props, 'overridden')
+    overrides.setdefault(key, set()).add(
+            (overridden_key, props['overriddenqualname'],
+             props['overriddenname']))
 
     # We store the unqualified name separately for each override because,
     # while it's usually the same for each, it can be different for an
     # overridden destructor.
-    overriddens.setdefault(props['overriddenqualname'], set()).add(
-            (props['qualname'], props['name']))
+    overriddens.setdefault(overridden_key, set()).add(
+            (key, props['qualname'], props['name']))
 
     # No sense wasting RAM remembering anything:
     raise UselessLine
@@ -170,9 +198,10 @@ def process_maybe_impl(parents, children, props):
 
     """
     if props.get('kind') == 'class' or props.get('kind') == 'struct':
-        if props.get('qualname') in parents:
+        key = symbol_key(props)
+        if key in parents:
             props['has_base_class'] = True
-        if props.get('qualname') in children:
+        if key in children:
             props['has_subclass'] = True
 
     return props
@@ -181,19 +210,20 @@ def process_maybe_impl(parents, children, props):
 def process_impl(parents, children, props):
     """Contribute to the whole-program class hierarchy graphs.
 
-    :arg children: A dict that points from parents to children::
+    :arg children: A dict that points from parents' symbols to children::
 
-        {'Some::Parent': set([('A::Child', 'Child')])}
+        {<Some::Parent sym>: set([(<A::Child sym>, 'A::Child', 'Child')])}
 
-    :arg parents: A dict that points from children to parents::
+    :arg parents: A dict that points from children's symbols to parents::
 
-        {'A::Child': set([('Some::Parent', 'Parent)])}
+        {<A::Child sym>: set([(<Some::Parent sym>, 'Some::Parent', 'Parent')])}
 
     """
-    parents.setdefault(props['qualname'], set()).add(
-        (props['basequalname'], props['basename']))
-    children.setdefault(props['basequalname'], set()).add(
-        (props['qualname'], props['name']))
+    key, base_key = symbol_key(props), symbol_key(props, 'base')
+    parents.setdefault(key, set()).add(
+        (base_key, props['basequalname'], props['basename']))
+    children.setdefault(base_key, set()).add(
+        (key, props['qualname'], props['name']))
 
     # No need to waste memory keeping this in the per-file store:
     raise UselessLine
@@ -220,6 +250,10 @@ def condense_line(dispatch_table, kind, fields):
     :arg fields: The map constructed from the row's alternating keys and values
 
     """
+    for field in SYMBOL_FIELDS:
+        if field in fields:
+            fields[field] = _process_sym(fields[field])
+
     fields = dispatch_table.get(kind, identity)(fields)
 
     if 'loc' in fields:
@@ -296,13 +330,14 @@ def condense_file(csv_folder, file_path, overrides, overriddens, parents,
         compiler plugin
     :arg file_path: A path to the file to analyze, relative to the tree's
         source folder
-    :arg overrides: A dict whose keys are function qualnames that are overrides
-    :arg overriddens: A dict whose keys are function qualnames that are
+    :arg overrides: A dict whose keys are symbols of functions that are
+        overrides
+    :arg overriddens: A dict whose keys are symbols of functions that are
         overriddens
-    :arg parents: A dict whose keys are class or struct qualnames that have
-        parents
-    :arg children: A dict whose keys are class or struct qualnames that have
-        children
+    :arg parents: A dict whose keys are symbols of classes or structs that
+        have parents
+    :arg children: A dict whose keys are symbols of classes or structs that
+        have children
     :arg csv_names: An iterable of names of CSV files within ``csv_folder`` to
         process, minus their ".csv" extensions
 
@@ -320,7 +355,7 @@ def condense_file(csv_folder, file_path, overrides, overriddens, parents,
                     dispatch_table)
 
 
-def condense_global(csv_folder, csv_names):
+def condense_global(csv_folder, csv_names, definitions=None, includes=None):
     """Perform the whole-program data gathering necessary to emit "overridden"
     and subclass-related needles.
 
@@ -328,6 +363,10 @@ def condense_global(csv_folder, csv_names):
 
     :arg csv_names: An iterable of the names of CSV files (minus their
         extensions) in ``csv_folder``
+    :arg definitions: A set to add the definitions of things to, while we're
+        reading everything anyway, or None not to bother
+    :arg includes: A set to add (including path, included path) pairs to, or
+        None not to bother
 
     """
     def listify_keys(d):
@@ -342,6 +381,13 @@ def condense_global(csv_folder, csv_names):
     parents = {}
     children = {}
 
+    def wanted(kind, fields):
+        if definitions is not None:
+            add_definition(definitions, kind, fields)
+        if includes is not None and kind == 'include':
+            includes.add((fields['source_path'], fields['target_path']))
+        return kind == 'func_override' or kind == 'impl'
+
     # Load from all the CSVs only the impl lines and {function lines
     # containing overriddenname}. Ignore the direct return value and collect
     # what we want via the partials.
@@ -349,8 +395,7 @@ def condense_global(csv_folder, csv_names):
         lines_from_csvs(csv_folder, csv_names),
         {'impl': partial(process_impl, parents, children),
          'func_override': partial(process_override, overrides, overriddens)},
-        predicate=lambda kind, fields: (kind == 'func_override' or
-                                        kind == 'impl'))
+        predicate=wanted)
 
     # Turn some sets into lists. There's no need to keep them as sets, and
     # lists are tighter on RAM, which will make them faster to pass to workers.
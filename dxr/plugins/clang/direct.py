@@ -1,4 +1,5 @@
 from dxr.plugins import direct_search
+from dxr.plugins.clang.symbols import symbol_lookup
 
 
 def insensitive(field):
@@ -6,6 +7,7 @@ def insensitive(field):
         """Return an elasticsearch clause demanding a case-insensitive match of
         the term's ``arg`` against the given field."""
         return {'query': {'match': {field: term['arg']}}}
+    matcher.local_lookup = symbol_lookup(field)
     return matcher
 
 
@@ -14,6 +16,7 @@ def exact(field):
         """Return an elasticsearch clause demanding a case-sensitive match of
         the term's ``arg`` against the given field."""
         return {'term': {field: term['arg']}}
+    matcher.local_lookup = symbol_lookup(field)
     return matcher
 
 
@@ -23,6 +26,7 @@ def qualified(matcher):
     def up_giver(term):
         if '::' in term['arg']:
             return matcher(term)
+    up_giver.local_lookup = matcher.local_lookup
     return up_giver
 
 
@@ -1,6 +1,7 @@
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Basic/Module.h"
 #include "clang/Basic/SourceManager.h"
 #include "clang/Basic/Version.h"
 #include "clang/Frontend/CompilerInstance.h"
@@ -8,18 +9,31 @@
 #include "clang/Lex/Lexer.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Lex/PPCallbacks.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <map>
 #include <memory>
-#include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
 
 // Needed for sha1 hacks
+#include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include "sha1.h"
 
@@ -27,6 +41,12 @@
   (CLANG_VERSION_MAJOR > (major) || \
    (CLANG_VERSION_MAJOR == (major) && CLANG_VERSION_MINOR >= (minor)))
 
+// The makefile defines this when it finds clang's Index library, whence we
+// get USRs for symbol IDs.
+#ifdef DXR_HAVE_USR
+#include "clang/Index/USRGeneration.h"
+#endif
+
 using namespace clang;
 
 namespace {
@@ -62,27 +82,92 @@ const char *hash(std::string &str) {
   return hashstr;
 }
 
+// Like hash() but safe to call from several threads at once
+void hashInto(StringRef str, char hashstr[41]) {
+  unsigned char rawhash[20];
+  sha1::calc(str.data(), str.size(), rawhash);
+  sha1::toHexString(rawhash, hashstr);
+}
+
+// Copy a string into an arena, to live as long as the arena does.
+StringRef save(llvm::BumpPtrAllocator &arena, StringRef str) {
+  char *copy = static_cast<char *>(arena.Allocate(str.size(), 1));
+  memcpy(copy, str.data(), str.size());
+  return StringRef(copy, str.size());
+}
+
+// Call job(i) for each i in [0, count), spread over up to `threads` threads,
+// counting the calling one.
+template <typename Job>
+void parallelFor(size_t count, unsigned threads, Job job) {
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i; (i = next++) < count; )
+      job(i);
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < threads && t < count; ++t)
+    pool.emplace_back(worker);
+  worker();
+  for (std::thread &t : pool)
+    t.join();
+}
+
+// Limits on how much work and output pathological TUs get. Past them, we
+// degrade to cheaper output rather than blowing up the tail of the build.
+// A limit of 0 means none.
+struct Budgets {
+  unsigned long maxWalkMs;  // Past this, drop values and macro texts.
+  unsigned long maxFileBytes;  // Past this, drop a file's further records.
+  unsigned long maxValueLength;
+  unsigned long maxEvalElements;  // Don't constant-evaluate bigger arrays.
+  unsigned long maxMacroTextLength;
+  unsigned long maxQualnameLength;
+};
+
+// Return the number in an env var, or fallback if it isn't set.
+unsigned long envNumber(const char *name, unsigned long fallback) {
+  const char *value = getenv(name);
+  return value ? strtoul(value, nullptr, 10) : fallback;
+}
+
+// Cut s down to about limit bytes, without splitting a UTF-8 sequence, and
+// mark that we did. Return whether we had to.
+bool truncateText(std::string &s, unsigned long limit) {
+  if (!limit || s.size() <= limit)
+    return false;
+  while (limit && (s[limit] & 0xC0) == 0x80)
+    --limit;
+  s.resize(limit);
+  s += "...";
+  return true;
+}
+
+// FileInfos live in their TU's arena, as does their realname.
 struct FileInfo {
-  FileInfo(std::string &rname) : realname(rname) {
-    interesting = rname.compare(0, srcdir.length(), srcdir) == 0;
+  FileInfo(StringRef rname, llvm::BumpPtrAllocator &arena) : info(buffer) {
+    interesting = rname.startswith(srcdir);
     if (interesting) {
       // Remove the trailing `/' as well.
-      realname.erase(0, srcdir.length() + 1);
-    } else if (rname.compare(0, output.length(), output) == 0) {
+      realname = save(arena, rname.substr(srcdir.length() + 1));
+    } else if (rname.startswith(output)) {
       // We're in the output directory, so we are probably a generated header.
       // We use the escape character to indicate the objdir nature.
       // Note that output also has the `/' already placed.
       interesting = true;
-      realname.replace(0, output.length(), GENERATED);
+      realname = save(arena, GENERATED + rname.substr(output.length()).str());
+    } else {
+      realname = save(arena, rname);
     }
   }
-  std::string realname;
-  std::ostringstream info;
+  StringRef realname;
+  SourceLocation start;  // Of one inclusion of the file, once we've seen it
+  std::string buffer;
+  llvm::raw_string_ostream info;  // Writes to buffer
   bool interesting;
   static std::string srcdir;  // the project source directory
   static std::string output;  // the project build directory
 };
-typedef std::shared_ptr<FileInfo> FileInfoPtr;
 
 class IndexConsumer;
 
@@ -140,6 +225,10 @@ public:
       StringRef searchPath,
       StringRef relativePath,
       const Module *imported) override;
+#if CLANG_AT_LEAST(3, 6)
+  void moduleImport(SourceLocation importLoc, ModuleIdPath path,
+                    const Module *imported) override;
+#endif
 };
 
 // IndexConsumer is our primary AST consumer.
@@ -149,10 +238,15 @@ class IndexConsumer : public ASTConsumer,
 private:
   CompilerInstance &ci;
   SourceManager &sm;
-  std::ostream *out;
-  std::map<std::string, FileInfoPtr> relmap;
-  // Map the SourceLocation of a macro to the text of the macro def.
-  std::map<SourceLocation, std::string> macromap;
+  // Per-TU state that lives until the TU is done is bump-allocated from here
+  // and freed all at once at the end.
+  llvm::BumpPtrAllocator arena;
+  llvm::raw_ostream *out;
+  // Map both the names we're given and their realpaths to FileInfos.
+  llvm::StringMap<FileInfo *, llvm::BumpPtrAllocator &> relmap;
+  std::vector<FileInfo *> files;  // Each FileInfo once, for output
+  // Map the raw SourceLocation of a macro to the text of the macro def.
+  llvm::DenseMap<unsigned, StringRef> macromap;
   LangOptions &features;
 #if CLANG_AT_LEAST(3, 6)
   std::unique_ptr<DiagnosticConsumer> inner;
@@ -160,37 +254,58 @@ private:
   DiagnosticConsumer *inner;
 #endif
   static std::string tmpdir;  // Place to save all the csv files to
+  static unsigned threads;  // How many threads to use for output
+  static std::string collectorSocket;  // Where to stream output, if anywhere
+  static std::string cachedir;  // Shared cache of csv files, if any
+  static Budgets budgets;
+  static bool syntax;  // Whether to record token classes for highlighting
   PrintingPolicy printPolicy;
 
-  const FileInfoPtr &getFileInfo(const std::string &filename) {
-    std::map<std::string, FileInfoPtr>::iterator it;
-    it = relmap.find(filename);
-    if (it == relmap.end()) {
-      // Check if we have this file stored under a canonicalized key.
-      char *real = realpath(filename.c_str(), nullptr);
-      std::string realstr(real ? real : filename.c_str());
-      free(real);
-      it = relmap.find(realstr);
-      if (it == relmap.end()) {
-        // We haven't seen this file before. We need to make the FileInfo
-        // structure information ourselves.
-        it = relmap.insert(make_pair(realstr,
-                                     std::make_shared<FileInfo>(realstr))).first;
-      }
-      // Note that the map values for the filename and realstr keys will both
-      // point to the same FileInfo object, which is what we want.
-      it = relmap.insert(make_pair(filename, it->second)).first;
+  // Memoized formatting. The same decls and files come up in record after
+  // record, and printing qualnames (types and all) is the bulk of the walk.
+  // The strings are in the arena.
+  llvm::DenseMap<const NamedDecl *, StringRef> qualnames;
+  llvm::DenseMap<const NamedDecl *, StringRef> symbolIds;
+  llvm::DenseMap<FileID, FileInfo *> filesByID;
+
+  // Counters for the stats file
+  unsigned long records;
+  std::chrono::steady_clock::time_point startTime;
+  // Ways we've degraded to stay within budget, also for the stats file
+  bool overTime;
+  unsigned long valuesSkipped, valuesTruncated, macroTextsSkipped,
+                macroTextsTruncated, qualnamesTruncated, recordsDropped;
+
+  FileInfo *getFileInfo(StringRef filename) {
+    llvm::StringMap<FileInfo *, llvm::BumpPtrAllocator &>::iterator it =
+      relmap.find(filename);
+    if (it != relmap.end())
+      return it->second;
+    // Check if we have this file stored under a canonicalized key.
+    std::string filenamestr = filename.str();
+    char *real = realpath(filenamestr.c_str(), nullptr);
+    std::string realstr(real ? real : filenamestr);
+    free(real);
+    FileInfo *&canonical = relmap[realstr];
+    if (!canonical) {
+      // We haven't seen this file before. We need to make the FileInfo
+      // structure information ourselves.
+      canonical = new (arena.Allocate<FileInfo>()) FileInfo(realstr, arena);
+      files.push_back(canonical);
     }
-    return it->second;
-  }
-  const FileInfoPtr &getFileInfo(const char *filename) {
-    std::string filenamestr(filename);
-    return getFileInfo(filenamestr);
+    // Note that the map values for the filename and realstr keys will both
+    // point to the same FileInfo object, which is what we want.
+    FileInfo *ret = canonical;
+    relmap[filename] = ret;
+    return ret;
   }
 public:
   IndexConsumer(CompilerInstance &ci)
-    : ci(ci), sm(ci.getSourceManager()), features(ci.getLangOpts()),
-      printPolicy(features) {
+    : ci(ci), sm(ci.getSourceManager()), relmap(arena),
+      features(ci.getLangOpts()), printPolicy(features), records(0),
+      startTime(std::chrono::steady_clock::now()), overTime(false),
+      valuesSkipped(0), valuesTruncated(0), macroTextsSkipped(0),
+      macroTextsTruncated(0), qualnamesTruncated(0), recordsDropped(0) {
 
     inner = ci.getDiagnostics().takeClient();
     ci.getDiagnostics().setClient(this, false);
@@ -208,6 +323,10 @@ public:
   }
 
   ~IndexConsumer() {
+    // The arena frees their memory but doesn't run their destructors.
+    for (std::vector<FileInfo *>::iterator it = files.begin();
+         it != files.end(); ++it)
+      (*it)->~FileInfo();
 #if CLANG_AT_LEAST(3, 6)
     ci.getDiagnostics().setClient(inner.release());
 #else
@@ -225,6 +344,13 @@ public:
 #endif
 
   static void setTmpDir(const std::string& dir) { tmpdir = dir; }
+  static void setThreads(unsigned n) { threads = n; }
+  static void setCollectorSocket(const std::string &path) {
+    collectorSocket = path;
+  }
+  static void setCacheDir(const std::string &dir) { cachedir = dir; }
+  static void setBudgets(const Budgets &b) { budgets = b; }
+  static void setSyntax(bool s) { syntax = s; }
 
   //// Helpers for processing declarations
 
@@ -237,14 +363,26 @@ public:
     // et al. On the other hand, if I just do spelling, I get really wrong
     // values for locations in macros, especially when ## is involved.
     // TODO: So yeah, maybe use sm.getFilename(loc) instead.
-    std::string filename = sm.getPresumedLoc(loc).getFilename();
+    StringRef filename = sm.getPresumedLoc(loc).getFilename();
     // Invalid locations and built-ins: not interesting at all
-    if (filename[0] == '<')
+    if (filename.startswith("<"))
       return false;
 
     // Get the real filename
-    const FileInfoPtr &f = getFileInfo(filename);
-    return f->interesting;
+    return getFileInfo(filename)->interesting;
+  }
+
+  // Return the FileInfo for the file a location is in, looking it up by
+  // FileID first to spare a string copy and map search per record.
+  FileInfo &fileInfoFor(SourceLocation loc) {
+    FileID fid = sm.getFileID(loc);
+    FileInfo *&f = filesByID[fid];
+    if (!f) {
+      f = getFileInfo(sm.getFilename(loc));
+      if (f->start.isInvalid() && sm.getFileEntryForID(fid))
+        f->start = sm.getLocForStartOfFile(fid);
+    }
+    return *f;
   }
 
   // Return a source location's file path, line, and column, or '' if the
@@ -261,7 +399,7 @@ public:
       if (!isInvalid) {
         // getFilename seems to want a SpellingLoc. I may be disappointing
         // it. I'm not sure what it will do if it's disappointed.
-        buffer = getFileInfo(sm.getFilename(loc).str())->realname;
+        buffer = fileInfoFor(loc).realname.str();
         buffer += ":";
         buffer += line;
         buffer += ":";
@@ -300,10 +438,32 @@ public:
       recordValue("locend", locationToString(afterToken(endLoc)));
   }
 
+  StringRef getQualifiedName(const NamedDecl &d) {
+    llvm::DenseMap<const NamedDecl *, StringRef>::iterator it =
+      qualnames.find(&d);
+    if (it != qualnames.end())
+      return it->second;
+    std::string name = formatQualifiedName(d);
+    if (budgets.maxQualnameLength &&
+        name.size() > budgets.maxQualnameLength) {
+      // Qualnames key the graphs and menus, so tell truncated ones apart by
+      // a hash of the whole thing.
+      char digest[41];
+      hashInto(name, digest);
+      truncateText(name, budgets.maxQualnameLength);
+      name += "#";
+      name.append(digest, 16);
+      ++qualnamesTruncated;
+    }
+    StringRef ret = save(arena, name);
+    qualnames[&d] = ret;
+    return ret;
+  }
+
   // This is a wrapper around NamedDecl::getQualifiedNameAsString.
   // It produces more qualified output to distinguish several cases
   // which would otherwise be ambiguous.
-  std::string getQualifiedName(const NamedDecl &d) {
+  std::string formatQualifiedName(const NamedDecl &d) {
     std::string ret;
     const FunctionDecl *fd = nullptr;
     const DeclContext *ctx = d.getDeclContext();
@@ -312,7 +472,8 @@ public:
       // d.getQualifiedNameAsString() will return the unqualifed name for this
       // but we want an actual qualified name so we can distinguish variables
       // with the same name but that are in different functions.
-      ret = getQualifiedName(*cast<NamedDecl>(ctx)) + "::" + d.getNameAsString();
+      ret = getQualifiedName(*cast<NamedDecl>(ctx)).str() + "::" +
+        d.getNameAsString();
     }
     else {
       if ((fd = dyn_cast<FunctionDecl>(&d))) {  // A function
@@ -377,38 +538,79 @@ public:
 #endif
     if (StringRef(ret).startswith(anon_ns)) {
       const std::string &filename = ci.getFrontendOpts().Inputs[0].getFile().str();
-      const std::string &realname = getFileInfo(filename)->realname;
+      const std::string &realname = getFileInfo(filename)->realname.str();
       ret = "(" + ret.substr(1, anon_ns.size() - 2) + " in " + realname + ")" +
         ret.substr(anon_ns.size());
     }
     return ret;
   }
 
+  // Return a stable 64-bit identifier for a decl as 16 hex digits. It's
+  // derived from clang's USR when we can get one, so it agrees across
+  // translation units without string comparisons downstream, and from the
+  // qualname otherwise.
+  StringRef getSymbolId(const NamedDecl &d, StringRef qualname) {
+    llvm::DenseMap<const NamedDecl *, StringRef>::iterator it =
+      symbolIds.find(&d);
+    if (it != symbolIds.end())
+      return it->second;
+    SmallString<128> usr;
+#ifdef DXR_HAVE_USR
+    const Decl *target = &d;
+    if (const FunctionDecl *fd = dyn_cast<FunctionDecl>(target)) {
+      // Match getQualifiedName(), which names instantiations after their
+      // template.
+      if (fd->isTemplateInstantiation() && fd->getTemplateInstantiationPattern())
+        target = fd->getTemplateInstantiationPattern();
+    }
+    if (index::generateUSRForDecl(target->getCanonicalDecl(), usr))
+      usr.clear();  // No USR for this kind of decl
+#endif
+    std::string key = usr.empty() ? qualname.str() : usr.str().str();
+    StringRef ret = save(arena, StringRef(hash(key), 16));
+    symbolIds[&d] = ret;
+    return ret;
+  }
+
+  void recordQualname(const NamedDecl &d, const char *qualnameKey = "qualname",
+                      const char *symKey = "sym") {
+    StringRef qualname = getQualifiedName(d);
+    recordValue(qualnameKey, qualname);
+    recordValue(symKey, getSymbolId(d, qualname));
+  }
+
   // Switch the output pointer to a specific file's CSV, and write a line header
   // to it.
   void beginRecord(const char *name, SourceLocation loc) {
     // Only a PresumedLoc has a getFilename() method, unfortunately. We'd
     // rather have the expansion location than the presumed one, as we're not
     // interested in lies told by the #lines directive.
-    StringRef filename = sm.getFilename(loc);
-    const FileInfoPtr &f = getFileInfo(filename);
-    out = &(f->info);
+    FileInfo &file = fileInfoFor(loc);
+    if (budgets.maxFileBytes && file.info.tell() >= budgets.maxFileBytes) {
+      // Let the caller write the record into the void.
+      out = &llvm::nulls();
+      ++recordsDropped;
+      return;
+    }
+    out = &file.info;
     *out << name;
+    // Checking the clock every record would cost more than it's worth.
+    if (++records % 1024 == 0 && budgets.maxWalkMs && !overTime)
+      overTime = std::chrono::steady_clock::now() - startTime >
+                 std::chrono::milliseconds(budgets.maxWalkMs);
   }
 
-  void recordValue(const char *key, std::string value, bool needQuotes=false) {
+  void recordValue(const char *key, StringRef value, bool needQuotes=false) {
     *out << "," << key << ",\"";
-    int start = 0;
     if (needQuotes) {
-      int quote = value.find('"');
-      while (quote != -1) {
+      size_t quote;
+      while ((quote = value.find('"')) != StringRef::npos) {
         // Need to repeat the "
-        *out << value.substr(start, quote - start + 1) << "\"";
-        start = quote + 1;
-        quote = value.find('"', start);
+        *out << value.substr(0, quote + 1) << "\"";
+        value = value.substr(quote + 1);
       }
     }
-    *out << value.substr(start) << "\"";
+    *out << value << "\"";
   }
 
   // If we're in a macro definition or even a stack of macros that all call
@@ -466,14 +668,110 @@ public:
                                                   // expansion location.
     std::string name = decl->getNameAsString();
     recordValue("name", name);
-    recordValue("qualname", getQualifiedName(*def));
+    recordQualname(*def);
     recordValue("loc", locationToString(decl->getLocation()));
     recordValue("locend",
                 locationToString(afterToken(decl->getLocation(), name)));
     recordValue("defloc", locationToString(def->getLocation()));
     if (kind)
       recordValue("kind", kind);
-    *out << std::endl;
+    *out << '\n';
+  }
+
+  // Declarations that came from a PCH or module are skipped (see
+  // TraverseDecl), so when this TU supplies their definition, emit their
+  // decldef records from here instead.
+  template <typename DeclT>
+  void declDefImportedRedecls(const char *kind, DeclT *def) {
+    for (typename DeclT::redecl_iterator it = def->redecls_begin(),
+           end = def->redecls_end();
+         it != end; ++it) {
+      if (it->isFromASTFile() && interestingLocation(it->getLocation()))
+        declDef(kind, *it, def, it->getLocation(),
+                afterToken(it->getLocation()));
+    }
+  }
+
+  // Raw-lex a whole file, comments and all, and record the extents of its
+  // keywords, literals, comments, and preprocessor directives, so the
+  // indexer can color it without running a regex lexer over it. Raw lexing
+  // goes by the text as written, so code in skipped #if blocks gets colored
+  // too.
+  //
+  // The extents go in one "regions" value, as space-separated
+  // <class><row>:<col>-<row>:<col> items, with classes k (keyword), s
+  // (string or char literal), n (number), c (comment), and p (directive).
+  void recordSyntax(FileInfo &file) {
+    bool invalid = false;
+    StringRef text = sm.getBufferData(sm.getFileID(file.start), &invalid);
+    if (invalid)
+      return;
+    Lexer lexer(file.start, features, text.begin(), text.begin(), text.end());
+    lexer.SetCommentRetentionState(true);
+    Preprocessor &pp = ci.getPreprocessor();
+
+    std::string regions;
+    llvm::raw_string_ostream os(regions);
+    // Track rows and columns ourselves as we go; the tokens come in order.
+    // Newlines are counted the way universal-newline splitting does.
+    unsigned row = 1, col = 0;
+    size_t at = 0;
+    auto advance = [&](size_t to) {
+      for (; at < to; ++at) {
+        char c = text[at];
+        if (c == '\n' ||
+            (c == '\r' && (at + 1 == text.size() || text[at + 1] != '\n'))) {
+          ++row;
+          col = 0;
+        } else {
+          ++col;
+        }
+      }
+    };
+    size_t directiveStart = 0;
+    bool afterHash = false;  // Just past a # starting a line
+    for (Token tok; ; ) {
+      lexer.LexFromRawLexer(tok);
+      if (tok.is(tok::eof))
+        break;
+      size_t begin = sm.getFileOffset(tok.getLocation());
+      char cls = 0;
+      if (tok.is(tok::comment)) {
+        cls = 'c';
+      } else if (tok.is(tok::numeric_constant)) {
+        cls = 'n';
+      } else if (tok::isLiteral(tok.getKind())) {
+        cls = 's';
+      } else if (tok.is(tok::hash) && tok.isAtStartOfLine()) {
+        directiveStart = begin;
+        afterHash = true;
+        continue;
+      } else if (tok.is(tok::raw_identifier)) {
+        if (afterHash) {
+          // Color the # and the directive's name together.
+          cls = 'p';
+          begin = directiveStart;
+        } else {
+          // Raw identifiers turn into keywords here if they are any.
+          pp.LookUpIdentifierInfo(tok);
+          if (tok.isNot(tok::identifier))
+            cls = 'k';
+        }
+      }
+      afterHash = false;
+      if (!cls)
+        continue;
+      advance(begin);
+      os << ' ' << cls << row << ':' << col;
+      advance(sm.getFileOffset(tok.getLocation()) + tok.getLength());
+      os << '-' << row << ':' << col;
+    }
+    os.flush();
+    if (regions.empty())
+      return;
+    beginRecord("syntax", file.start);
+    recordValue("regions", StringRef(regions).substr(1));
+    *out << '\n';
   }
 
   //// AST processing overrides
@@ -481,33 +779,270 @@ public:
   // All we need is to follow the final declaration.
   void HandleTranslationUnit(ASTContext &ctx) override {
     TraverseDecl(ctx.getTranslationUnitDecl());
+    // Files we recorded nothing about have no start location. They're left
+    // for the indexer to color some other way.
+    if (syntax) {
+      for (std::vector<FileInfo *>::iterator it = files.begin();
+           it != files.end(); ++it)
+        if ((*it)->interesting && (*it)->start.isValid())
+          recordSyntax(**it);
+    }
+    std::chrono::steady_clock::time_point walkEnd =
+      std::chrono::steady_clock::now();
 
     // Emit all files now
-    std::map<std::string, FileInfoPtr>::iterator it;
-    for (it = relmap.begin(); it != relmap.end(); it++) {
-      if (!it->second->interesting)
-        continue;
+    struct Output {
+      FileInfo *file;
+      std::string filename;
+    };
+    std::vector<Output> outputs;
+    unsigned long bytes = 0;
+    for (std::vector<FileInfo *>::iterator it = files.begin();
+         it != files.end(); ++it) {
       // Look at how much code we have
-      std::string content = it->second->info.str();
-      if (content.length() == 0)
-        continue;
-      std::string filename = tmpdir;
+      if ((*it)->interesting && !(*it)->info.str().empty()) {
+        outputs.push_back(Output{*it});
+        bytes += (*it)->buffer.length();
+      }
+    }
+
+    // If there's a collector, hand it everything and let it work out names
+    // and dupes. If it's gone away partway, the files we write ourselves
+    // will just be the same ones it would have.
+    int collector = connectCollector();
+    if (collector != -1) {
+      bool sent = true;
+      for (std::vector<Output>::iterator o = outputs.begin();
+           sent && o != outputs.end(); ++o)
+        sent = sendFrame(collector, 'c', o->file->realname, o->file->buffer);
+      if (sent) {
+        writeStats(walkEnd, outputs.size(), bytes, collector);
+        close(collector);
+        return;
+      }
+      close(collector);
+    }
+
+    // Hashing and writing the CSVs doesn't touch the AST, so the whole batch
+    // can go wide. The hashing is a good share of the time spent on big TUs,
+    // and on network-backed temp folders, so is waiting on each write in
+    // turn.
+    parallelFor(outputs.size(), threads, [&](size_t i) {
+      Output &o = outputs[i];
+      char hashstr[41];
       // Hashing the filename allows us to not worry about the file structure
       // not matching up.
-      filename += hash(it->second->realname);
-      filename += ".";
-      filename += hash(content);
-      filename += ".csv";
-
+      hashInto(o.file->realname, hashstr);
+      std::string name = hashstr;
+      name += ".";
+      hashInto(o.file->buffer, hashstr);
+      name += hashstr;
+      name += ".csv";
+      o.filename = tmpdir + name;
+
+      const std::string &content = o.file->buffer;
+      if (!cachedir.empty() && linkFromCache(name, o.filename, content))
+        return;
       // Okay, I want to use the standard library for I/O as much as possible,
       // but the C/C++ standard library does not have the feature of "open
       // succeeds only if it doesn't exist."
-      int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+      int fd = open(o.filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
       if (fd != -1) {
-        write(fd, content.c_str(), content.length());
+        bool written = writeAll(fd, content.c_str(), content.length());
+        int error = errno;
         close(fd);
+        if (!written) {
+          // Left under its content-hash name, a truncated CSV would never be
+          // rewritten, thanks to O_EXCL. Build the message whole, since other
+          // threads may be complaining at the same time.
+          unlink(o.filename.c_str());
+          std::string message = "dxr-index: couldn't write " + o.filename +
+                                ": " + strerror(error) + "\n";
+          llvm::errs() << message;
+        }
+      }
+    });
+
+    writeStats(walkEnd, outputs.size(), bytes, -1);
+  }
+
+  // Link the CSV called name from the shared cache to dest, first putting
+  // it in the cache if it isn't there. An entry is written under a temp
+  // name and renamed into place, so nobody links half of one. Return false
+  // if linking doesn't work out, say because the cache is on another
+  // filesystem, in which case dest is left for the caller to write.
+  static bool linkFromCache(const std::string &name, const std::string &dest,
+                            const std::string &content) {
+    std::string cached = cachedir + name;
+    for (int tries = 0; tries < 2; ++tries) {
+      if (link(cached.c_str(), dest.c_str()) == 0 || errno == EEXIST)
+        return true;
+      if (errno != ENOENT)
+        return false;
+      std::string temp = cachedir + "." + name + ".XXXXXX";
+      int fd = mkstemp(&temp[0]);
+      if (fd == -1)
+        return false;
+      bool written = writeAll(fd, content.c_str(), content.length());
+      fchmod(fd, 0644);
+      close(fd);
+      if (!written || rename(temp.c_str(), cached.c_str()) == -1) {
+        unlink(temp.c_str());
+        return false;
       }
     }
+    return false;
+  }
+
+  // Connect to the output collector. Return the socket, or -1 if there's
+  // no collector or it can't be reached.
+  static int connectCollector() {
+    struct sockaddr_un addr;
+    if (collectorSocket.empty() ||
+        collectorSocket.length() >= sizeof(addr.sun_path))
+      return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1)
+      return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, collectorSocket.c_str(), collectorSocket.length());
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  static bool writeAll(int fd, const char *data, size_t length) {
+    while (length) {
+      ssize_t n = write(fd, data, length);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      data += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  // Send all of data, without taking a SIGPIPE if the collector has died.
+  static bool sendAll(int fd, const char *data, size_t length) {
+    while (length) {
+      ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+      if (n == -1) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      data += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  // Send a frame in the collector's protocol: a kind byte, the lengths of
+  // the name and body as network-order 32-bit ints, then the name and body.
+  static bool sendFrame(int fd, char kind, StringRef name, StringRef body) {
+    char header[9];
+    uint32_t nameLength = htonl(name.size());
+    uint32_t bodyLength = htonl(body.size());
+    header[0] = kind;
+    memcpy(header + 1, &nameLength, 4);
+    memcpy(header + 5, &bodyLength, 4);
+    return sendAll(fd, header, sizeof(header)) &&
+           sendAll(fd, name.data(), name.size()) &&
+           sendAll(fd, body.data(), body.size());
+  }
+
+  // Write a one-line summary of what indexing this TU cost, in the same
+  // format as the CSVs, to <tmpdir>/<hash of main file>.<pid>.stats. If
+  // collector isn't -1, send it there to write instead.
+  void writeStats(std::chrono::steady_clock::time_point walkEnd,
+                  size_t fileCount, unsigned long bytes, int collector) {
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+    std::chrono::steady_clock::time_point end =
+      std::chrono::steady_clock::now();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::string mainFile = ci.getFrontendOpts().Inputs[0].getFile().str();
+    std::string stats;
+    llvm::raw_string_ostream statsOut(stats);
+    out = &statsOut;
+    *out << "stats";
+    recordValue("file", getFileInfo(mainFile)->realname);
+    recordValue("records", std::to_string(records));
+    recordValue("files", std::to_string(fileCount));
+    recordValue("bytes", std::to_string(bytes));
+    // The arena holds all the per-TU state that lives to the end, so this is
+    // our peak, give or take the hash maps indexing it.
+    recordValue("arena_bytes", std::to_string(arena.getTotalMemory()));
+    recordValue("max_rss_kb", std::to_string(usage.ru_maxrss));
+    recordValue("walk_ms", std::to_string(
+      duration_cast<milliseconds>(walkEnd - startTime).count()));
+    recordValue("output_ms", std::to_string(
+      duration_cast<milliseconds>(end - walkEnd).count()));
+    recordValue("values_skipped", std::to_string(valuesSkipped));
+    recordValue("values_truncated", std::to_string(valuesTruncated));
+    recordValue("macro_texts_skipped", std::to_string(macroTextsSkipped));
+    recordValue("macro_texts_truncated", std::to_string(macroTextsTruncated));
+    recordValue("qualnames_truncated", std::to_string(qualnamesTruncated));
+    recordValue("records_dropped", std::to_string(recordsDropped));
+    // Summed across TUs, this counts the ones that hit any budget:
+    recordValue("over_budget", (overTime || valuesSkipped ||
+                                valuesTruncated || macroTextsSkipped ||
+                                macroTextsTruncated || qualnamesTruncated ||
+                                recordsDropped) ? "1" : "0");
+    *out << '\n';
+    statsOut.flush();
+    out = nullptr;
+
+    std::string basename = hash(mainFile);
+    basename += ".";
+    basename += std::to_string(getpid());
+    basename += ".stats";
+    if (collector != -1 && sendFrame(collector, 's', basename, stats))
+      return;
+    std::string filename = tmpdir + basename;
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd != -1 && writeAll(fd, stats.c_str(), stats.length());
+    if (!written) {
+      int error = errno;
+      llvm::errs() << "dxr-index: couldn't write " << filename << ": "
+                   << strerror(error) << '\n';
+    }
+    if (fd != -1)
+      close(fd);
+  }
+
+  // Decls deserialized from a PCH or module were indexed when that AST file
+  // was built, since we're loaded for those compilations too. Re-emitting
+  // them in every TU that uses the AST file would be wasted work, and merely
+  // walking them would force clang to deserialize all of it. References from
+  // this TU's own code into them are still recorded by the visitors of the
+  // referring expressions and types.
+  bool TraverseDecl(Decl *d) {
+    if (d && d->isFromASTFile())
+      return true;
+    return RecursiveASTVisitor<IndexConsumer>::TraverseDecl(d);
+  }
+
+  // Walk only the top-level decls parsed in this TU, without pulling in the
+  // lexical contents of any AST files it loads.
+  bool TraverseTranslationUnitDecl(TranslationUnitDecl *d) {
+    if (!WalkUpFromTranslationUnitDecl(d))
+      return false;
+    for (DeclContext::decl_iterator it = d->noload_decls_begin(),
+           end = d->noload_decls_end();
+         it != end; ++it) {
+      if (!TraverseDecl(*it))
+        return false;
+    }
+    return true;
   }
 
   // Tag declarations: class, struct, union, enum
@@ -524,12 +1059,13 @@ public:
       if (!nd)
         nd = d;
       recordValue("name", nd->getNameAsString());
-      recordValue("qualname", getQualifiedName(*nd));
+      recordQualname(*nd);
       recordValue("loc", locationToString(begin = d->getLocation()));
       recordValue("locend", locationToString(afterToken(begin)));
       recordValue("kind", d->getKindName());
       printScope(d);
-      *out << std::endl;
+      *out << '\n';
+      declDefImportedRedecls("type", d);
     }
 
     declDef("type", d, d->getDefinition(),
@@ -550,9 +1086,9 @@ public:
         return true;
       beginRecord("impl", d->getLocation());
       recordValue("name", d->getNameAsString());
-      recordValue("qualname", getQualifiedName(*d));
+      recordQualname(*d);
       recordValue("basename", base->getNameAsString());
-      recordValue("basequalname", getQualifiedName(*base));
+      recordQualname(*base, "basequalname", "basesym");
       *out << ",access,\"";
       switch ((*iter).getAccessSpecifierAsWritten()) {
         case AS_public: *out << "public"; break;
@@ -562,7 +1098,7 @@ public:
       }
       if ((*iter).isVirtual())
         *out << " virtual";
-      *out << "\"" << std::endl;
+      *out << "\"\n";
     }
     return true;
   }
@@ -576,8 +1112,10 @@ public:
       beginRecord("function", functionLocation);
       std::string functionName = d->getNameAsString();
       recordValue("name", functionName);
-      std::string functionQualName = getQualifiedName(*d);
+      StringRef functionQualName = getQualifiedName(*d);
+      StringRef functionSym = getSymbolId(*d, functionQualName);
       recordValue("qualname", functionQualName);
+      recordValue("sym", functionSym);
 #if CLANG_AT_LEAST(3, 5)
       recordValue("type", d->getCallResultType().getAsString(printPolicy));
 #else
@@ -597,7 +1135,7 @@ public:
       recordValue("loc", locationToString(beginLoc));
       recordLocEndForName(functionName, beginLoc, d->getNameInfo().getEndLoc());
       printScope(d);
-      *out << std::endl;
+      *out << '\n';
 
       // Print out overrides
       if (CXXMethodDecl::classof(d)) {  // It's a method.
@@ -614,9 +1152,11 @@ public:
           beginRecord("func_override", functionLocation);
           recordValue("name", functionName);
           recordValue("qualname", functionQualName);
+          recordValue("sym", functionSym);
           recordValue("overriddenname", overriddenDecl->getNameAsString());
-          recordValue("overriddenqualname", getQualifiedName(*overriddenDecl));
-          *out << std::endl;
+          recordQualname(*overriddenDecl, "overriddenqualname",
+                         "overriddensym");
+          *out << '\n';
         }
       }
     }
@@ -625,6 +1165,8 @@ public:
     if (d->isDefined(def))
       declDef("function", d, def,
               d->getNameInfo().getBeginLoc(), d->getNameInfo().getEndLoc());
+    if (d->isThisDeclarationADefinition())
+      declDefImportedRedecls("function", d);
 
     return true;
   }
@@ -663,21 +1205,42 @@ public:
     return fd && fd->isThisDeclarationADefinition();
   }
 
+  // Would constant-evaluating a var be more trouble than it's worth, like
+  // for a huge generated table?
+  bool tooBigToEvaluate(const VarDecl *vd, const Expr *init) {
+    uint64_t limit = budgets.maxEvalElements;
+    if (!limit)
+      return false;
+    if (const ConstantArrayType *cat =
+          vd->getASTContext().getAsConstantArrayType(vd->getType()))
+      if (cat->getSize().ugt(limit))
+        return true;
+    if (const InitListExpr *ile = dyn_cast<InitListExpr>(init->IgnoreImplicit()))
+      return ile->getNumInits() > limit;
+    return false;
+  }
+
   std::string getValueForValueDecl(ValueDecl *d) {
     if (const VarDecl *vd = dyn_cast<VarDecl>(d)) {
       const Expr *init = vd->getAnyInitializer(vd);
       if (!isa<ParmVarDecl>(vd) &&
           init && !init->getType().isNull() && !init->isValueDependent() &&
           vd->getType().isConstQualified()) {
+        if (overTime || tooBigToEvaluate(vd, init)) {
+          ++valuesSkipped;
+          return std::string();
+        }
         if (const APValue *apv = vd->evaluateValue()) {
           std::string ret = apv->getAsString(vd->getASTContext(), vd->getType());
           // Workaround for constant strings being shown as &"foo" or &"foo"[0]
           if (str_starts_with(ret, "&\"")) {
             if (str_ends_with(ret, "\""))
-              return ret.substr(1);
-            if (str_ends_with(ret, "\"[0]"))
-              return ret.substr(1, ret.length() - 4);
+              ret = ret.substr(1);
+            else if (str_ends_with(ret, "\"[0]"))
+              ret = ret.substr(1, ret.length() - 4);
           }
+          if (truncateText(ret, budgets.maxValueLength))
+            ++valuesTruncated;
           return ret;
         }
       }
@@ -695,7 +1258,7 @@ public:
     if (treatThisValueDeclAsADefinition(d)) {
       beginRecord("variable", location);
       recordValue("name", d->getNameAsString());
-      recordValue("qualname", getQualifiedName(*d));
+      recordQualname(*d);
       recordValue("loc", locationToString(location));
       recordValue("locend", locationToString(afterToken(location)));
       recordValue("type", d->getType().getAsString(printPolicy), true);
@@ -703,7 +1266,7 @@ public:
       if (!value.empty())
         recordValue("value", value, true);
       printScope(d);
-      *out << std::endl;
+      *out << '\n';
     }
 
     if (VarDecl *vd = dyn_cast<VarDecl>(d)) {
@@ -729,6 +1292,8 @@ public:
       // declDef.
       declDef("variable", vd, def,
               vd->getLocation(), afterToken(vd->getLocation()));
+      if (def == vd)
+        declDefImportedRedecls("variable", vd);
     }
   }
 
@@ -757,11 +1322,11 @@ public:
 #endif
     beginRecord("typedef", d->getLocation());
     recordValue("name", d->getNameAsString());
-    recordValue("qualname", getQualifiedName(*d));
+    recordQualname(*d);
     recordValue("loc", locationToString(d->getLocation()));
     recordValue("locend", locationToString(afterToken(d->getLocation())));
     printScope(d);
-    *out << std::endl;
+    *out << '\n';
     return true;
   }
 
@@ -773,13 +1338,13 @@ public:
     // worth inventing a new record for.
     beginRecord("typedef", d->getLocation());
     recordValue("name", d->getNameAsString());
-    recordValue("qualname", getQualifiedName(*d));
+    recordQualname(*d);
     recordValue("loc", locationToString(d->getLocation()));
 
     // TODO: d->getNameInfo()?
     recordValue("locend", locationToString(afterToken(d->getLocation())));
     printScope(d);
-    *out << std::endl;
+    *out << '\n';
     return true;
   }
 
@@ -789,10 +1354,10 @@ public:
       return true;
     beginRecord("namespace", d->getLocation());
     recordValue("name", d->getNameAsString());
-    recordValue("qualname", getQualifiedName(*d));
+    recordQualname(*d);
     recordValue("loc", locationToString(d->getLocation()));
     recordValue("locend", locationToString(afterToken(d->getLocation())));
-    *out << std::endl;
+    *out << '\n';
     return true;
   }
 
@@ -803,10 +1368,10 @@ public:
 
     beginRecord("namespace_alias", d->getAliasLoc());
     recordValue("name", d->getNameAsString());
-    recordValue("qualname", getQualifiedName(*d));
+    recordQualname(*d);
     recordValue("loc", locationToString(d->getAliasLoc()));
     recordValue("locend", locationToString(afterToken(d->getAliasLoc())));
-    *out << std::endl;
+    *out << '\n';
 
     if (d->getQualifierLoc())
       visitNestedNameSpecifierLoc(d->getQualifierLoc());
@@ -866,8 +1431,8 @@ public:
     if (kind)
       recordValue("kind", kind);
     recordValue("name", name);
-    recordValue("qualname", getQualifiedName(*d));
-    *out << std::endl;
+    recordQualname(*d);
+    *out << '\n';
   }
 
   const char *kindForDecl(const Decl *d) {
@@ -928,7 +1493,7 @@ public:
     recordValue("calllocend", locationToString(e->getLocEnd()));
     recordValue("calleeloc", locationToString(callee->getLocation()));
     recordValue("name", namedCallee->getNameAsString());
-    recordValue("qualname", getQualifiedName(*namedCallee));
+    recordQualname(*namedCallee);
     // Determine the type of call
     const char *type = "static";
     if (CXXMethodDecl::classof(callee)) {
@@ -944,7 +1509,7 @@ public:
       type = "funcptr";
     }
     recordValue("calltype", type);
-    *out << std::endl;
+    *out << '\n';
     return true;
   }
 
@@ -966,12 +1531,12 @@ public:
     recordValue("calllocend", locationToString(e->getLocEnd()));
     recordValue("calleeloc", locationToString(callee->getLocation()));
     recordValue("name", callee->getNameAsString());
-    recordValue("qualname", getQualifiedName(*callee));
+    recordQualname(*callee);
 
     // There are no virtual constructors in C++:
     recordValue("calltype", "static");
 
-    *out << std::endl;
+    *out << '\n';
     return true;
   }
 
@@ -1115,7 +1680,7 @@ public:
       // printExtent.
       recordValue("locend", locationToString(afterToken(loc)));
     }
-    *out << std::endl;
+    *out << '\n';
   }
 
   // Macros!
@@ -1167,20 +1732,29 @@ public:
     recordValue("loc", locationToString(nameStart));
     recordValue("locend", locationToString(afterToken(nameStart)));
     recordValue("name", std::string(contents, nameLen));
-    if (defnStart < length) {
+    if (defnStart < length && overTime) {
+      ++macroTextsSkipped;
+    } else if (defnStart < length) {
       std::string text;
       if (hasArgs)  // Give the argument list.
         text = std::string(contents + argsStart, argsEnd - argsStart);
-      text += std::string(contents + defnStart, length - defnStart);
+      // Copy no more of a giant definition than we'll keep.
+      unsigned long limit = budgets.maxMacroTextLength;
+      size_t take = length - defnStart;
+      if (limit && text.size() + take > limit + 1)
+        take = limit + 1 > text.size() ? limit + 1 - text.size() : 0;
+      text += std::string(contents + defnStart, take);
+      if (truncateText(text, limit))
+        ++macroTextsTruncated;
       // FIXME: handle non-ASCII characters better
       for (size_t i = 0; i < text.size(); ++i) {
         if ((text[i] < ' ' || text[i] >= 0x7F) &&
             text[i] != '\t' && text[i] != '\n')
           text[i] = '?';
       }
-      macromap.insert(make_pair(nameStart, text));
+      macromap[nameStart.getRawEncoding()] = save(arena, text);
     }
-    *out << std::endl;
+    *out << '\n';
   }
 
   void printMacroReference(const Token &tok, const MacroInfo *MI) {
@@ -1201,12 +1775,12 @@ public:
     recordValue("loc", locationToString(refLoc));
     recordValue("locend", locationToString(afterToken(refLoc)));
     recordValue("kind", "macro");
-    std::map<SourceLocation, std::string>::const_iterator it =
-      macromap.find(macroLoc);
+    llvm::DenseMap<unsigned, StringRef>::const_iterator it =
+      macromap.find(macroLoc.getRawEncoding());
     if (it != macromap.end()) {
       recordValue("text", it->second, true);
     }
-    *out << std::endl;
+    *out << '\n';
   }
 
   void MacroExpands(const Token &tok, const MacroInfo *MI, SourceRange Range) {
@@ -1235,31 +1809,60 @@ public:
       StringRef searchPath,
       StringRef relativePath,
       const Module *imported) {
-    PresumedLoc presumedHashLoc = sm.getPresumedLoc(hashLoc);
-    const FileInfoPtr &source = getFileInfo(presumedHashLoc.getFilename());
-    const FileInfoPtr &target = getFileInfo(file->getName());
-    SourceLocation targetBegin, targetEnd;
+    if (filenameRange.isInvalid())
+      return;
+    // imported is set when a module is imported in place of the textual
+    // include. The module's own decls were indexed when it was built, but the
+    // edge to the header still belongs to this file.
+    recordInclude(hashLoc, file, filenameRange.getBegin(),
+                  filenameRange.getEnd(), imported);
+  }
 
-    if (!interestingLocation(hashLoc) ||
-        filenameRange.isInvalid() ||
-        presumedHashLoc.isInvalid() ||
+#if CLANG_AT_LEAST(3, 6)
+  // Like "@import Foo.Bar;". Record it as an include of the module's header,
+  // which is the nearest thing to a file we can point to.
+  void moduleImport(SourceLocation importLoc, ModuleIdPath path,
+                    const Module *imported) {
+    if (!imported || path.empty())
+      return;
+    const FileEntry *header = nullptr;
+  #if CLANG_AT_LEAST(3, 7)
+    header = imported->getUmbrellaHeader().Entry;
+    if (!header && !imported->Headers[Module::HK_Normal].empty())
+      header = imported->Headers[Module::HK_Normal].front().Entry;
+  #else
+    header = imported->getUmbrellaHeader();
+  #endif
+    recordInclude(importLoc, header, path.front().second,
+                  afterToken(path.back().second), imported);
+  }
+#endif
 
-        // Don't record inclusions of files that are outside the source tree,
-        // like stdlibs. file is NULL if an #include can't be resolved, like if
-        // you include a nonexistent file.
-        !file ||
+  void recordInclude(SourceLocation hashLoc, const FileEntry *file,
+                     SourceLocation targetBegin, SourceLocation targetEnd,
+                     const Module *imported) {
+    // Don't record inclusions of files that are outside the source tree,
+    // like stdlibs. file is NULL if an #include can't be resolved, like if
+    // you include a nonexistent file.
+    if (!file || !interestingLocation(hashLoc))
+      return;
+    PresumedLoc presumedHashLoc = sm.getPresumedLoc(hashLoc);
+    if (presumedHashLoc.isInvalid())
+      return;
+    FileInfo *source = getFileInfo(presumedHashLoc.getFilename());
+    FileInfo *target = getFileInfo(file->getName());
 
-        !(target->interesting) ||
+    if (!(target->interesting) ||
 
         // TODO: Come up with some kind of reasonable extent for macro-based
         // includes, like #include FOO_MACRO.
-        (targetBegin = filenameRange.getBegin()).isMacroID() ||
-        (targetEnd = filenameRange.getEnd()).isMacroID() ||
+        targetBegin.isMacroID() ||
+        targetEnd.isMacroID() ||
 
         // TODO: Support generated files once we run the trigram indexer over
         // them. For now, we skip them.
-        !(source->realname.compare(0, GENERATED.size(), GENERATED)) ||
-        !(target->realname.compare(0, GENERATED.size(), GENERATED)))
+        source->realname.startswith(GENERATED) ||
+        target->realname.startswith(GENERATED))
       return;
 
     beginRecord("include", hashLoc);
@@ -1267,7 +1870,9 @@ public:
     recordValue("target_path", target->realname);
     recordValue("loc", locationToString(targetBegin));
     recordValue("locend", locationToString(targetEnd));
-    *out << std::endl;
+    if (imported)
+      recordValue("module", imported->getFullModuleName());
+    *out << '\n';
   }
 
 };
@@ -1358,6 +1963,12 @@ void PreprocThunk::InclusionDirective(
   real->InclusionDirective(hashLoc, includeTok, fileName, isAngled, filenameRange,
                            file, searchPath, relativePath, imported);
 }
+#if CLANG_AT_LEAST(3, 6)
+void PreprocThunk::moduleImport(SourceLocation importLoc, ModuleIdPath path,
+                                const Module *imported) {
+  real->moduleImport(importLoc, path, imported);
+}
+#endif
 
 // Our plugin entry point.
 class DXRIndexAction : public PluginASTAction {
@@ -1429,6 +2040,40 @@ protected:
     IndexConsumer::setTmpDir(tmpdir);
     free(abs_tmpdir);
 
+    // How many threads to hash and write output with. The build is already
+    // running a compiler per core, so don't take many more by default, but
+    // let slow (say, networked) temp folders ask for more writes in flight.
+    const char *threads = getenv("DXR_CXX_CLANG_THREADS");
+    unsigned n = threads ?
+      std::min(unsigned(atoi(threads)), 16u) :
+      std::min(std::thread::hardware_concurrency(), 4u);
+    IndexConsumer::setThreads(std::max(1u, n));
+
+    // The collector to stream output to, if the build has one
+    const char *collector = getenv("DXR_CXX_CLANG_COLLECTOR_SOCKET");
+    IndexConsumer::setCollectorSocket(collector ? collector : "");
+
+    // The shared cache to link csv files from, if any
+    const char *cache = getenv("DXR_CXX_CLANG_CACHE_FOLDER");
+    IndexConsumer::setCacheDir(cache ? std::string(cache) + "/" : "");
+
+    // Budgets for pathological TUs. The defaults match the [[clang]] config
+    // options'.
+    Budgets budgets;
+    budgets.maxWalkMs = envNumber("DXR_CXX_CLANG_MAX_WALK_MS", 0);
+    budgets.maxFileBytes = envNumber("DXR_CXX_CLANG_MAX_FILE_BYTES", 0);
+    budgets.maxValueLength = envNumber("DXR_CXX_CLANG_MAX_VALUE_LENGTH", 1000);
+    budgets.maxEvalElements = envNumber("DXR_CXX_CLANG_MAX_EVAL_ELEMENTS",
+                                        10000);
+    budgets.maxMacroTextLength = envNumber("DXR_CXX_CLANG_MAX_MACRO_TEXT_LENGTH",
+                                           2000);
+    budgets.maxQualnameLength = envNumber("DXR_CXX_CLANG_MAX_QUALNAME_LENGTH",
+                                          2000);
+    IndexConsumer::setBudgets(budgets);
+
+    // Whether to record syntax-coloring regions
+    IndexConsumer::setSyntax(envNumber("DXR_CXX_CLANG_SYNTAX_REGIONS", 0));
+
     return true;
   }
 };
@@ -1437,6 +2082,11 @@ protected:
 std::string FileInfo::srcdir;
 std::string FileInfo::output;
 std::string IndexConsumer::tmpdir;
+unsigned IndexConsumer::threads = 1;
+std::string IndexConsumer::collectorSocket;
+std::string IndexConsumer::cachedir;
+Budgets IndexConsumer::budgets;
+bool IndexConsumer::syntax = false;
 }
 
 static FrontendPluginRegistry::Add<DXRIndexAction>
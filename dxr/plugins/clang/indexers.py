@@ -4,17 +4,32 @@ from itertools import chain
 from operator import itemgetter
 import os
 from os import listdir
+from shutil import rmtree
+from tempfile import mkdtemp
 
 from funcy import merge, imap, autocurry
 
+from dxr.artifacts import staging_folder, staging_path, write_sorted_table
+from dxr.build import is_ignored
+from dxr.exceptions import BuildError
 from dxr.filters import LINE
+from dxr.include_graph import (fan_out, write_fan_out_report,
+                               write_include_graph)
 from dxr.indexers import (FileToIndex as FileToIndexBase,
                           TreeToIndex as TreeToIndexBase,
                           QUALIFIED_LINE_NEEDLE, unsparsify, FuncSig)
-from dxr.plugins.clang.condense import condense_file, condense_global
+from dxr.plugins.clang import collector
+from dxr.plugins.clang.cache import (evict, plugin_version, version_folder,
+    graph_digest, condensed_folder, condensed_path, load_pickle, save_pickle)
+from dxr.plugins.clang.condense import (condense_file, condense_global,
+                                        symbol_key)
 from dxr.plugins.clang.menus import (FunctionRef, VariableRef, TypeRef,
     NamespaceRef, NamespaceAliasRef, MacroRef, IncludeRef, TypedefRef)
 from dxr.plugins.clang.needles import all_needles
+from dxr.plugins.clang.stats import tu_stats, write_summary
+from dxr.plugins.clang.symbols import SYMBOL_TABLE, symbol_rows
+from dxr.plugins.clang.syntax import syntax_regions
+from dxr.utils import open_log
 
 
 mappings = {
@@ -50,22 +65,76 @@ mappings = {
     }
 }
 
+# Limits on the compiler plugin's work per TU, as (config option, default)
+# pairs. 0 means no limit. The plugin gets each as an env var named for it.
+BUDGETS = [('max_walk_ms', 0),
+           ('max_file_bytes', 0),
+           ('max_value_length', 1000),
+           ('max_eval_elements', 10000),
+           ('max_macro_text_length', 2000),
+           ('max_qualname_length', 2000)]
+
+# Bump this when condensing or needle-making would make something different
+# out of the same CSVs, to invalidate the cached results:
+CONDENSED_VERSION = '1'
+
+
+def graph_roots(condensed):
+    """Return the set of symbols whose entries in the whole-program graphs
+    condensing and needle-making look at for a file."""
+    roots = set(symbol_key(props) for kind in condensed.itervalues()
+                for props in kind)
+    roots.discard(None)
+    return roots
+
 
 class FileToIndex(FileToIndexBase):
     """C and C++ indexer using clang compiler plugin"""
 
-    def __init__(self, path, contents, plugin_name, tree, overrides, overriddens, parents, children, csv_names, temp_folder):
+    def __init__(self, path, contents, plugin_name, tree, overrides, overriddens, parents, children, csv_names, temp_folder, condensed_folder=None):
+        """
+        :arg condensed_folder: Where to look for this file's condensed data
+            and needles from an earlier build, and to put them if they aren't
+            there, or None not to cache them
+
+        """
         super(FileToIndex, self).__init__(path, contents, plugin_name, tree)
         self.overrides = overrides
         self.overriddens = overriddens
         self.parents = parents
         self.children = children
-        self.condensed = condense_file(temp_folder, path,
-                                       overrides, overriddens,
-                                       parents, children,
-                                       csv_names)
-
-    def needles_by_line(self):
+        self._needles = None
+        graphs = overrides, overriddens, parents, children
+        cache_path = cached = roots = None
+        if condensed_folder and csv_names:
+            # The results depend on the CSVs and on the bits of the graphs
+            # reachable from the file's symbols. Which symbols those are
+            # depends on the CSVs alone, so they're cached on their own, to
+            # look the results up by.
+            key = [CONDENSED_VERSION] + sorted(csv_names)
+            roots_path = condensed_path(condensed_folder, ['roots'] + key)
+            roots = load_pickle(roots_path)
+            if roots is not None:
+                cache_path = condensed_path(
+                    condensed_folder, [graph_digest(graphs, roots)] + key)
+                cached = load_pickle(cache_path)
+        if cached:
+            self.condensed, self._needles = cached
+        else:
+            self.condensed = condense_file(temp_folder, path,
+                                           overrides, overriddens,
+                                           parents, children,
+                                           csv_names)
+            if condensed_folder and csv_names:
+                if roots is None:
+                    roots = graph_roots(self.condensed)
+                    save_pickle(roots_path, roots)
+                    cache_path = condensed_path(
+                        condensed_folder, [graph_digest(graphs, roots)] + key)
+                self._needles = self._all_needles()
+                save_pickle(cache_path, (self.condensed, self._needles))
+
+    def _all_needles(self):
         return all_needles(
                 self.condensed,
                 self.overrides,
@@ -73,6 +142,29 @@ class FileToIndex(FileToIndexBase):
                 self.parents,
                 self.children)
 
+    def needles_by_line(self):
+        if self._needles is None:
+            return self._all_needles()
+        return self._needles
+
+    def covers_syntax(self):
+        return bool(self.condensed.get('syntax'))
+
+    def regions(self):
+        syntax = self.condensed.get('syntax')
+        if not syntax:
+            return
+        # Every TU that saw the file lexed the same text, so any record will
+        # do, unless the file changed during the build. Be deterministic
+        # about it then.
+        num_lines = len(self._line_offsets())
+        for (start_row, start_col, end_row, end_col,
+             region) in syntax_regions(min(s['regions'] for s in syntax)):
+            if end_row <= num_lines:
+                yield (self.char_offset(start_row, start_col),
+                       self.char_offset(end_row, end_col),
+                       region)
+
     def refs(self):
         def getter_or_empty(y):
             return lambda x: x.get(y, [])
@@ -189,6 +281,7 @@ class TreeToIndex(TreeToIndexBase):
         self._temp_folder = os.path.join(self.tree.temp_folder,
                                          'plugins',
                                          self.plugin_name)
+        self._collector_socket = None
 
     def environment(self, vars_):
         """Set up environment variables to trigger analysis dumps from clang.
@@ -197,11 +290,17 @@ class TreeToIndex(TreeToIndexBase):
 
         """
         tree = self.tree
-        plugin_folder = os.path.dirname(__file__)
+        plugin_path = os.path.join(os.path.dirname(__file__),
+                                   'libclang-index-plugin.so')
         flags = [
-            '-load', os.path.join(plugin_folder, 'libclang-index-plugin.so'),
+            '-load', plugin_path,
             '-add-plugin', 'dxr-index',
-            '-plugin-arg-dxr-index', tree.source_folder
+            '-plugin-arg-dxr-index', tree.source_folder,
+            # Modules' decls are indexed only while the modules are built and
+            # are skipped in the TUs importing them, so don't let the build
+            # reuse any built without us:
+            '-fmodules-cache-path=%s' % os.path.join(self._temp_folder,
+                                                     'modules')
         ]
         flags_str = " ".join(imap('-Xclang {}'.format, flags))
 
@@ -214,9 +313,82 @@ class TreeToIndex(TreeToIndexBase):
         }
         env['DXR_CC'] = env['CC']
         env['DXR_CXX'] = env['CXX']
+        env['DXR_CXX_CLANG_SYNTAX_REGIONS'] = (
+            '1' if self.plugin_config.syntax_regions else '0')
+        for name, _ in BUDGETS:
+            env['DXR_CXX_CLANG_' + name.upper()] = str(
+                getattr(self.plugin_config, name))
+        cache_folder = None
+        if tree.config.cache_folder:
+            cache_folder = version_folder(tree.config.cache_folder,
+                                          plugin_version(plugin_path))
+            env['DXR_CXX_CLANG_CACHE_FOLDER'] = cache_folder
+        if self.plugin_config.collector:
+            # Keep the socket path short; they top out around 100 chars.
+            self._collector_socket = os.path.join(mkdtemp(prefix='dxr-clang-'),
+                                                  'collector')
+            collector.start(self._collector_socket,
+                            self._temp_folder,
+                            cache_folder)
+            env['DXR_CXX_CLANG_COLLECTOR_SOCKET'] = self._collector_socket
         return merge(vars_, env)
 
     def post_build(self):
+        collected = self._stop_collector()
+        if collected and collected.get('write_errors'):
+            raise BuildError(
+                "The clang plugin's output collector couldn't write %s "
+                "files. %s" % (collected['write_errors'],
+                               collected['first_write_error']))
+        stats = list(tu_stats(self._temp_folder))
+        with open_log(self.tree.log_folder, 'clang-stats.log') as log:
+            write_summary(stats, log)
+            if collected:
+                for key in sorted(collected):
+                    log.write('Collector %s: %s\n' % (key, collected[key]))
+            config = self.tree.config
+            if config.cache_folder:
+                log.write('Cache entries evicted: %s\n' %
+                          evict(config.cache_folder,
+                                config.cache_size * 1024 * 1024))
+        symbols_path = staging_path(self.tree, SYMBOL_TABLE)
+        definitions = set() if symbols_path else None
+        includes = set()
+        self._load(definitions, includes)
+        if symbols_path:
+            write_sorted_table(symbols_path,
+                               symbol_rows(self._indexed_only(definitions)))
+            write_include_graph(staging_folder(self.tree), includes)
+
+        # A TU can be built more than once, in different configurations:
+        tu_ms = defaultdict(int)
+        for tu in stats:
+            if 'file' in tu:
+                tu_ms[tu['file']] += tu.get('walk_ms', 0) + tu.get('output_ms', 0)
+        with open_log(self.tree.log_folder, 'clang-includes.log') as log:
+            write_fan_out_report(
+                fan_out(includes, tu_ms, self.tree.source_folder), log)
+
+        # Files whose CSVs and whose bits of the graphs above are the same as
+        # last time can reuse what they condensed to then:
+        self._condensed_folder = None
+        if self.tree.config.cache_folder:
+            self._condensed_folder = condensed_folder(
+                self.tree.config.cache_folder)
+
+    def load_build(self):
+        """Map and condense the CSVs, leaving the logs, the staged
+        artifacts, and the cache to whatever full build may be running."""
+        self._load(None, None)
+        self._condensed_folder = None
+
+    def _load(self, definitions, includes):
+        """Map the CSVs to their files, and build the whole-program graphs.
+
+        :arg definitions: A set to add definitions to, or None
+        :arg includes: A set to add include edges to, or None
+
+        """
         def csv_map():
             """Map input files to the output CSVs corresponding to them.
 
@@ -238,9 +410,84 @@ class TreeToIndex(TreeToIndexBase):
 
         self._csv_map = csv_map()
         self._overrides, self._overriddens, self._parents, self._children = condense_global(self._temp_folder,
-                            chain.from_iterable(self._csv_map.itervalues()))
+                            chain.from_iterable(self._csv_map.itervalues()),
+                            definitions,
+                            includes)
+
+    def _indexed_only(self, definitions):
+        """Return the definitions which are in files index_files() will give
+        docs to, so direct searches don't jump to pages that aren't there."""
+        tree = self.tree
+        indexed = {}
+        for definition in definitions:
+            path = definition[3]
+            if path not in indexed:
+                indexed[path] = (
+                    not is_ignored(path,
+                                   tree.ignore_paths,
+                                   tree.ignore_filenames) and
+                    os.path.isfile(os.path.join(tree.source_folder, path)))
+            if indexed[path]:
+                yield definition
+
+    def _stop_collector(self):
+        """Wait for the collector, if there is one, to write out everything
+        it has, so it's all there when we list the folder. Return its final
+        counters, or None if there wasn't one."""
+        if self._collector_socket:
+            collected = collector.stop(self._collector_socket)
+            rmtree(os.path.dirname(self._collector_socket), ignore_errors=True)
+            self._collector_socket = None
+            return collected
+
+    def pre_refresh(self, paths):
+        """Delete the CSVs of the changed files.
+
+        Every TU that includes them is about to be rebuilt, so any CSVs
+        that are still right will be written again.
+
+        """
+        self._csvs_before_refresh = set(self._csv_names())
+        for path in paths:
+            path_hash = sha1(path).hexdigest()
+            for csv_name in self._csv_map.pop(path_hash, []):
+                try:
+                    os.remove(os.path.join(self._temp_folder,
+                                           csv_name + '.csv'))
+                except OSError:
+                    pass
+
+    def post_refresh(self, paths):
+        """Pick up the changed files' new CSVs.
+
+        The rebuilt TUs also write new CSVs for the unchanged files they
+        touch, when, say, their refs point at lines of a header which have
+        moved. Those files aren't reindexed, so throw their new CSVs out.
+        Otherwise, the next refresh service to start would condense them
+        along with the old ones, doubling up those files' refs.
+
+        The whole-program graphs stay as they were at the last full build, so
+        new overrides and subclasses don't show up till the next one.
+
+        """
+        self._stop_collector()
+        hashes = set(sha1(path).hexdigest() for path in paths)
+        for csv_name in self._csv_names():
+            path_hash = csv_name.split('.', 1)[0]
+            if path_hash in hashes:
+                self._csv_map[path_hash].append(csv_name[:-4])
+            elif csv_name not in self._csvs_before_refresh:
+                try:
+                    os.remove(os.path.join(self._temp_folder, csv_name))
+                except OSError:
+                    pass
+
+    def _csv_names(self):
+        return [name for name in listdir(self._temp_folder)
+                if name.endswith('.csv')]
 
     def file_to_index(self, path, contents):
+        csv_names = self._csv_map[sha1(path).hexdigest()]
         return FileToIndex(path,
                            contents,
                            self.plugin_name,
@@ -249,5 +496,6 @@ class TreeToIndex(TreeToIndexBase):
                            self._overriddens,
                            self._parents,
                            self._children,
-                           self._csv_map[sha1(path).hexdigest()],
-                           self._temp_folder)
+                           csv_names,
+                           self._temp_folder,
+                           self._condensed_folder)
@@ -13,6 +13,19 @@ def quote(qualname):
     return qualname
 
 
+def _identity(prop):
+    """Return the kwargs by which a Ref identifies the symbol it's hung on.
+
+    Prefer the compiler's symbol ID, which is already a stable 64-bit int, and
+    fall back to hashing the qualname.
+
+    """
+    sym = prop.get('sym')
+    if sym is not None:
+        return {'qualname_hash': sym}
+    return {'qualname': prop.get('qualname')}
+
+
 class _ClangRef(Ref):
     plugin = 'clang'
 
@@ -26,7 +39,7 @@ class _RefWithDefinition(_ClangRef):
         prepended onto whatever tuple the subclass returns from
         _condensed_menu_data().
 
-        Also yank a qualname out of prop['qualname'] if available.
+        Also yank a symbol ID or qualname out of prop if available.
 
         """
         definition = prop.get('defloc')
@@ -38,7 +51,7 @@ class _RefWithDefinition(_ClangRef):
             definition_tuple = None, None
         return cls(tree,
                    (definition_tuple + cls._condensed_menu_data(tree, prop)),
-                   qualname=prop.get('qualname'))
+                   **_identity(prop))
 
     def menu_items(self):
         """Return a jump-to-definition menu item along with whatever others
@@ -208,7 +221,7 @@ class FunctionRef(_ClangRef):
         return cls(tree,
                    (search_for_def, prop['qualname'],
                     'has_overriddens' in prop, 'has_overrides' in prop),
-                   qualname=prop['qualname'])
+                   **_identity(prop))
 
     def menu_items(self):
         search_for_def, qualname = self.menu_data[:2]
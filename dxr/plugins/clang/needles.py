@@ -2,6 +2,7 @@ from itertools import chain
 
 from dxr.indexers import (iterable_per_line, with_start_and_end,
                           split_into_lines)
+from dxr.plugins.clang.condense import symbol_key
 
 
 # TODO: Use.
@@ -123,7 +124,7 @@ def macro_needles(condensed):
             condensed['macro'])
 
 
-def _walk_graph(graph, root_qualname, seen):
+def _walk_graph(graph, root, seen):
     """Yield (qualname, name) pairs gleaned from recursively descending a
     graph, without any repeats.
 
@@ -132,17 +133,17 @@ def _walk_graph(graph, root_qualname, seen):
     for ES, since duplicates will be merged in the term index. But it makes the
     highlighter emit icky empty tag pairs.
 
-    We also cut off cycles before we get back to the original ``root_qualname``.
+    We also cut off cycles before we get back to the original ``root``.
 
-    :arg seen: The set of qualnames traversed, so we can avoid cycles and
+    :arg seen: The set of symbols traversed, so we can avoid cycles and
         dupes. Cycles shouldn't happen, but the clang compiler plugin is buggy,
         so sometimes they do.
 
     """
-    direct_dests = graph.get(root_qualname, [])
-    for dest_qualname, dest_name in direct_dests:
-        if dest_qualname not in seen:  # Dodge duplicates and cycles.
-            seen.add(dest_qualname)
+    direct_dests = graph.get(root, [])
+    for dest, dest_qualname, dest_name in direct_dests:
+        if dest not in seen:  # Dodge duplicates and cycles.
+            seen.add(dest)
 
             # Direct destinations:
             yield dest_qualname, dest_name
@@ -151,41 +152,42 @@ def _walk_graph(graph, root_qualname, seen):
             # subclass's override, it overrides me as well. Flatten this in
             # place to avoid deeply nested chain() calls that lead to stack
             # overflows, e.g. bug 1246700.
-            for x in _walk_graph(graph, dest_qualname, seen):
+            for x in _walk_graph(graph, dest, seen):
                 yield x
 
 
-def needles_from_graph(graph, root_qualname, method_span, needle_name):
+def needles_from_graph(graph, root, method_span, needle_name):
     """Yield the unique needles gleaned from recursively descending a graph.
 
-    The returned needles start at the nodes the ``root_qualname`` points to,
-    not at the root itself.
+    The returned needles start at the nodes the ``root`` points to, not at the
+    root itself.
 
-    :arg graph: A graph of this format::
+    :arg graph: A graph of this format, keyed by symbol (see
+        :func:`~dxr.plugins.clang.condense.symbol_key`)::
 
-        {'source qualname': [('dest qualname', 'dest name')]}
+        {source sym: [(dest sym, 'dest qualname', 'dest name')]}
 
-    :arg root_qualname: The graph key at which to begin
+    :arg root: The graph key at which to begin
     :arg method_span: The span to emit for every needle (the same for each)
     :arg needle_name: The key to emit for every needle (the same for each)
 
     """
-    pairs = _walk_graph(graph, root_qualname, set([root_qualname]))
+    pairs = _walk_graph(graph, root, set([root]))
     return ((needle_name,
              {'qualname': qualname, 'name': name},
              method_span) for qualname, name in pairs)
 
 
 def overrides_needles(condensed, overrides):
-    def base_methods_of(method_qualname, method_span):
+    def base_methods_of(method, method_span):
         """Return an iterable of needles for methods overridden by
-        ``method_qualname``, either directly or indirectly.
+        ``method``, either directly or indirectly.
 
         """
-        return needles_from_graph(overrides, method_qualname, method_span, 'c_overrides')
+        return needles_from_graph(overrides, method, method_span, 'c_overrides')
 
     for f in condensed['function']:
-        for needle in base_methods_of(f['qualname'], f['span']):
+        for needle in base_methods_of(symbol_key(f), f['span']):
             yield needle
 
 
@@ -194,22 +196,22 @@ def overridden_needles(condensed, overriddens):
     gathered from override sites during the whole-program pass. If it has,
     spit out "c_overridden" needles for its direct and indirect overrides.
 
-    :arg overriddens: A map of qualnames of overridden methods pointing to
-        lists of (qualname of overriding method, name of overriding method),
-        gathered during the whole-program post-build pass::
+    :arg overriddens: A map of symbols of overridden methods pointing to
+        lists of (symbol, qualname, and name of overriding method), gathered
+        during the whole-program post-build pass::
 
-        {'Base::foo()': [('Derived::foo()', 'foo')]}
+        {<Base::foo() sym>: [(<Derived::foo() sym>, 'Derived::foo()', 'foo')]}
 
     """
-    def overrides_of(method_qualname, method_span):
+    def overrides_of(method, method_span):
         """Return an iterable of needles for methods that override
-        ``method_qualname``, either directly or indirectly.
+        ``method``, either directly or indirectly.
 
         """
-        return needles_from_graph(overriddens, method_qualname, method_span, 'c_overridden')
+        return needles_from_graph(overriddens, method, method_span, 'c_overridden')
 
     for f in condensed['function']:
-        for needle in overrides_of(f['qualname'], f['span']):
+        for needle in overrides_of(symbol_key(f), f['span']):
             yield needle
 
 
@@ -239,7 +241,7 @@ def caller_needles(condensed, overriddens):
     for call in condensed['call']:
         if call['calltype'] == 'virtual':
             for needle_from_base_method in needles_from_graph(
-                    overriddens, call['qualname'], call['span'], 'c_call'):
+                    overriddens, symbol_key(call), call['span'], 'c_call'):
                 yield needle_from_base_method
 
 
@@ -250,12 +252,12 @@ def inheritance_needles(condensed, parents, children):
             # Lay down needles at a class's line. These needles' values are
             # any classes that this class is a parent of.
             for needle in needles_from_graph(
-                    children, type['qualname'], type['span'], 'c_bases'):
+                    children, symbol_key(type), type['span'], 'c_bases'):
                 yield needle
             # And these needles' values are the classes that this class is a
             # child of:
             for needle in needles_from_graph(
-                    parents, type['qualname'], type['span'], 'c_derived'):
+                    parents, symbol_key(type), type['span'], 'c_derived'):
                 yield needle
 
 
@@ -0,0 +1,68 @@
+"""Digestion of the per-TU stats files written by the compiler plugin"""
+
+import csv
+from glob import glob
+from itertools import izip
+from os.path import join
+
+
+# Stats for which the max across TUs is interesting rather than the total:
+MAXED = set(['arena_bytes', 'max_rss_kb'])
+
+
+def tu_stats(folder):
+    """Yield a dict of stats for each TU the plugin reported on in
+    ``folder``.
+
+    All values but the "file" one are ints.
+
+    """
+    for path in glob(join(folder, '*.stats')):
+        with open(path, 'rb') as file:
+            for line in csv.reader(file):
+                stats = dict(izip(line[1::2], line[2::2]))
+                for key, value in stats.iteritems():
+                    if key != 'file':
+                        stats[key] = int(value)
+                yield stats
+
+
+def write_summary(stats, log, slowest=10):
+    """Write the totals and maxima of some TUs' stats to a file, along with
+    the TUs which took longest to index.
+
+    :arg stats: An iterable of dicts from :func:`tu_stats`
+    :arg log: A file-like object to write to
+    :arg slowest: How many of the slowest TUs to list
+
+    """
+    totals = {}
+    maxima = {}
+    times = []
+    over_budget = []
+    count = 0
+    for tu in stats:
+        count += 1
+        for key, value in tu.iteritems():
+            if key in MAXED:
+                maxima[key] = max(maxima.get(key, 0), value)
+            elif key != 'file':
+                totals[key] = totals.get(key, 0) + value
+        times.append((tu.get('walk_ms', 0) + tu.get('output_ms', 0),
+                      tu.get('file')))
+        if tu.get('over_budget'):
+            over_budget.append(tu.get('file'))
+
+    log.write('TUs: %s\n' % count)
+    for key in sorted(totals):
+        log.write('Total %s: %s\n' % (key, totals[key]))
+    for key in sorted(maxima):
+        log.write('Peak %s: %s\n' % (key, maxima[key]))
+    if times:
+        log.write('Slowest TUs (ms):\n')
+        for ms, path in sorted(times, reverse=True)[:slowest]:
+            log.write('%10d %s\n' % (ms, path))
+    if over_budget:
+        log.write('TUs over budget (see [[clang]] options):\n')
+        for path in sorted(over_budget):
+            log.write('           %s\n' % path)
@@ -0,0 +1,80 @@
+"""A table of where things are defined, for answering direct searches
+without asking elasticsearch
+
+Each row maps a needle field and a name, as the direct searchers in
+:mod:`~dxr.plugins.clang.direct` would match it against ES, to the path and
+line of a definition: ``c_function.qualname Foo::bar`` to
+``src/foo.cpp:12``, for instance. Lowercased names go under the ``.lower``
+versions of the fields, as they're analyzed in ES.
+
+"""
+from dxr.artifacts import sorted_table
+
+
+# The name of the artifact:
+SYMBOL_TABLE = 'clang-symbols'
+
+# Kinds of CSV rows which define things, and the needles ES knows them by:
+DEFINITION_NEEDLES = {'function': 'c_function',
+                      'type': 'c_type',
+                      'typedef': 'c_type',
+                      'variable': 'c_var',
+                      'macro': 'c_macro'}
+
+
+def add_definition(definitions, kind, fields):
+    """If a raw CSV row defines something, add a tuple describing it to the
+    set ``definitions``."""
+    # Rows without a locend don't make needles, so they don't make rows.
+    if (kind in DEFINITION_NEEDLES and
+            fields.get('loc') and fields.get('locend') and 'name' in fields):
+        path, row, _ = fields['loc'].rsplit(':', 2)
+        definitions.add((kind, fields['name'], fields.get('qualname'), path,
+                         row))
+
+
+def _lower(name):
+    return name.decode('utf-8', 'replace').lower().encode('utf-8')
+
+
+def symbol_rows(definitions):
+    """Return an iterable of (key, value) rows for
+    :func:`~dxr.artifacts.write_sorted_table()`, made from the results of
+    :func:`add_definition()`."""
+    for kind, name, qualname, path, row in definitions:
+        needle = DEFINITION_NEEDLES[kind]
+        location = '%s:%s' % (path, row)
+        names = [('name', name)]
+        if qualname and kind != 'macro':
+            names.append(('qualname', qualname))
+            if kind == 'function' and '(' in qualname:
+                # Functions are findable without their arg types, too:
+                names.append(('qualname', qualname[:qualname.index('(')]))
+        for field, value in names:
+            if any(c in value or c in location for c in '\t\n'):
+                continue
+            yield '%s.%s %s' % (needle, field, value), location
+            yield '%s.%s.lower %s' % (needle, field, _lower(value)), location
+
+
+def symbol_lookup(field):
+    """Return a function that looks up a direct-search term in the symbol
+    table as a match against the needle field ``field``.
+
+    The function returns a list of up to 2 (path, line) pairs, or None if
+    there's no table.
+
+    """
+    def lookup(term, artifact_folder):
+        table = sorted_table(artifact_folder, SYMBOL_TABLE)
+        if table is None:
+            return None
+        name = term['arg'].encode('utf-8')
+        if field.endswith('.lower'):
+            name = _lower(name)
+        ret = []
+        for location in table.values('%s %s' % (field, name), limit=2):
+            path, row = location.rsplit(':', 1)
+            ret.append((path.decode('utf-8'), int(row)))
+        return ret
+    return lookup
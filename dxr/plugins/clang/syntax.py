@@ -0,0 +1,40 @@
+"""Syntax coloring from the token classes the compiler plugin records
+
+With the ``syntax_regions`` option on, the plugin raw-lexes each file it
+indexes and writes a ``syntax`` row with the extents of its keywords,
+literals, comments, and preprocessor directives. That saves running a
+Pygments regex lexer over every C and C++ file at indexing time.
+
+"""
+from dxr.lines import Region
+
+
+# The plugin's one-letter token classes, and the CSS classes to color them
+# with. They're the same ones the pygmentize plugin uses, plus numbers.
+CSS_CLASSES = {'k': 'k',
+               's': 'str',
+               'n': 'n',
+               'c': 'c',
+               'p': 'p'}
+
+
+def syntax_regions(value):
+    """Yield (start row, start col, end row, end col, Region) for the items of
+    a ``syntax`` row's ``regions`` value, like ``k3:0-3:5 c4:2-6:1``.
+
+    Rows are 1-based and columns 0-based, as elsewhere in the plugin's output.
+    Items of classes we don't know are skipped.
+
+    """
+    # One Region per class will do; they're immutable as far as anybody's
+    # concerned.
+    regions = dict((cls, Region(css)) for cls, css in CSS_CLASSES.iteritems())
+    for item in value.split():
+        region = regions.get(item[0])
+        if region is None:
+            continue
+        start, end = item[1:].split('-')
+        start_row, start_col = start.split(':')
+        end_row, end_col = end.split(':')
+        yield (int(start_row), int(start_col), int(end_row), int(end_col),
+               region)
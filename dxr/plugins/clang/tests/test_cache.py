@@ -0,0 +1,84 @@
+"""Unit tests for the cache of compiler plugin output shared across trees"""
+
+from os import listdir, makedirs, stat
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+from time import sleep
+
+from nose.tools import eq_, ok_
+
+from dxr.plugins.clang.cache import (evict, link_or_write, version_folder,
+    graph_digest, condensed_folder, condensed_path, load_pickle, save_pickle)
+from dxr.utils import frozendict
+
+
+def test_link_and_evict():
+    """Trees should share one copy of each CSV, and eviction should throw out
+    the least recently used ones."""
+    folder = mkdtemp()
+    try:
+        cache = version_folder(join(folder, 'cache'), 'abc')
+        trees = [join(folder, 'tree1'), join(folder, 'tree2')]
+        for tree in trees:
+            makedirs(tree)
+        link_or_write(cache, 'a.csv', 'aaaa', join(trees[0], 'a.csv'))
+        sleep(0.01)
+        link_or_write(cache, 'b.csv', 'bbbb', join(trees[0], 'b.csv'))
+        sleep(0.01)
+        link_or_write(cache, 'a.csv', 'aaaa', join(trees[1], 'a.csv'))
+
+        eq_(sorted(listdir(cache)), ['a.csv', 'b.csv'])
+        eq_(stat(join(cache, 'a.csv')).st_nlink, 3)
+        with open(join(trees[1], 'a.csv')) as file:
+            eq_(file.read(), 'aaaa')
+
+        # Another build's entry, still being written, isn't fair game:
+        with open(join(cache, '.c.csvXYZ'), 'w') as file:
+            file.write('cc')
+
+        # b was used longest ago:
+        eq_(evict(join(folder, 'cache'), 4), 1)
+        eq_(sorted(listdir(cache)), ['.c.csvXYZ', 'a.csv'])
+        # The trees keep their copies:
+        eq_(sorted(listdir(trees[0])), ['a.csv', 'b.csv'])
+    finally:
+        rmtree(folder)
+
+
+def test_condensed_round_trip():
+    """Condensed data should survive the trip through the cache, and the
+    graph digest shouldn't depend on the order things were found in."""
+    folder = mkdtemp()
+    try:
+        eq_(graph_digest([{1: [(2, 'B', 'B'), (3, 'C', 'C')]}, {}], [1]),
+            graph_digest([{1: [(3, 'C', 'C'), (2, 'B', 'B')]}, {}], [1]))
+        ok_(graph_digest([{1: [(2, 'B', 'B')]}, {}], [1]) !=
+            graph_digest([{}, {1: [(2, 'B', 'B')]}], [1]))
+
+        path = condensed_path(condensed_folder(folder), ['1', 'abc', 'x.y'])
+        eq_(load_pickle(path), None)
+        condensed = {'function': set([frozendict(name='main',
+                                                 qualname='main()')])}
+        save_pickle(path, (condensed, [[('c_function', {'name': 'main'})]]))
+        eq_(load_pickle(path),
+            (condensed, [[('c_function', {'name': 'main'})]]))
+    finally:
+        rmtree(folder)
+
+
+def test_graph_digest_scope():
+    """Only the parts of the graphs reachable from the given symbols should
+    count."""
+    digest = graph_digest([{1: [(2, 'B', 'B')], 2: [(3, 'C', 'C')]}], [1])
+    # Something unrelated overrides something else:
+    eq_(graph_digest([{1: [(2, 'B', 'B')],
+                       2: [(3, 'C', 'C')],
+                       7: [(8, 'H', 'H')]}], [1]),
+        digest)
+    # Something overrides an indirect override of 1:
+    ok_(graph_digest([{1: [(2, 'B', 'B')],
+                       2: [(3, 'C', 'C')],
+                       3: [(4, 'D', 'D')]}], [1]) != digest)
+    # 1 newly gets an entry:
+    ok_(graph_digest([{}], [1]) != graph_digest([{1: []}], [1]))
@@ -10,7 +10,8 @@ from StringIO import StringIO
 
 from nose.tools import eq_
 
-from dxr.plugins.clang.condense import condense, process_call, process_function
+from dxr.plugins.clang.condense import (condense, process_call,
+                                       process_function, symbol_key)
 
 
 DISPATCH_TABLE = {'call': process_call,
@@ -38,3 +39,14 @@ def test_duplicate_collapsing():
     line = '''variable,name,"mAtkObject",qualname,"mozilla::a11y::AccessibleWrap::mAtkObject",loc,"accessible/atk/AccessibleWrap.h:83:13",locend,"accessible/atk/AccessibleWrap.h:83:23",type,"AtkObject *",scopename,"AccessibleWrap",scopequalname,"mozilla::a11y::AccessibleWrap"'''
     eq_(condense_csv(line + '\n' + line),
         condense_csv(line))
+
+
+def test_symbol_ids():
+    """Symbol IDs should come out as signed 64-bit ints and be preferred over
+    qualnames as graph keys."""
+    condensed = condense_csv("""
+        ref,name,"a",qualname,"a",sym,"ffffffffffffffff",kind,"variable"
+        ref,name,"b",qualname,"b",sym,"000000000000002a",kind,"variable"
+        ref,name,"c",qualname,"c",kind,"variable"
+        """)
+    eq_(sorted(symbol_key(r) for r in condensed['ref']), [-1, 42, 'c'])
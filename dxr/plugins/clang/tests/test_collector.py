@@ -0,0 +1,131 @@
+"""Unit tests for the daemon which collects the compiler plugin's output"""
+
+from hashlib import sha1
+from os import listdir, makedirs
+from os.path import join
+from shutil import rmtree
+import socket
+from tempfile import mkdtemp
+from threading import Thread
+
+from nose.tools import eq_, ok_
+
+from dxr.plugins.clang.collector import HEADER, Collector, counters, stop
+
+
+def _send(socket_path, frames):
+    """Send some (kind, name, body) frames over a new connection."""
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(socket_path)
+    for kind, name, body in frames:
+        sock.sendall(HEADER.pack(kind, len(name), len(body)) + name + body)
+    sock.close()
+
+
+def test_dedup_and_write():
+    """Identical blobs should be written once, under the names the plugin
+    would have used, and stats files should be written as named."""
+    folder = mkdtemp()
+    try:
+        socket_path = join(folder, 'socket')
+        output = join(folder, 'out')
+        makedirs(output)
+        server = Collector(socket_path, output)
+        thread = Thread(target=server.serve_forever)
+        thread.start()
+
+        records = 'ref,name,"x"\n'
+        _send(socket_path, [('c', '/src/a.h', records),
+                            ('c', '/src/b.cpp', 'def\n'),
+                            ('s', 'abc.1.stats', 'stats\n')])
+        _send(socket_path, [('c', '/src/a.h', records)])
+        final = stop(socket_path)
+        thread.join()
+        server.server_close()
+
+        eq_(final['blobs'], 4)
+        eq_(final['duplicates'], 1)
+        eq_(final['files_written'], 3)
+        a_name = '%s.%s.csv' % (sha1('/src/a.h').hexdigest(),
+                                sha1(records).hexdigest())
+        eq_(sorted(listdir(output)),
+            sorted([a_name,
+                    '%s.%s.csv' % (sha1('/src/b.cpp').hexdigest(),
+                                   sha1('def\n').hexdigest()),
+                    'abc.1.stats']))
+        with open(join(output, a_name)) as file:
+            eq_(file.read(), records)
+    finally:
+        rmtree(folder)
+
+
+def test_counters():
+    """Live counters should be available while the collector runs."""
+    folder = mkdtemp()
+    try:
+        socket_path = join(folder, 'socket')
+        server = Collector(socket_path, folder)
+        thread = Thread(target=server.serve_forever)
+        thread.start()
+        try:
+            eq_(counters(socket_path)['blobs'], 0)
+        finally:
+            stop(socket_path)
+            thread.join()
+            server.server_close()
+    finally:
+        rmtree(folder)
+
+
+def test_write_errors():
+    """Failing to write a blob should be counted, not hang flush()."""
+    folder = mkdtemp()
+    try:
+        socket_path = join(folder, 'socket')
+        output = join(folder, 'out')
+        makedirs(output)
+        server = Collector(socket_path, output)
+        thread = Thread(target=server.serve_forever)
+        thread.start()
+        # Removing the folder, rather than chmodding it, makes it unwritable
+        # even to root.
+        rmtree(output)
+
+        _send(socket_path, [('c', '/src/a.h', 'def\n'),
+                            ('s', 'abc.1.stats', 'stats\n')])
+        final = stop(socket_path)
+        thread.join()
+        server.server_close()
+
+        eq_(final['files_written'], 0)
+        eq_(final['write_errors'], 2)
+        ok_(final['first_write_error'])
+    finally:
+        rmtree(folder)
+
+
+def test_truncated_frame():
+    """A frame cut short, as by a compiler being killed, should be dropped
+    rather than written as a valid-looking CSV."""
+    folder = mkdtemp()
+    try:
+        socket_path = join(folder, 'socket')
+        output = join(folder, 'out')
+        makedirs(output)
+        server = Collector(socket_path, output)
+        thread = Thread(target=server.serve_forever)
+        thread.start()
+
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect(socket_path)
+        sock.sendall(HEADER.pack('c', len('/src/a.h'), 100) +
+                     '/src/a.h' + 'ref,name,"x"\n')
+        sock.close()
+        final = stop(socket_path)
+        thread.join()
+        server.server_close()
+
+        eq_(final['blobs'], 0)
+        eq_(listdir(output), [])
+    finally:
+        rmtree(folder)
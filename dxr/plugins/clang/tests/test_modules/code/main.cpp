@@ -0,0 +1,14 @@
+#include "shapes.h"
+
+int Triangle::sides() {
+  return 3;
+}
+
+int perimeter(int side) {
+  Triangle t;
+  return t.sides() * side;
+}
+
+int main(int argc, char* argv[]) {
+  return perimeter(2);
+}
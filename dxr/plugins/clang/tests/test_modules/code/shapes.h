@@ -0,0 +1,6 @@
+class Triangle {
+  public:
+    int sides();
+};
+
+int perimeter(int side);
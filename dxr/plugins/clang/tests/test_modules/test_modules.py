@@ -0,0 +1,25 @@
+"""Tests for indexing code built with clang modules
+
+A module's headers are indexed while the module is built, and TUs importing
+it emit only their own records and their references into it.
+
+"""
+from dxr.testing import DxrInstanceTestCase
+
+
+class ModuleTests(DxrInstanceTestCase):
+    def test_types(self):
+        """Types from the module should be indexed, against its header."""
+        self.found_line_eq('type:Triangle', u'class <b>Triangle</b> {', 1)
+
+    def test_refs_into_module(self):
+        """References from the importing file to decls in the module should
+        still be recorded."""
+        self.found_line_eq('function-ref:perimeter',
+                           u'return <b>perimeter</b>(2);', 13)
+
+    def test_decls_in_module(self):
+        """Declarations in the module should point to definitions made
+        outside it."""
+        self.found_line_eq('function-decl:perimeter',
+                           u'int <b>perimeter</b>(int side);', 6)
@@ -18,16 +18,25 @@ def test_sig_needles():
 
 def test_graph_walking_cycles():
     """Make sure _walk_graph() doesn't get stuck in cycles."""
-    graph = {'A': [('B', 'b')],
-             'B': [('C', 'c')],
-             'C': [('A', 'a')]}
-    eq_(set(_walk_graph(graph, 'A', set(['A']))),
+    graph = {1: [(2, 'B', 'b')],
+             2: [(3, 'C', 'c')],
+             3: [(1, 'A', 'a')]}
+    eq_(set(_walk_graph(graph, 1, set([1]))),
         set([('B', 'b'), ('C', 'c')]))
 
 def test_graph_walking_dupes():
     """Make sure _walk_graph() doesn't emit duplicates."""
-    graph = {'A': [('B', 'b'), ('C', 'c')],
-             'B': [('D', 'd')],
-             'C': [('D', 'd')]}
-    eq_(set(_walk_graph(graph, 'A', set(['A']))),
+    graph = {1: [(2, 'B', 'b'), (3, 'C', 'c')],
+             2: [(4, 'D', 'd')],
+             3: [(4, 'D', 'd')]}
+    eq_(set(_walk_graph(graph, 1, set([1]))),
         set([('B', 'b'), ('C', 'c'), ('D', 'd')]))
+
+
+def test_graph_walking_same_qualname():
+    """Distinct symbols should be walked separately even if their qualnames
+    collide."""
+    graph = {1: [(2, 'B', 'b'), (3, 'B', 'b')],
+             3: [(4, 'D', 'd')]}
+    eq_(set(_walk_graph(graph, 1, set([1]))),
+        set([('B', 'b'), ('D', 'd')]))
@@ -0,0 +1,12 @@
+int Shape::sides() {
+  return 4;
+}
+
+int area(int width, int height) {
+  return width * height;
+}
+
+int main(int argc, char* argv[]) {
+  Shape square;
+  return area(square.sides(), 2);
+}
@@ -0,0 +1,6 @@
+class Shape {
+  public:
+    int sides();
+};
+
+int area(int width, int height);
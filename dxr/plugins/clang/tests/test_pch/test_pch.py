@@ -0,0 +1,25 @@
+"""Tests for indexing translation units that use a precompiled header
+
+Decls in the PCH are indexed when it's built and skipped in the TUs that load
+it, so these make sure nothing falls through the cracks in between.
+
+"""
+from dxr.testing import DxrInstanceTestCase
+
+
+class PchTests(DxrInstanceTestCase):
+    def test_types(self):
+        """Types from the PCH should be indexed, against the header."""
+        self.found_line_eq('type:Shape', u'class <b>Shape</b> {', 1)
+
+    def test_refs_into_pch(self):
+        """References from the main file to decls in the PCH should still be
+        recorded."""
+        self.found_line_eq('function-ref:area',
+                           u'return <b>area</b>(square.sides(), 2);', 11)
+
+    def test_decls_in_pch(self):
+        """Declarations in the PCH should still point to definitions made
+        outside it."""
+        self.found_line_eq('function-decl:area',
+                           u'int <b>area</b>(int width, int height);', 6)
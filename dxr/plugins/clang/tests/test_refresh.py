@@ -0,0 +1,60 @@
+"""Unit tests for how the clang plugin keeps its CSVs straight across
+refreshes"""
+
+from collections import defaultdict
+from hashlib import sha1
+from os import listdir, makedirs
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr.plugins.clang.indexers import TreeToIndex
+
+
+class _Tree(object):
+    def __init__(self, temp_folder):
+        self.temp_folder = temp_folder
+
+
+def _csv_name(path, content):
+    return '%s.%s.csv' % (sha1(path).hexdigest(), sha1(content).hexdigest())
+
+
+def _write(folder, name):
+    with open(join(folder, name), 'w'):
+        pass
+
+
+def test_header_refresh():
+    """Refreshing a header should take up its new CSVs and throw out the new
+    ones the rebuilt TUs wrote for unchanged files, which aren't reindexed."""
+    folder = mkdtemp()
+    try:
+        tree_indexer = TreeToIndex('clang', _Tree(folder), None)
+        tree_indexer.pre_build()
+        temp = join(folder, 'plugins', 'clang')
+        makedirs(temp)
+        old_header = _csv_name('a.h', 'old')
+        old_tu = _csv_name('a.cpp', 'old')
+        for name in [old_header, old_tu]:
+            _write(temp, name)
+        tree_indexer._csv_map = defaultdict(list)
+        for name in [old_header, old_tu]:
+            tree_indexer._csv_map[name.split('.')[0]].append(name[:-4])
+
+        tree_indexer.pre_refresh(['a.h'])
+        # Rebuilding a.cpp writes a.h's new CSV and, since a.cpp's refs into
+        # a.h moved, a new one for a.cpp:
+        new_header = _csv_name('a.h', 'new')
+        for name in [new_header, _csv_name('a.cpp', 'new')]:
+            _write(temp, name)
+        tree_indexer.post_refresh(['a.h'])
+
+        eq_(sorted(listdir(temp)), sorted([new_header, old_tu]))
+        eq_(tree_indexer._csv_map[sha1('a.h').hexdigest()],
+            [new_header[:-4]])
+        eq_(tree_indexer._csv_map[sha1('a.cpp').hexdigest()], [old_tu[:-4]])
+    finally:
+        rmtree(folder)
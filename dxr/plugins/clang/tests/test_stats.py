@@ -0,0 +1,41 @@
+"""Unit tests for the digestion of the compiler plugin's per-TU stats"""
+
+from os.path import join
+from shutil import rmtree
+from StringIO import StringIO
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr.plugins.clang.stats import tu_stats, write_summary
+
+
+def test_summary():
+    """Counts should be summed, sizes maxed, TUs ranked by time, and those
+    that went over budget named."""
+    folder = mkdtemp()
+    try:
+        with open(join(folder, 'a.1.stats'), 'w') as file:
+            file.write('stats,file,"a.cpp",records,"10",arena_bytes,"4096",'
+                       'walk_ms,"5",output_ms,"1"\n')
+        with open(join(folder, 'b.2.stats'), 'w') as file:
+            file.write('stats,file,"b.cpp",records,"20",arena_bytes,"1024",'
+                       'walk_ms,"30",output_ms,"2",values_skipped,"3",'
+                       'over_budget,"1"\n')
+        log = StringIO()
+        write_summary(tu_stats(folder), log)
+        eq_(log.getvalue(),
+            'TUs: 2\n'
+            'Total output_ms: 3\n'
+            'Total over_budget: 1\n'
+            'Total records: 30\n'
+            'Total values_skipped: 3\n'
+            'Total walk_ms: 35\n'
+            'Peak arena_bytes: 4096\n'
+            'Slowest TUs (ms):\n'
+            '        32 b.cpp\n'
+            '         6 a.cpp\n'
+            'TUs over budget (see [[clang]] options):\n'
+            '           b.cpp\n')
+    finally:
+        rmtree(folder)
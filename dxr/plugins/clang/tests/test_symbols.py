@@ -0,0 +1,56 @@
+"""Unit tests for the table of definitions behind direct searches"""
+
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr.artifacts import write_sorted_table
+from dxr.plugins.clang.symbols import (add_definition, symbol_lookup,
+                                       symbol_rows, SYMBOL_TABLE)
+
+
+def test_lookups():
+    """Direct-search fields should find definitions, case-sensitively or
+    not, and should report ambiguity."""
+    definitions = set()
+    for kind, fields in [
+            ('function', {'name': 'bar', 'qualname': 'Foo::bar(int)',
+                          'loc': 'foo.cpp:12:5', 'locend': 'foo.cpp:12:8'}),
+            ('type', {'name': 'Foo', 'qualname': 'Foo',
+                      'loc': 'foo.h:3:7', 'locend': 'foo.h:3:10'}),
+            ('type', {'name': 'FOO', 'qualname': 'FOO',
+                      'loc': 'other.h:9:7', 'locend': 'other.h:9:10'}),
+            ('macro', {'name': 'BAR',
+                       'loc': 'foo.h:1:9', 'locend': 'foo.h:1:12'}),
+            ('ref', {'name': 'Foo', 'qualname': 'Foo',
+                     'loc': 'foo.cpp:20:1', 'locend': 'foo.cpp:20:4'}),
+            # Without a locend, there's no needle, so there should be no row:
+            ('function', {'name': 'baz', 'qualname': 'baz()',
+                          'loc': 'foo.cpp:30:1', 'locend': ''})]:
+        add_definition(definitions, kind, fields)
+
+    folder = mkdtemp()
+    try:
+        write_sorted_table(join(folder, SYMBOL_TABLE),
+                           symbol_rows(definitions))
+
+        def lookup(field, arg):
+            return symbol_lookup(field)({'arg': arg}, folder)
+
+        eq_(lookup('c_function.name', u'bar'), [(u'foo.cpp', 12)])
+        eq_(lookup('c_function.qualname', u'Foo::bar'), [(u'foo.cpp', 12)])
+        eq_(lookup('c_function.qualname', u'Foo::bar(int)'),
+            [(u'foo.cpp', 12)])
+        eq_(lookup('c_function.qualname.lower', u'FOO::BAR'),
+            [(u'foo.cpp', 12)])
+        eq_(lookup('c_function.name', u'baz'), [])
+        eq_(lookup('c_type.name', u'Foo'), [(u'foo.h', 3)])
+        eq_(len(lookup('c_type.name.lower', u'foo')), 2)
+        eq_(lookup('c_macro.name', u'BAR'), [(u'foo.h', 1)])
+        eq_(lookup('c_macro.name', u'bar'), [])
+        eq_(symbol_lookup('c_type.name')({'arg': u'Foo'}, join(folder, 'x')),
+            None)
+    finally:
+        rmtree(folder)
@@ -0,0 +1,23 @@
+"""Tests for turning the compiler plugin's syntax rows into regions"""
+
+from nose.tools import eq_
+
+from dxr.plugins.clang.syntax import syntax_regions
+
+
+def test_syntax_regions():
+    """Items should become rows, columns, and CSS classes, and unknown classes
+    should be skipped."""
+    eq_([(start_row, start_col, end_row, end_col, region.css_class)
+         for start_row, start_col, end_row, end_col, region in
+         syntax_regions('p1:0-1:8 k3:0-3:3 s3:10-3:15 z4:0-4:1 n4:6-4:8 '
+                        'c5:0-7:2')],
+        [(1, 0, 1, 8, 'p'),
+         (3, 0, 3, 3, 'k'),
+         (3, 10, 3, 15, 'str'),
+         (4, 6, 4, 8, 'n'),
+         (5, 0, 7, 2, 'c')])
+
+
+def test_empty():
+    eq_(list(syntax_regions('')), [])
@@ -15,13 +15,17 @@ from parsimonious import ParseError
 from dxr.es import (UNINDEXED_STRING, UNANALYZED_STRING, UNINDEXED_INT,
                     UNINDEXED_LONG)
 from dxr.exceptions import BadTerm
-from dxr.filters import Filter, negatable, FILE, LINE
+from dxr.filters import Filter, negatable, line_filter, FILE, LINE
 import dxr.indexers
+from dxr.metrics import phase
 from dxr.mime import is_binary_image, is_textual_image
 from dxr.query import some_filters
+from dxr.query_cache import LruCache
 from dxr.plugins import direct_search
+from dxr.trigram_index import matching_paths
 from dxr.trigrammer import (regex_grammar, NGRAM_LENGTH, es_regex_filter,
-                            NoTrigrams, PythonRegexVisitor)
+                            NoTrigrams, PythonRegexVisitor,
+                            SubstringTreeVisitor)
 from dxr.utils import glob_to_regex, split_content_lines, unicode_for_display
 
 __all__ = ['mappings', 'analyzers', 'TextFilter', 'PathFilter', 'FilenameFilter',
@@ -86,6 +90,10 @@ mappings = {
                 'type': 'boolean',
                 'index': 'no'
             },
+            'content_stored': {  # whether the content store has the file
+                'type': 'boolean',
+                'index': 'no'
+            },
             'description': UNINDEXED_STRING,
 
             # Sidebar nav links:
@@ -113,10 +121,15 @@ mappings = {
         '_all': {
             'enabled': False
         },
+        # File-wide needles are stored once, on the FILE doc, rather than on
+        # each line. Line queries get at them with has_parent filters.
+        '_parent': {
+            'type': FILE
+        },
         'properties': {
+            # The one file-wide needle copied onto lines, for grouping
+            # results by file, sorting, and fetching a file's lines
             'path': PATH_SEGMENT_MAPPING,
-            'file_name': PATH_SEGMENT_MAPPING,
-            'ext': UNANALYZED_STRING,
             # TODO: After the query language refresh, use match_phrase_prefix
             # queries on non-globbed paths, analyzing them with the path
             # analyzer, for max perf. Perfect! Otherwise, fall back to trigram-
@@ -165,6 +178,9 @@ mappings = {
                         'plugin': UNINDEXED_STRING,
                         'id': UNINDEXED_STRING,  # Ref ID
                         'menu_data': UNINDEXED_STRING,  # opaque to ES
+                        # Or, instead, the key of the data in the menu table
+                        # artifact
+                        'menu_id': UNINDEXED_STRING,
                         'hover': UNINDEXED_STRING,
                         # Hash of qualname of the symbol we're hanging the
                         # menu off of, if it is a symbol and we can come up
@@ -309,6 +325,7 @@ class PathFilter(_PathSegmentFilterBase):
     description = Markup('File or directory sub-path to search within. <code>*'
                          '</code>, <code>?</code>, and <code>[...]</code> act '
                          'as shell wildcards.')
+    on_lines = True
 
     @negatable
     def filter(self):
@@ -358,22 +375,34 @@ class RegexpFilter(Filter):
                          r'<code>regexp:(?i)\bs?printf</code> '
                          r'<code>regexp:"(three|3) mice"</code>')
 
+    # Parsed and compiled regexes, by term arg and case sensitivity
+    _plans = LruCache(1000)
+
     def __init__(self, term, enabled_plugins):
         """Compile the Python equivalent of the regex so we don't have to lean
         on the regex cache during highlighting.
 
         Python's regex cache is naive: after it hits 100, it just clears: no
-        LRU.
+        LRU. So we keep our own, which also saves reparsing popular regexes.
 
         """
         super(RegexpFilter, self).__init__(term, enabled_plugins)
+        key = term['arg'], term['case_sensitive']
+        plan = self._plans.get(key)
+        if plan is None:
+            plan = self._plan(*key)
+            self._plans.set(key, plan)
+        self._parsed_regex, self._compiled_regex = plan
+
+    @staticmethod
+    def _plan(regex, is_case_sensitive):
         try:
-            self._parsed_regex = regex_grammar.parse(term['arg'])
+            parsed = regex_grammar.parse(regex)
         except ParseError:
             raise BadTerm('Invalid regex.')
-        self._compiled_regex = (
-                re.compile(PythonRegexVisitor().visit(self._parsed_regex),
-                           flags=0 if self._term['case_sensitive'] else re.I))
+        python_regex = PythonRegexVisitor().visit(parsed)
+        flags = 0 if is_case_sensitive else re.I
+        return parsed, re.compile(python_regex, flags=flags)
 
     @negatable
     def filter(self):
@@ -381,11 +410,25 @@ class RegexpFilter(Filter):
             return es_regex_filter(
                 self._parsed_regex,
                 'content',
-                is_case_sensitive=self._term['case_sensitive'])
+                is_case_sensitive=self._term['case_sensitive'],
+                prefilter=self._trigram_index_filter())
         except NoTrigrams:
             raise BadTerm('Regexes need at least 3 literal characters in a  '
                           'row for speed.')
 
+    def _trigram_index_filter(self):
+        """Return an ES filter for just the files the trigram index says
+        match, or None if there's no index or it can't say."""
+        if self.artifact_folder:
+            with phase('trigrams'):
+                paths = matching_paths(
+                    self.artifact_folder,
+                    SubstringTreeVisitor().visit(
+                        self._parsed_regex).simplified(),
+                    self._compiled_regex)
+            if paths is not None:
+                return {'terms': {'path': paths}}
+
     def highlight_content(self, result):
         return (m.span() for m in
                 self._compiled_regex.finditer(result['content'][0]))
@@ -403,7 +446,8 @@ class FilterAggregator(Filter):
 
     def filter(self):
         # OR together all the underlying filters.
-        return {'or': filter(None, (f.filter() for f in self.filters))}
+        return {'or': filter(None, (line_filter(f) if self.domain == LINE
+                                    else f.filter() for f in self.filters))}
 
     def highlight_content(self, result):
         # Union all of our underlying filters.
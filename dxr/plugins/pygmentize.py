@@ -99,6 +99,9 @@ def _regions_for_contents(lexer, contents):
 class FileToIndex(dxr.indexers.FileToIndex):
     """Emitter of CSS classes for syntax-highlit regions"""
 
+    # Plugins that know better, like clang, can color files for us.
+    syntax_fallback = True
+
     def regions(self):
         lexer = _lexer_for_filename(basename(self.path))
         if lexer:
@@ -1,15 +1,24 @@
 import cgi
+from copy import deepcopy
 from itertools import chain, groupby
 from operator import itemgetter
 import re
 
 from parsimonious import Grammar, NodeVisitor
 
-from dxr.filters import LINE, FILE
+from dxr.filters import LINE, FILE, line_filter
+from dxr.metrics import phase
 from dxr.mime import icon
+from dxr.query_cache import LruCache
 from dxr.utils import append_update, cached
 
 
+# Parsed queries, by enabled plugins and query text. Parsing is a
+# noticeable part of the cost of a search, and the same queries come in
+# over and over.
+_plans = LruCache(1000)
+
+
 @cached
 def direct_searchers(plugins):
     """Return a list of all direct searchers, ordered by priority, then plugin
@@ -32,13 +41,27 @@ def direct_searchers(plugins):
 class Query(object):
     """Query object, constructor will parse any search query"""
 
-    def __init__(self, es_search, querystr, enabled_plugins):
+    def __init__(self, es_search, querystr, enabled_plugins,
+                 artifact_folder=None):
+        """
+        :arg artifact_folder: The folder of artifacts from the build of the
+            index being searched, if any. Direct searchers may answer from
+            them without bothering ES.
+
+        """
         self.es_search = es_search
         self.enabled_plugins = list(enabled_plugins)
+        self.artifact_folder = artifact_folder
 
         # A list of dicts describing query terms:
-        grammar = query_grammar(self.enabled_plugins)
-        self.terms = QueryVisitor().visit(grammar.parse(querystr))
+        key = tuple(p.name for p in self.enabled_plugins), querystr
+        terms = _plans.get(key)
+        if terms is None:
+            grammar = query_grammar(self.enabled_plugins)
+            terms = QueryVisitor().visit(grammar.parse(querystr))
+            _plans.set(key, terms)
+        # Filters keep the terms around, so give each query its own.
+        self.terms = deepcopy(terms)
 
     def single_term(self):
         """Return the single, non-negated textual term in the query.
@@ -95,11 +118,17 @@ class Query(object):
         """
         enabled_filters_by_name = filters_by_name(self.enabled_plugins)
 
+        def make_filter(f, term):
+            """Instantiate a Filter class for a term."""
+            instance = f(term, self.enabled_plugins)
+            instance.artifact_folder = self.artifact_folder
+            return instance
+
         def group_filters_by_term(predicate):
             """Return an iterable of lists of ES filters for each term, filtered on
             predicate(Filter)."""
 
-            return ([f(term, self.enabled_plugins) for f in enabled_filters_by_name[term['name']]
+            return ([make_filter(f, term) for f in enabled_filters_by_name[term['name']]
                      if predicate(f)] for term in self.terms)
 
         def group_filters_by_name(predicate):
@@ -110,7 +139,7 @@ class Query(object):
             for term in self.terms:
                 for f in enabled_filters_by_name[term['name']]:
                     if predicate(f):
-                        d.setdefault(term['name'], []).append(f(term, self.enabled_plugins))
+                        d.setdefault(term['name'], []).append(make_filter(f, term))
             return d.itervalues()
 
         # Instantiate applicable filters, yielding a list of lists, each inner
@@ -128,7 +157,8 @@ class Query(object):
 
         # An ORed-together ball for each term's filters, omitting filters that
         # punt by returning {} and ors that contain nothing but punts:
-        ors = filter(None, [filter(None, (f.filter() for f in term))
+        clause = line_filter if is_line_query else lambda f: f.filter()
+        ors = filter(None, [filter(None, (clause(f) for f in term))
                             for term in filters])
         ors = [{'or': x} for x in ors]
 
@@ -155,12 +185,13 @@ class Query(object):
                 'match_all': {}
             }
 
-        results = self.es_search(
-            {'query': query,
-             'sort': ['path', 'number'] if is_line_query else ['path'],
-             'from': offset,
-             'size': limit},
-            doc_type=LINE if is_line_query else FILE)['hits']
+        with phase('es'):
+            results = self.es_search(
+                {'query': query,
+                 'sort': ['path', 'number'] if is_line_query else ['path'],
+                 'from': offset,
+                 'size': limit},
+                doc_type=LINE if is_line_query else FILE)['hits']
         result_count = results['total']
         results = [r['_source'] for r in results['hits']]
 
@@ -188,19 +219,33 @@ class Query(object):
         for searcher in direct_searchers(self.enabled_plugins):
             clause = searcher(term)
             if clause:
-                results = self.es_search(
-                    {
-                        'query': {
-                            'filtered': {
-                                'query': {
-                                    'match_all': {}
-                                },
-                                'filter': clause
-                            }
+                # A searcher with a local_lookup() can look in the build's
+                # artifacts, returning a list of (path, line) pairs, or None
+                # if they have nothing to say.
+                local_lookup = getattr(searcher, 'local_lookup', None)
+                if local_lookup and self.artifact_folder:
+                    hits = local_lookup(term, self.artifact_folder)
+                    if hits is not None:
+                        if len(hits) == 1:
+                            return hits[0]
+                        elif len(hits) > 1:
+                            return None
+                        continue
+
+                with phase('es'):
+                    results = self.es_search(
+                        {
+                            'query': {
+                                'filtered': {
+                                    'query': {
+                                        'match_all': {}
+                                    },
+                                    'filter': clause
+                                }
+                            },
+                            'size': 2
                         },
-                        'size': 2
-                    },
-                    doc_type=searcher.domain)['hits']['hits']
+                        doc_type=searcher.domain)['hits']['hits']
                 if len(results) == 1:
                     result = results[0]['_source']
                     # Everything is stored as arrays in ES. Pull it all out:
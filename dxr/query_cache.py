@@ -0,0 +1,131 @@
+"""In-process caches of parsed queries and of search results
+
+A handful of queries, like searches for popular identifiers, make up much
+of the load on the web app and on ES. Parsing a query and its regexes again
+each time is wasted CPU, and running the same ES queries again is wasted
+round trips, so the app keeps the most recently used of each around.
+
+Results are only good for as long as the index they came from is live, so
+they're keyed by the name of the concrete ES index, which the catalog
+records when a build is deployed. When a deploy swaps a tree's alias to a
+new index, the tree's cached results stop being found and are thrown out.
+Since the refresh service changes live indices in place, results also
+expire after a while.
+
+"""
+from json import dumps
+from threading import Lock
+from time import time
+
+from ordereddict import OrderedDict
+
+from dxr.metrics import phase
+
+
+class LruCache(object):
+    """A thread-safe mapping of bounded size, which forgets its least
+    recently used entries first"""
+
+    def __init__(self, size, max_age=None):
+        """
+        :arg size: The most entries to keep
+        :arg max_age: The number of seconds after which to forget an entry,
+            or None to keep them until they're crowded out
+
+        """
+        self.size = size
+        self.max_age = max_age
+        self._entries = OrderedDict()
+        self._lock = Lock()
+
+    def get(self, key, default=None):
+        with self._lock:
+            try:
+                expiry, value = self._entries.pop(key)
+            except KeyError:
+                return default
+            if expiry is not None and expiry < time():
+                return default
+            self._entries[key] = expiry, value  # Move it to the young end.
+            return value
+
+    def set(self, key, value):
+        with self._lock:
+            self._entries.pop(key, None)
+            self._entries[key] = (None if self.max_age is None
+                                  else time() + self.max_age), value
+            while len(self._entries) > self.size:
+                self._entries.popitem(last=False)
+
+    def discard(self, predicate):
+        """Forget the entries whose keys satisfy ``predicate``."""
+        with self._lock:
+            for key in [k for k in self._entries if predicate(k)]:
+                del self._entries[key]
+
+    def __len__(self):
+        return len(self._entries)
+
+
+# Tells a cached None from a miss
+_NONE = object()
+
+
+class ResultCache(LruCache):
+    """An :class:`LruCache` of search results, keyed by tree and ES index"""
+
+    def __init__(self, size, max_age=None):
+        super(ResultCache, self).__init__(size, max_age)
+        self._indices = {}
+
+    def wrap(self, query, tree, index):
+        """Return a stand-in for a :class:`~dxr.query.Query` which answers
+        from the cache when it can.
+
+        If ``index`` isn't the one the tree's results were last cached for,
+        a new build has been deployed, so throw the old ones out.
+
+        """
+        with self._lock:
+            if self._indices.get(tree) != index:
+                self._indices[tree] = index
+                for key in [k for k in self._entries
+                            if k[0] == tree and k[1] != index]:
+                    del self._entries[key]
+        return CachedQuery(query, self, (tree, index))
+
+
+class CachedQuery(object):
+    """A :class:`~dxr.query.Query` whose results and direct results are kept
+    in a :class:`ResultCache`"""
+
+    def __init__(self, query, cache, scope):
+        self._query = query
+        self._cache = cache
+        self._scope = scope
+
+    def __getattr__(self, name):
+        return getattr(self._query, name)
+
+    def _key(self, *args):
+        return self._scope + (dumps(self._query.terms, sort_keys=True),) + args
+
+    def results(self, offset=0, limit=100):
+        key = self._key('results', offset, limit)
+        ret = self._cache.get(key)
+        if ret is None:
+            ret = self._query.results(offset, limit)
+            # Results are highlighted lazily, so listing them does it:
+            with phase('highlight'):
+                ret = dict(ret, results=list(ret['results']))
+            self._cache.set(key, ret)
+        # Hand out a fresh iterator, like Query.results() does.
+        return dict(ret, results=iter(ret['results']))
+
+    def direct_result(self):
+        key = self._key('direct')
+        ret = self._cache.get(key)
+        if ret is None:
+            ret = self._query.direct_result()
+            self._cache.set(key, _NONE if ret is None else ret)
+        return None if ret is _NONE else ret
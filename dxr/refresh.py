@@ -0,0 +1,195 @@
+"""A long-running service which reindexes single files as they change
+
+A full ``dxr index`` of a big tree takes hours, which is a long time for code
+review tools to wait for cross-references to catch up with a push.
+:class:`Refresher` loads a tree's whole-program analysis and compilation
+database once and then, for each batch of changed files it's told about,
+rebuilds just the TUs that are or include them and replaces just those
+files' docs in the tree's live ES index.
+
+It needs what a full build leaves in the temp folder, so index the tree with
+``clean`` in ``skip_stages``, and it needs ``compile_commands`` to know how to
+rebuild TUs. To find the TUs that include a changed header, it walks the
+include graph among the index's artifacts, so ``artifact_folder`` must be set
+as well.
+
+Whole-program data, like which methods override which, and the artifacts stay
+as they were at the last full build, except that the trigram index notes
+which files have changed. So do the docs of files other than the
+changed ones, even if their references into the changed ones moved.
+
+"""
+import os
+from os.path import isdir, isfile, join, normpath, relpath
+from threading import Lock
+from time import time
+
+from flask import Flask, jsonify, request
+from funcy import first
+from pyelasticsearch import ElasticSearch
+
+from dxr import artifacts, compile_db
+from dxr.app import make_app
+from dxr.build import index_file
+from dxr.config import FORMAT
+from dxr.exceptions import BuildError
+from dxr.filters import FILE, LINE
+from dxr.include_graph import include_graph_tables, reachable
+from dxr.trigram_index import mark_stale
+from dxr.utils import open_log
+from dxr.vcs import VcsCache
+
+
+class Refresher(object):
+    """Keeper of what it takes to rebuild and reindex parts of one tree"""
+
+    def __init__(self, tree):
+        """Load the compilation database, and run the plugins' whole-program
+        analysis over the last full build's output.
+
+        Raise :class:`~dxr.exceptions.BuildError` if the tree can't be
+        refreshed.
+
+        """
+        if not tree.compile_commands:
+            raise BuildError("Tree '%s' has no compile_commands, so there's "
+                             "no telling how to rebuild parts of it." %
+                             tree.name)
+        if not isdir(join(tree.temp_folder, 'plugins')):
+            raise BuildError("Tree '%s' has no temp files from a full build. "
+                             "Index it with 'clean' in skip_stages first." %
+                             tree.name)
+        config = tree.config
+        self.tree = tree
+        self.es = ElasticSearch(config.es_hosts,
+                                timeout=config.es_indexing_timeout,
+                                max_retries=config.es_indexing_retries)
+        self.alias = config.es_alias.format(format=FORMAT, tree=tree.name)
+        self.index = self._live_index()
+        if not self.index:
+            raise BuildError("Tree '%s' hasn't been indexed yet." % tree.name)
+        folder = artifacts.published_folder(config, self.index)
+        if not (folder and include_graph_tables(folder)):
+            # Without it, a changed header's CSVs would be dropped with no TU
+            # rebuilt to replace them.
+            raise BuildError("Tree '%s' has no include graph, so there's no "
+                             "telling which TUs a header is in. Set "
+                             "artifact_folder, and index it again." %
+                             tree.name)
+        self.commands = compile_db.compile_commands(tree.compile_commands)
+        self.app = make_app(config)
+
+        # A full build of the tree may be under way, so load_build() leaves
+        # its staged artifacts, logs, and cache alone.
+        self.tree_indexers = [p.tree_to_index(p.name, tree, VcsCache(tree))
+                              for p in tree.enabled_plugins if p.tree_to_index]
+        for tree_indexer in self.tree_indexers:
+            tree_indexer.pre_build()
+        for tree_indexer in self.tree_indexers:
+            tree_indexer.load_build()
+
+    def _live_index(self):
+        """Return the name of the index the tree's alias points to."""
+        return first(self.es.aliases(self.alias))
+
+    def affected_commands(self, paths):
+        """Return the compile commands of the TUs which are or include any of
+        ``paths``."""
+        affected = set(paths)
+        folder = artifacts.published_folder(self.tree.config, self.index)
+        _, includers = include_graph_tables(folder)
+        for path in paths:
+            affected.update(reachable(includers, path)[0])
+        return [(directory, file, argv)
+                for directory, file, argv in self.commands
+                if relpath(file, self.tree.source_folder) in affected]
+
+    def refresh(self, paths):
+        """Rebuild the TUs affected by changes to some files, and replace the
+        files' docs in ES.
+
+        Files which no longer exist just have their docs deleted.
+
+        :arg paths: The changed files' paths, relative to the source folder
+
+        Return the paths of the TUs rebuilt and of those which failed to
+        compile. Raise :class:`~dxr.exceptions.BuildError` if a full build
+        has replaced the index since we started, since its temp files are
+        gone with it.
+
+        """
+        tree = self.tree
+        if self._live_index() != self.index:
+            raise BuildError("Tree '%s' has been reindexed since the refresh "
+                             "service started. Restart it." % tree.name)
+        commands = self.affected_commands(paths)
+        for tree_indexer in self.tree_indexers:
+            tree_indexer.pre_refresh(paths)
+        try:
+            environ = os.environ.copy()
+            for tree_indexer in self.tree_indexers:
+                environ.update(tree_indexer.environment(environ))
+            with open_log(tree.log_folder, 'refresh.log') as log:
+                failures = [path for path, _, code in
+                            compile_db.run(commands,
+                                           max(tree.workers, 1),
+                                           environ,
+                                           log)
+                            if code]
+        finally:
+            # Even if the compiles blew up, stop any collectors and clear
+            # out what they wrote, lest the next refresh count it as old.
+            for tree_indexer in self.tree_indexers:
+                tree_indexer.post_refresh(paths)
+
+        # So index_file() can use url_for():
+        with self.app.test_request_context():
+            for path in paths:
+                self.es.delete_by_query(self.index,
+                                        [FILE, LINE],
+                                        {'query': {'term': {'path': path}}})
+                absolute = join(tree.source_folder, path)
+                if isfile(absolute):
+                    index_file(tree,
+                               self.tree_indexers,
+                               absolute,
+                               self.es,
+                               self.index)
+        self.es.refresh(index=self.index)
+        folder = artifacts.published_folder(tree.config, self.index)
+        if folder and tree.trigram_index:
+            mark_stale(folder, paths)
+        return [file for _, file, _ in commands], failures
+
+
+def make_service(refresher):
+    """Return a WSGI app which refreshes files on request.
+
+    POST one or more ``path`` params, relative to the source folder, to
+    ``/refresh``. Refreshes happen one at a time, since concurrent ones might
+    rebuild the same TUs. Once a full build replaces the index, every refresh
+    gets a 409 until the service is restarted.
+
+    """
+    service = Flask('dxr.refresh')
+    lock = Lock()
+
+    @service.route('/refresh', methods=['POST'])
+    def refresh():
+        paths = [normpath(path).encode('utf-8')
+                 for path in request.values.getlist('path')]
+        if not paths or any(path.startswith(('/', '..')) for path in paths):
+            return jsonify({'error': 'Pass one or more "path" params, '
+                                     'relative to the source folder.'}), 400
+        with lock:
+            start = time()
+            try:
+                rebuilt, failures = refresher.refresh(paths)
+            except BuildError as exc:
+                return jsonify({'error': str(exc)}), 409
+        return jsonify({'paths': paths,
+                        'rebuilt': rebuilt,
+                        'failed': failures,
+                        'ms': int((time() - start) * 1000)})
+
+    return service
@@ -0,0 +1,416 @@
+"""An on-disk trigram index of file contents, for answering regex searches
+
+ES answers a regex search by evaluating the trigram constraints which
+:mod:`dxr.trigrammer` extracts and then running the regex itself, as a
+script, over every line doc that survives them. On a big tree, that's by
+far the slowest kind of query. With ``trigram_index`` on, the build also
+writes, beside the content store, an index from each trigram to the files
+containing it. The app evaluates the same
+:class:`~dxr.trigrammer.SubstringTree` against it by intersecting and
+uniting posting lists, confirms the candidate files by running the regex
+over their text from the content store, and hands ES just the files that
+really match, so its script runs over their lines alone.
+
+Each chunk of files a worker indexes goes into shards of its own, and
+:func:`merge_shards()` combines them into one once indexing is done, so a
+search looks through one dictionary rather than hundreds. A shard is::
+
+    MAGIC
+    header: number of paths, number of trigrams, bytes of paths
+    paths, separated by newlines
+    dictionary: a (trigram, offset, length) entry per trigram, sorted
+    posting lists
+
+Trigrams are folded to lowercase and packed into 64-bit ints, 21 bits per
+character. A posting list is the sorted numbers (within the shard) of the
+files having a trigram, delta-encoded as varints.
+
+Files reindexed by the refresh service since the build are listed in
+:data:`STALE`. Their shards don't reflect their new contents, so they're
+always candidates and are left to ES to confirm.
+
+"""
+from array import array
+from errno import ENOENT
+from heapq import merge
+from itertools import groupby, izip
+from mmap import mmap, ACCESS_READ
+import os
+from os.path import join
+from shutil import copyfileobj
+from struct import Struct
+from tempfile import mkstemp
+
+from dxr.content_store import stored_file
+from dxr.trigrammer import NGRAM_LENGTH, NoTrigrams, SubstringTree, And
+
+try:
+    # Native versions of decode() and intersect(). The Python ones below
+    # are the reference, and the native ones must give the same output.
+    from dxr import _postings as _native
+except ImportError:
+    _native = None
+
+
+MAGIC = 'DXRTRI1\n'
+HEADER = Struct('<III')
+ENTRY = Struct('<QQI')
+
+# What shards are named, after this prefix and a unique suffix
+SHARD_PREFIX = 'trigrams.'
+
+# The artifact listing the paths reindexed since the build
+STALE = 'trigrams.stale'
+
+# How many postings a worker holds onto before writing a shard
+SHARD_POSTINGS = 20000000
+
+# Past this many candidate or confirmed files, we leave the search to ES:
+# confirming would take too long, or the list of paths would make for a
+# giant ES filter.
+MAX_CANDIDATES = 20000
+MAX_PATHS = 1000
+
+
+def trigram_key(trigram):
+    """Pack a unicode trigram into an int, lowercasing it."""
+    a, b, c = trigram.lower()
+    return ord(a) << 42 | ord(b) << 21 | ord(c)
+
+
+def trigram_keys(text):
+    """Return the set of keys of the trigrams in some unicode text."""
+    text = text.lower()
+    return set(ord(text[i]) << 42 | ord(text[i + 1]) << 21 | ord(text[i + 2])
+               for i in xrange(len(text) - NGRAM_LENGTH + 1))
+
+
+def encode(numbers):
+    """Return a posting list of some sorted, non-negative ints."""
+    out = bytearray()
+    last = 0
+    for number in numbers:
+        delta = number - last
+        last = number
+        while delta >= 0x80:
+            out.append(delta & 0x7f | 0x80)
+            delta >>= 7
+        out.append(delta)
+    return str(out)
+
+
+def decode(data):
+    """Return the list of ints in a posting list."""
+    if _native:
+        return _native.decode(data)
+    ret = []
+    value = delta = shift = 0
+    for byte in bytearray(data):
+        delta |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            value += delta
+            ret.append(value)
+            delta = shift = 0
+    if shift:
+        raise ValueError('truncated posting list')
+    return ret
+
+
+def intersect(a, b):
+    """Return the sorted list of ints in both of two sorted lists."""
+    if _native:
+        return _native.intersect(a, b)
+    b = set(b)
+    return [x for x in a if x in b]
+
+
+class TrigramWriter(object):
+    """A writer of the shards of one chunk of files"""
+
+    def __init__(self, folder):
+        self._folder = folder
+        self._start()
+
+    def _start(self):
+        self._paths = []
+        self._postings = {}
+        self._count = 0
+
+    def add(self, path, lines):
+        """Index the text of a file.
+
+        :arg path: The bytestring path of the file, relative to the source
+            folder
+        :arg lines: The unicode lines of the file
+
+        """
+        if '\n' in path:
+            return  # Can't be listed. The app leaves it to ES.
+        number = len(self._paths)
+        self._paths.append(path)
+        keys = trigram_keys(u''.join(lines))
+        for key in keys:
+            self._postings.setdefault(key, array('L')).append(number)
+        self._count += len(keys)
+        if self._count >= SHARD_POSTINGS:
+            self._write()
+
+    def _write(self):
+        if not self._paths:
+            return
+        fd, path = mkstemp(dir=self._folder, prefix=SHARD_PREFIX)
+        os.chmod(path, 0644)  # mkstemp's 0600 would lock out the web app.
+        with os.fdopen(fd, 'wb') as shard:
+            paths = '\n'.join(self._paths)
+            keys = sorted(self._postings)
+            shard.write(MAGIC)
+            shard.write(HEADER.pack(len(self._paths), len(keys), len(paths)))
+            shard.write(paths)
+            lists = []
+            offset = 0
+            for key in keys:
+                data = encode(self._postings[key])
+                shard.write(ENTRY.pack(key, offset, len(data)))
+                lists.append(data)
+                offset += len(data)
+            shard.writelines(lists)
+        self._start()
+
+    def close(self):
+        """Write whatever's left as a last shard."""
+        self._write()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        if type is None:
+            self.close()
+
+
+class Shard(object):
+    """A memory-mapped shard of the index"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as file:
+            self._map = mmap(file.fileno(), 0, access=ACCESS_READ)
+        if self._map[:len(MAGIC)] != MAGIC:
+            raise ValueError('%s is not a trigram index shard.' % path)
+        _, self._num_keys, paths_length = HEADER.unpack_from(
+            self._map, len(MAGIC))
+        start = len(MAGIC) + HEADER.size
+        self.paths = self._map[start:start + paths_length].split('\n')
+        self._entries = start + paths_length
+        self._postings = self._entries + self._num_keys * ENTRY.size
+
+    def _entry(self, i):
+        return ENTRY.unpack_from(self._map, self._entries + i * ENTRY.size)
+
+    def postings(self, key):
+        """Return the sorted numbers of the files having a trigram key."""
+        lo, hi = 0, self._num_keys
+        while lo < hi:
+            mid = (lo + hi) // 2
+            if self._entry(mid)[0] < key:
+                lo = mid + 1
+            else:
+                hi = mid
+        if lo < self._num_keys:
+            found, offset, length = self._entry(lo)
+            if found == key:
+                start = self._postings + offset
+                return decode(self._map[start:start + length])
+        return []
+
+    def candidates(self, substrings):
+        """Return the sorted numbers of the files which might have a line
+        matching a regex, given its :class:`~dxr.trigrammer.SubstringTree`.
+
+        None means any file might.
+
+        """
+        if isinstance(substrings, basestring):
+            if len(substrings) < NGRAM_LENGTH:
+                return None
+            # Intersect the shortest lists first, so the rest get galloped
+            # through.
+            lists = sorted((self.postings(trigram_key(substrings[i:i + 3]))
+                            for i in xrange(len(substrings) - 2)), key=len)
+            ret = lists[0]
+            for list in lists[1:]:
+                if not ret:
+                    break
+                ret = intersect(ret, list)
+            return ret
+        if not isinstance(substrings, SubstringTree) or not substrings:
+            return None
+        children = [self.candidates(s) for s in substrings]
+        if isinstance(substrings, And):
+            children = sorted((c for c in children if c is not None), key=len)
+            if not children:
+                return None
+            ret = children[0]
+            for child in children[1:]:
+                ret = intersect(ret, child)
+            return ret
+        # Anything else is an Or, or as good as one.
+        if any(c is None for c in children):
+            return None
+        return [number for number, _ in groupby(merge(*children))]
+
+
+def _shard_names(folder):
+    return sorted(name for name in os.listdir(folder)
+                  if name.startswith(SHARD_PREFIX) and name != STALE)
+
+
+def merge_shards(folder):
+    """Combine the shards written by :class:`TrigramWriter`\ s into one, and
+    delete them.
+
+    Files are renumbered by shard, in order, so each posting list stays
+    sorted when the lists of one trigram from all the shards are run
+    together.
+
+    """
+    names = _shard_names(folder)
+    if len(names) < 2:
+        return
+    shards = [Shard(join(folder, name)) for name in names]
+    bases = []
+    num_paths = 0
+    for shard in shards:
+        bases.append(num_paths)
+        num_paths += len(shard.paths)
+
+    def entries(n, shard):
+        # Shard number second, so each trigram's lists come in shard order
+        for i in xrange(shard._num_keys):
+            key, start, length = shard._entry(i)
+            yield key, n, start, length
+
+    # The posting lists go in a file of their own while the dictionary is
+    # worked out, then get tacked onto the end.
+    fd, lists_path = mkstemp(dir=folder, prefix='.' + SHARD_PREFIX)
+    keys = array('L')
+    offsets = array('L')
+    lengths = array('L')
+    with os.fdopen(fd, 'wb') as lists:
+        offset = 0
+        for key, group in groupby(merge(*[entries(n, shard) for n, shard
+                                          in enumerate(shards)]),
+                                  key=lambda entry: entry[0]):
+            numbers = []
+            for _, n, start, length in group:
+                shard = shards[n]
+                start += shard._postings
+                base = bases[n]
+                numbers.extend(number + base for number in
+                               decode(shard._map[start:start + length]))
+            data = encode(numbers)
+            lists.write(data)
+            keys.append(key)
+            offsets.append(offset)
+            lengths.append(len(data))
+            offset += len(data)
+
+    fd, path = mkstemp(dir=folder, prefix=SHARD_PREFIX)
+    os.chmod(path, 0644)  # mkstemp's 0600 would lock out the web app.
+    with os.fdopen(fd, 'wb') as out:
+        paths = '\n'.join(p for shard in shards for p in shard.paths)
+        out.write(MAGIC)
+        out.write(HEADER.pack(num_paths, len(keys), len(paths)))
+        out.write(paths)
+        for entry in izip(keys, offsets, lengths):
+            out.write(ENTRY.pack(*entry))
+        with open(lists_path, 'rb') as lists:
+            copyfileobj(lists, out)
+    os.remove(lists_path)
+    for name in names:
+        os.remove(join(folder, name))
+
+
+_shards = {}
+
+
+def shards(artifact_folder):
+    """Return the :class:`Shard`\ s in an artifact folder, opening them only
+    once per process."""
+    try:
+        return _shards[artifact_folder]
+    except KeyError:
+        pass
+    if len(_shards) > 100:  # Don't hoard the shards of long-gone builds.
+        _shards.clear()
+    try:
+        names = _shard_names(artifact_folder)
+    except OSError as exc:
+        if exc.errno != ENOENT:
+            raise
+        names = []
+    ret = _shards[artifact_folder] = [Shard(join(artifact_folder, name))
+                                      for name in names]
+    return ret
+
+
+def stale_paths(artifact_folder):
+    """Return the set of paths reindexed since the build."""
+    try:
+        with open(join(artifact_folder, STALE)) as file:
+            return set(line.rstrip('\n') for line in file)
+    except IOError as exc:
+        if exc.errno != ENOENT:
+            raise
+        return set()
+
+
+def mark_stale(artifact_folder, paths):
+    """Record that some paths have been reindexed since the build."""
+    with open(join(artifact_folder, STALE), 'a') as file:
+        file.writelines(path + '\n' for path in paths if '\n' not in path)
+
+
+def matching_paths(artifact_folder, substrings, regex):
+    """Return the sorted unicode paths of the files having a line that
+    matches a regex, or None if the index can't say.
+
+    The result may include stale files which don't match; ES sorts those
+    out.
+
+    :arg substrings: The simplified :class:`~dxr.trigrammer.SubstringTree`
+        of the regex
+    :arg regex: The compiled Python equivalent of the regex. It's run
+        against each line, so ^ and $ mean what they do in ES, whatever the
+        line endings.
+
+    """
+    if isinstance(substrings, basestring) and len(substrings) < NGRAM_LENGTH:
+        raise NoTrigrams
+    found = shards(artifact_folder)
+    if not found:
+        return None
+    stale = stale_paths(artifact_folder)
+    if len(stale) > MAX_PATHS:
+        return None
+    candidates = []
+    for shard in found:
+        numbers = shard.candidates(substrings)
+        if numbers is None:
+            return None
+        candidates.extend(shard.paths[n] for n in numbers)
+        if len(candidates) > MAX_CANDIDATES:
+            return None
+
+    paths = set(stale)
+    for path in candidates:
+        if path in stale:
+            continue
+        stored = stored_file(artifact_folder, path.decode('utf-8'))
+        if stored is None:
+            return None  # Can't confirm it, so let ES.
+        if any(regex.search(line) for line in stored.lines()):
+            paths.add(path)
+            if len(paths) > MAX_PATHS:
+                return None
+    return sorted(path.decode('utf-8') for path in paths)
@@ -546,7 +546,8 @@ def boolean_filter_tree(substrings, trigram_field):
     }
 
 
-def es_regex_filter(parsed_regex, raw_field, is_case_sensitive):
+def es_regex_filter(parsed_regex, raw_field, is_case_sensitive,
+                    prefilter=None):
     """Return an efficient ES filter to find matches to a regex.
 
     Looks for fields of which ``regex`` matches a substring. (^ and $ do
@@ -559,6 +560,9 @@ def es_regex_filter(parsed_regex, raw_field, is_case_sensitive):
         raw_field.trigrams.
     :arg is_case_sensitive: Whether the match should be performed
         case-sensitive
+    :arg prefilter: An ES filter to narrow down the docs to run the regex
+        over, in place of the trigram constraints, if something else has
+        already done the narrowing
 
     """
     trigram_field = ('%s.trigrams' if is_case_sensitive else
@@ -577,7 +581,7 @@ def es_regex_filter(parsed_regex, raw_field, is_case_sensitive):
         js_regex = JsRegexVisitor().visit(parsed_regex)
         return {
             'and': [
-                boolean_filter_tree(substrings, trigram_field),
+                prefilter or boolean_filter_tree(substrings, trigram_field),
                 {
                     'script': {
                         'lang': 'js',
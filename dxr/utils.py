@@ -263,6 +263,17 @@ def cd(path):
     chdir(old_dir)
 
 
+@contextmanager
+def maybe(manager):
+    """Enter a context manager and yield what it gives, or just yield None
+    if it is None."""
+    if manager is None:
+        yield None
+    else:
+        with manager as entered:
+            yield entered
+
+
 def rmtree_if_exists(folder):
     """Remove a folder if it exists. Otherwise, do nothing."""
     try:
@@ -5,7 +5,7 @@ try:
 except ImportError:
     pass
 
-from setuptools import setup, find_packages
+from setuptools import setup, find_packages, Extension
 
 
 setup(
@@ -17,6 +17,11 @@ setup(
     author_email='erik@mozilla.com',
     license='MIT',
     packages=find_packages(exclude=['ez_setup']),
+    # Speedups for dxr.lines and dxr.trigram_index. They fall back to pure
+    # Python without them.
+    ext_modules=[Extension('dxr._lines', ['dxr/_lines.c'], optional=True),
+                 Extension('dxr._postings', ['dxr/_postings.c'],
+                           optional=True)],
     entry_points={'dxr.plugins': ['urllink = dxr.plugins.urllink',
                                   'buglink = dxr.plugins.buglink:plugin',
                                   'clang = dxr.plugins.clang:plugin',
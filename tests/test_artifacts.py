@@ -0,0 +1,38 @@
+"""Tests for the files builds leave beside their indices"""
+
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr.artifacts import SortedTable, sorted_table, write_sorted_table
+
+
+def test_sorted_table():
+    """Every key should find all its values and no others, whether it's at
+    the start, middle, or end of the table or not there at all."""
+    folder = mkdtemp()
+    try:
+        path = join(folder, 'table')
+        rows = [('key%03i' % i, 'value%i' % j)
+                for i in xrange(0, 300, 3) for j in xrange(i % 4)]
+        write_sorted_table(path, rows + rows)  # Dupes should be dropped.
+        table = SortedTable(path)
+        for i in xrange(-1, 301):
+            eq_(table.values('key%03i' % i),
+                ['value%i' % j for j in xrange(i % 4)] if i % 3 == 0 else [])
+        eq_(table.values('key'), [])
+        eq_(table.values('key003', limit=1), ['value0'])
+    finally:
+        rmtree(folder)
+
+
+def test_empty_and_missing_tables():
+    folder = mkdtemp()
+    try:
+        write_sorted_table(join(folder, 'empty'), [])
+        eq_(SortedTable(join(folder, 'empty')).values('a'), [])
+        eq_(sorted_table(folder, 'missing'), None)
+    finally:
+        rmtree(folder)
@@ -0,0 +1,34 @@
+"""Tests for the parts of dxr.build that don't need a whole tree"""
+
+from nose.tools import eq_
+
+from dxr.build import is_ignored, size_ordered_chunks
+
+
+def test_biggest_first():
+    """Big files should come first, in chunks of about the same size, with
+    the small ones batched up at the end."""
+    sizes = [('small%s' % i, 10) for i in xrange(6)] + [('huge', 1000),
+                                                         ('big', 500)]
+    eq_(size_ordered_chunks(sizes, 2, min_bytes=0, chunks_per_worker=4),
+        [(['huge'], 1000),
+         (['big'], 500),
+         (['small0', 'small1', 'small2', 'small3', 'small4', 'small5'], 60)])
+
+
+def test_max_paths():
+    """Chunks should be cut off at max_paths, however small the files."""
+    sizes = [(str(i), 0) for i in xrange(5)]
+    eq_(size_ordered_chunks(sizes, 1, max_paths=2),
+        [(['0', '1'], 0), (['2', '3'], 0), (['4'], 0)])
+
+
+def test_is_ignored():
+    """Paths should be ignored by filename, by path, or by being in an
+    ignored folder, the same as unignored() would."""
+    eq_(is_ignored('src/foo.c', ['/obj/'], ['*.o']), False)
+    eq_(is_ignored('src/foo.o', ['/obj/'], ['*.o']), True)
+    eq_(is_ignored('obj/gen/foo.c', ['/obj/'], []), True)
+    eq_(is_ignored('.hg/foo.c', [], ['.hg']), True)
+    eq_(is_ignored('src/foo.c', ['/src/foo.c'], []), True)
+    eq_(is_ignored('src/foo.c', ['/src/foo.c/'], []), False)
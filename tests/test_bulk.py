@@ -0,0 +1,84 @@
+"""Tests for pipelined bulk indexing"""
+
+from threading import Lock
+from time import sleep
+
+from nose.tools import eq_, ok_, assert_raises
+
+from dxr.bulk import BulkSender
+
+
+class FakeElasticSearch(object):
+    """A stand-in for an ES connection which records bulk requests, taking
+    a set amount of time over each"""
+
+    def __init__(self, latency=0, fail=False):
+        self.latency = latency
+        self.fail = fail
+        self.chunks = []
+        self._lock = Lock()
+
+    def bulk(self, actions, index=None, doc_type=None):
+        sleep(self.latency)
+        if self.fail:
+            raise ValueError('ES is down.')
+        with self._lock:
+            self.chunks.append((index, doc_type, list(actions)))
+
+
+def test_everything_sent():
+    """Every doc should make it to ES exactly once, in whatever chunks."""
+    es = FakeElasticSearch()
+    sender = BulkSender(es, 'idx', 'line', senders=3, docs_per_chunk=7,
+                        min_docs_per_chunk=1)
+    ops = ['{"doc": %s}' % i for i in xrange(100)]
+    for op in ops:
+        sender.add(op)
+    sender.close()
+    eq_(sorted(op for _, _, chunk in es.chunks for op in chunk), sorted(ops))
+    eq_(set((index, doc_type) for index, doc_type, _ in es.chunks),
+        set([('idx', 'line')]))
+
+
+def test_adaptive_chunks():
+    """Chunks should grow while ES is quick and shrink when it's slow."""
+    sender = BulkSender(FakeElasticSearch(), 'idx', 'line',
+                        docs_per_chunk=100, target_latency=10)
+    for i in xrange(500):
+        sender.add('{}')
+    sender.close()
+    ok_(sender.docs_per_chunk > 100)
+
+    sender = BulkSender(FakeElasticSearch(latency=0.01), 'idx', 'line',
+                        senders=1, docs_per_chunk=100, min_docs_per_chunk=10,
+                        target_latency=0.001)
+    for i in xrange(500):
+        sender.add('{}')
+    sender.close()
+    eq_(sender.docs_per_chunk, 10)
+
+
+def test_errors_raised():
+    """A failed request should surface in the indexing worker."""
+    sender = BulkSender(FakeElasticSearch(fail=True), 'idx', 'line',
+                        docs_per_chunk=1)
+    sender.add('{}')
+    assert_raises(ValueError, sender.close)
+
+
+def test_exit_on_error():
+    """Leaving the sender on an exception should stop its threads without
+    masking the exception."""
+    es = FakeElasticSearch(latency=0.01)
+    try:
+        with BulkSender(es, 'idx', 'line', senders=2,
+                        docs_per_chunk=1) as sender:
+            for i in xrange(20):
+                sender.add('{}')
+            raise KeyError('indexing failed')
+    except KeyError:
+        pass
+    else:
+        raise AssertionError('The exception should have come through.')
+    ok_(not any(thread.is_alive() for thread in sender._threads))
+    ok_(len(es.chunks) < 20)
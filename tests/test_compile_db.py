@@ -0,0 +1,41 @@
+"""Tests for building from a compilation database"""
+
+from os import devnull, environ as os_environ
+
+from nose.tools import eq_
+
+from dxr.compile_db import by_cost, run, with_compiler
+
+
+def test_most_expensive_first():
+    """TUs should be ordered by last time's cost, with unknown ones first."""
+    commands = [('/obj', '/src/%s' % name, ['cc', name])
+                for name in ['small.c', 'new.c', 'huge.c', 'medium.c']]
+    costs = {'/src/small.c': 1.0, '/src/huge.c': 90.0, '/src/medium.c': 10.0}
+    eq_([path for _, path, _ in by_cost(commands, costs)],
+        ['/src/new.c', '/src/huge.c', '/src/medium.c', '/src/small.c'])
+
+
+def test_compiler_substitution():
+    """The compiler should be swapped for $CC or $CXX, as appropriate."""
+    environ = {'CC': 'clang -Xclang -foo', 'CXX': 'clang++ -Xclang -foo'}
+    eq_(with_compiler(['/usr/bin/gcc', '-c', 'a.c'], '/src/a.c', environ),
+        ['clang', '-Xclang', '-foo', '-c', 'a.c'])
+    eq_(with_compiler(['/usr/bin/gcc', '-c', 'a.cpp'], '/src/a.cpp', environ),
+        ['clang++', '-Xclang', '-foo', '-c', 'a.cpp'])
+    eq_(with_compiler(['g++', '-c', 'a.c'], '/src/a.c', environ),
+        ['clang++', '-Xclang', '-foo', '-c', 'a.c'])
+    eq_(with_compiler(['gcc', '-c', 'a.c'], '/src/a.c', {}),
+        ['gcc', '-c', 'a.c'])
+
+
+def test_run():
+    """Each command's return code should come back with its path."""
+    with open(devnull, 'w') as log:
+        results = run([('/', '/src/good.c', ['true']),
+                       ('/', '/src/bad.c', ['false'])],
+                      2,
+                      {'PATH': os_environ['PATH']},
+                      log)
+        eq_(sorted((path, code != 0) for path, _, code in results),
+            [('/src/bad.c', True), ('/src/good.c', False)])
@@ -0,0 +1,47 @@
+"""Tests for the compressed store of file contents"""
+
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr import content_store
+from dxr.content_store import ContentWriter, merge_content_pieces, stored_file
+
+
+def test_round_trip():
+    """Text, lines, rendering info, and binary data should come back out of
+    the store as they went in, across blocks and across packs."""
+    folder = mkdtemp()
+    old_block_size = content_store.BLOCK_SIZE
+    content_store.BLOCK_SIZE = 16  # so lines straddle blocks
+    try:
+        lines = [u'first line\n', u'\N{SNOWMAN} second\r\n', u'\n',
+                 u'last, without a newline']
+        render = [[2, [{'start': 0, 'end': 1, 'payload': {}}], [], []]]
+        with ContentWriter(folder) as writer:
+            writer.add_text('a/b.c', lines, render)
+            writer.add_text('empty', [])
+        with ContentWriter(folder) as writer:
+            writer.add_data('pic.png', '\x89PNG\0' * 10)
+        merge_content_pieces(folder)
+
+        stored = stored_file(folder, u'a/b.c')
+        eq_(stored.is_text, True)
+        eq_(stored.lines(), lines)
+        eq_(stored.lines(2, 3), lines[1:3])
+        eq_(stored.lines(4, 100), lines[3:])
+        eq_(stored.lines(5, 6), [])
+        eq_(stored.data(), u''.join(lines).encode('utf-8'))
+        eq_(stored.render(), {2: tuple(render[0][1:])})
+
+        eq_(stored_file(folder, u'empty').lines(), [])
+
+        stored = stored_file(folder, u'pic.png')
+        eq_(stored.is_text, False)
+        eq_(stored.data(), '\x89PNG\0' * 10)
+
+        eq_(stored_file(folder, u'nonexistent'), None)
+    finally:
+        content_store.BLOCK_SIZE = old_block_size
+        rmtree(folder)
@@ -0,0 +1,51 @@
+"""Tests for the include graph and its fan-out report"""
+
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_
+
+from dxr.include_graph import (fan_out, include_graph_tables, reachable,
+                               write_include_graph)
+
+
+EDGES = [('a.cpp', 'a.h'),
+         ('a.h', 'common.h'),
+         ('b.cpp', 'common.h'),
+         ('common.h', 'config.h'),
+         ('config.h', 'common.h')]  # a cycle, guarded by include guards
+
+
+def test_reachable():
+    """Walking either way should find everything transitively, cycles and
+    all, and should give up past the limit."""
+    folder = mkdtemp()
+    try:
+        write_include_graph(folder, EDGES)
+        includes, includers = include_graph_tables(folder)
+        eq_(reachable(includes, 'a.cpp'),
+            (set(['a.h', 'common.h', 'config.h']), False))
+        eq_(reachable(includers, 'config.h'),
+            (set(['common.h', 'config.h', 'a.h', 'a.cpp', 'b.cpp']), False))
+        eq_(reachable(includes, 'nonexistent.h'), (set(), False))
+        eq_(reachable(includes, 'a.cpp', limit=2)[1], True)
+    finally:
+        rmtree(folder)
+
+
+def test_fan_out():
+    """Headers should be charged for every TU that pulls them in."""
+    folder = mkdtemp()
+    try:
+        for name, size in [('a.h', 10), ('common.h', 100), ('config.h', 1)]:
+            with open(join(folder, name), 'w') as file:
+                file.write('x' * size)
+        stats = fan_out(EDGES, {'a.cpp': 5, 'b.cpp': 7}, folder)
+        eq_([(s['path'], s['tus'], s['bytes'], s['ms'], s['direct_includers'])
+             for s in stats],
+            [('common.h', 2, 200, 12, 3),
+             ('a.h', 1, 10, 5, 1),
+             ('config.h', 2, 2, 12, 1)])
+    finally:
+        rmtree(folder)
@@ -1,16 +1,20 @@
 """Tests for the machinery that takes offsets and markup bits from plugins and
 decorates source code with them to create HTML"""
 
+from random import Random
 from unittest import TestCase
 import warnings
 from warnings import catch_warnings
 
 from more_itertools import first
+from nose import SkipTest
 from nose.tools import eq_
 
+from dxr import lines as lines_module
 from dxr.lines import (line_boundaries, remove_overlapping_refs, Region, LINE,
                        Ref, balanced_tags, finished_tags, tag_boundaries,
-                       html_line, nesting_order, tags_per_line)
+                       html_line, html_lines, nesting_order, tags_per_line,
+                       es_lines, es_line_buckets)
 from dxr.utils import build_offset_map, split_content_lines
 
 
@@ -316,3 +320,55 @@ def test_unusual_whitespace():
              u"This is the last line\n"]
     eq_(split_content_lines(u''.join(lines)), lines)
 
+
+
+class SerializableRef(RefWithoutData):
+    """A RefWithoutData that can be turned into ES docs"""
+
+    plugin = 'dummy_plugin'
+    id = 'dummy_id'
+
+
+class NativeTests(TestCase):
+    """Make sure the native versions of the tag machinery match the Python
+    ones, output for output."""
+
+    def setUp(self):
+        if not lines_module._native:
+            raise SkipTest('dxr._lines is not built.')
+
+    def python_and_native(self, function, *args):
+        """Return what ``function`` returns with the Python implementation
+        and then with the native one."""
+        native = lines_module._native
+        lines_module._native = None
+        try:
+            python = list(function(*args))
+        finally:
+            lines_module._native = native
+        return python, list(function(*args))
+
+    def test_random(self):
+        """Throw lots of random refs and regions at both."""
+        rand = Random(1234)
+        text = u''.join(rand.choice(u'ab<&> \n') for _ in xrange(400))
+        lines = split_content_lines(text)
+        offsets = build_offset_map(lines)
+        for _ in xrange(50):
+            def spans(cls):
+                ret = []
+                for _ in xrange(rand.randint(0, 40)):
+                    start = rand.randint(-1, len(text))
+                    ret.append((start,
+                                start + rand.randint(-2, 30),
+                                cls(rand.choice('abc'))))
+                return ret
+            refs, regions = spans(SerializableRef), spans(Region)
+            with catch_warnings():
+                warnings.simplefilter('ignore')
+                python, native = self.python_and_native(
+                    finished_tags, lines, refs, regions)
+            eq_(python, native)
+            eq_(*self.python_and_native(es_lines, python))
+            eq_(*self.python_and_native(es_line_buckets, python))
+            eq_(*self.python_and_native(html_lines, lines, python, offsets))
@@ -0,0 +1,40 @@
+"""Tests for storing menu data once per menu"""
+
+from os import listdir
+from os.path import join
+from shutil import rmtree
+from tempfile import mkdtemp
+
+from nose.tools import eq_, ok_
+
+from dxr.artifacts import SortedTable
+from dxr.menu_table import (MENU_TABLE, intern_menus, merge_menu_pieces,
+                            write_menu_piece)
+
+
+def test_round_trip():
+    """Refs with the same menu data should share an ID, and the data should
+    come back out of the merged table by it."""
+    folder = mkdtemp()
+    try:
+        refs = [{'start': 0, 'end': 3,
+                 'payload': {'plugin': 'p', 'id': 'r', 'menu_data': data}}
+                for data in ['{"a": 1}', '{"b": 2}', '{"a": 1}']]
+        menus = {}
+        intern_menus(refs[:2], menus)
+        write_menu_piece(folder, menus)
+        eq_(menus, {})
+        intern_menus(refs[2:], menus)
+        write_menu_piece(folder, menus)
+        merge_menu_pieces(folder)
+
+        ids = [ref['payload']['menu_id'] for ref in refs]
+        eq_(ids[0], ids[2])
+        ok_(ids[0] != ids[1])
+        eq_(any('menu_data' in ref['payload'] for ref in refs), False)
+        eq_(listdir(folder), [MENU_TABLE])
+        table = SortedTable(join(folder, MENU_TABLE))
+        eq_(table.values(ids[0]), ['{"a": 1}'])
+        eq_(table.values(ids[1]), ['{"b": 2}'])
+    finally:
+        rmtree(folder)
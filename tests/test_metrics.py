@@ -0,0 +1,35 @@
+"""Tests for the web app's latency instrumentation"""
+
+from nose.tools import eq_
+
+from dxr.metrics import Metrics, percentile, query_type
+
+
+def test_percentile():
+    values = range(1, 101)
+    eq_(percentile(values, 0.5), 51)
+    eq_(percentile(values, 0.99), 99)
+    eq_(percentile(values, 1.0), 100)
+    eq_(percentile([7], 0.9), 7)
+
+
+def test_summary():
+    """Timings should be grouped by kind and phase, and only the latest
+    should count toward percentiles."""
+    metrics = Metrics(reservoir_size=2)
+    for seconds in [5.0, 0.001, 0.003]:
+        metrics.record('search:regexp', 'es', seconds)
+    metrics.record('search:regexp', 'total', 0.01)
+    summary = metrics.summary()
+    eq_(sorted(summary['search:regexp']), ['es', 'total'])
+    es = summary['search:regexp']['es']
+    eq_(es['count'], 3)
+    eq_(es['max_ms'], 3.0)
+    eq_(es['p50_ms'], 3.0)
+
+
+def test_query_type():
+    eq_(query_type([{'name': 'regexp'}, {'name': 'path'},
+                    {'name': 'regexp'}]),
+        'path+regexp')
+    eq_(query_type([]), 'empty')
@@ -8,6 +8,7 @@ from unittest import TestCase
 
 from nose.tools import eq_
 
+from dxr.filters import FILE, Filter, line_filter
 from dxr.query import fix_extents_overlap
 
 
@@ -49,3 +50,42 @@ class FixExtentsOverlapTests(TestCase):
         """Work even if the highlighting starts at offset 0."""
         eq_(list(fix_extents_overlap([(0, 3), (2, 5), (11, 14)])),
             [(0, 5), (11, 14)])
+
+
+class LineFilterTests(TestCase):
+    """Tests for line_filter()"""
+
+    def test_file_filters(self):
+        """FILE-domain filters should go through the lines' parents unless
+        their fields are on lines too."""
+        class ExtFilter(Filter):
+            domain = FILE
+
+            def filter(self):
+                return {'term': {'ext': 'cpp'}}
+
+        class PathFilter(ExtFilter):
+            on_lines = True
+
+            def filter(self):
+                return {'term': {'path': 'a.cpp'}}
+
+        eq_(line_filter(ExtFilter({}, [])),
+            {'has_parent': {'parent_type': FILE,
+                            'filter': {'term': {'ext': 'cpp'}}}})
+        eq_(line_filter(PathFilter({}, [])), {'term': {'path': 'a.cpp'}})
+
+    def test_line_filters(self):
+        """LINE-domain filters and punts should pass through untouched."""
+        class NumberFilter(Filter):
+            def filter(self):
+                return {'term': {'number': 3}}
+
+        class PuntFilter(Filter):
+            domain = FILE
+
+            def filter(self):
+                return None
+
+        eq_(line_filter(NumberFilter({}, [])), {'term': {'number': 3}})
+        eq_(line_filter(PuntFilter({}, [])), None)
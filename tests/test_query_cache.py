@@ -0,0 +1,69 @@
+"""Tests for the caches of parsed queries and search results"""
+
+from nose.tools import eq_
+
+from dxr import query_cache
+from dxr.query_cache import LruCache, ResultCache
+
+
+def test_lru():
+    """The least recently used entry should be forgotten first."""
+    cache = LruCache(2)
+    cache.set('a', 1)
+    cache.set('b', 2)
+    eq_(cache.get('a'), 1)  # Now b is the oldest.
+    cache.set('c', 3)
+    eq_(cache.get('b'), None)
+    eq_(cache.get('a'), 1)
+    eq_(cache.get('c'), 3)
+    eq_(len(cache), 2)
+
+
+def test_expiry():
+    """Entries past their max age should be misses."""
+    now = [1000.0]
+    old_time = query_cache.time
+    query_cache.time = lambda: now[0]
+    try:
+        cache = LruCache(10, max_age=60)
+        cache.set('a', 1)
+        now[0] += 59
+        eq_(cache.get('a'), 1)
+        now[0] += 2
+        eq_(cache.get('a'), None)
+    finally:
+        query_cache.time = old_time
+
+
+class FakeQuery(object):
+    """A Query that counts how many times it's asked"""
+
+    def __init__(self, terms):
+        self.terms = terms
+        self.asked = 0
+
+    def results(self, offset=0, limit=100):
+        self.asked += 1
+        return {'result_count': 1,
+                'results': iter([('icon', 'path', [(1, 'line')])])}
+
+    def direct_result(self):
+        self.asked += 1
+        return None
+
+
+def test_results():
+    """Results should be remembered per index, and a new index should throw
+    out the old one's."""
+    cache = ResultCache(10)
+    terms = [{'name': 'text', 'arg': 'hi', 'not': False}]
+    query = FakeQuery(terms)
+    for _ in xrange(2):
+        results = cache.wrap(query, 'tree', 'index1').results()
+        eq_(list(results['results']), [('icon', 'path', [(1, 'line')])])
+        eq_(cache.wrap(query, 'tree', 'index1').direct_result(), None)
+    eq_(query.asked, 2)
+
+    cache.wrap(query, 'tree', 'index2').results()
+    eq_(query.asked, 3)
+    eq_(len(cache), 1)
@@ -0,0 +1,107 @@
+"""Tests for the on-disk trigram index"""
+
+import re
+from shutil import rmtree
+from tempfile import mkdtemp
+from unittest import TestCase
+
+from nose import SkipTest
+from nose.tools import eq_
+
+from dxr import trigram_index
+from dxr.content_store import ContentWriter, merge_content_pieces
+from dxr.trigram_index import (TrigramWriter, decode, encode, intersect,
+                               mark_stale, matching_paths, merge_shards,
+                               shards)
+from dxr.trigrammer import NoTrigrams, SubstringTreeVisitor, regex_grammar
+
+
+def test_postings_round_trip():
+    numbers = [0, 1, 127, 128, 300, 16384, 2 ** 40]
+    eq_(decode(encode(numbers)), numbers)
+    eq_(decode(''), [])
+
+
+def test_intersect():
+    eq_(intersect([1, 3, 5, 7, 9], [0, 3, 4, 9, 10]), [3, 9])
+    eq_(intersect([], [1, 2]), [])
+
+
+class NativeTests(TestCase):
+    """Make sure the native decoder and intersecter match the Python ones."""
+
+    def setUp(self):
+        if not trigram_index._native:
+            raise SkipTest('dxr._postings is not built.')
+
+    def python_and_native(self, function, *args):
+        native = trigram_index._native
+        trigram_index._native = None
+        try:
+            python = function(*args)
+        finally:
+            trigram_index._native = native
+        return python, function(*args)
+
+    def test_decode(self):
+        eq_(*self.python_and_native(decode, encode(range(0, 100000, 7))))
+
+    def test_intersect(self):
+        eq_(*self.python_and_native(intersect,
+                                    range(0, 10000, 3),
+                                    range(0, 10000, 5) + [10001]))
+        eq_(*self.python_and_native(intersect, [5], range(1000)))
+
+
+def matches(folder, regex, flags=0):
+    parsed = regex_grammar.parse(regex)
+    return matching_paths(folder,
+                          SubstringTreeVisitor().visit(parsed).simplified(),
+                          re.compile(regex, flags))
+
+
+def test_matching_paths():
+    """Candidates should come out of the shards and be confirmed against the
+    content store. Stale files should always come out."""
+    folder = mkdtemp()
+    try:
+        files = {'one.c': [u'int main() {\n', u'    return 0;\n', u'}\n'],
+                 'two.c': [u'void Main(int x);\n'],
+                 'three.c': [u'maintain\n', u'int x\n'],
+                 'four.c': [u'int y;\r', u'mainly\r']}
+        with ContentWriter(folder) as content:
+            with TrigramWriter(folder) as trigrams:
+                for path, lines in sorted(files.items())[:2]:
+                    content.add_text(path, lines)
+                    trigrams.add(path, lines)
+            with TrigramWriter(folder) as trigrams:
+                for path, lines in sorted(files.items())[2:]:
+                    content.add_text(path, lines)
+                    trigrams.add(path, lines)
+        merge_content_pieces(folder)
+        eq_(len(shards(folder)), 2)
+
+        eq_(matches(folder, r'main\('), [u'one.c'])
+        eq_(matches(folder, r'main\(', re.I), [u'one.c', u'two.c'])
+        eq_(matches(folder, r'^main'), [u'four.c', u'three.c'])
+        eq_(matches(folder, r'(main|return)\('), [u'one.c'])
+        eq_(matches(folder, r'nothing here'), [])
+        try:
+            matches(folder, r'ma')
+        except NoTrigrams:
+            pass
+        else:
+            raise AssertionError('Short regexes should raise NoTrigrams.')
+
+        # Merging the shards shouldn't change any answers:
+        merge_shards(folder)
+        trigram_index._shards.clear()
+        eq_(len(shards(folder)), 1)
+        eq_(matches(folder, r'main\('), [u'one.c'])
+        eq_(matches(folder, r'main\(', re.I), [u'one.c', u'two.c'])
+        eq_(matches(folder, r'^main'), [u'four.c', u'three.c'])
+
+        mark_stale(folder, ['two.c'])
+        eq_(matches(folder, r'nothing here'), [u'two.c'])
+    finally:
+        rmtree(folder)